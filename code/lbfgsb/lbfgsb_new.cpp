@@ -498,6 +498,153 @@ void setulb(int n, int m, double *x, double *l, double *u, int *nbd,
 } /* setulb */
 
 
+int setulb_seed(int n, int m, double *s, double *y, int npair,
+		double *wa, int *iwa, int *lsave, int *isave, double *dsave)
+{
+	/*     ************
+
+	 Subroutine setulb_seed
+
+	 This subroutine puts correction pairs kept from a previous
+	 optimization into the limited memory BFGS matrix, so that the
+	 first iteration already uses their curvature. It is called
+	 after setulb has returned with 'FG_START' on 'START'.
+
+	 s and y are double precision arrays of dimension n x npair
+	 storing the steps and the changes of the gradient, oldest pair
+	 first. Pairs with s'y <= epsmch*s's are skipped, and only the
+	 last m of the others are kept.
+
+	 wa, iwa, lsave, isave and dsave are the working arrays passed
+	 to setulb. As all the variables are free before the first
+	 Cauchy point, the inner products kept in snd by formk are
+	 computed here for the full set, and the matrix is marked as
+	 updated so that formk adjusts them to the free variables on the
+	 first iteration.
+
+	 On exit the number of pairs used is returned. If the pairs do
+	 not give a positive definite middle matrix, 0 is returned and
+	 the memory is left empty.
+
+	 ************
+	 */
+
+	/* Local variables */
+	int i, j, k, col, info, *keep, *imain;
+	double *ws, *wy, *sy, *ss, *wt, *wn1, dr, rr, theta;
+
+	/* the arrays partitioned by setulb (1-based offsets in isave(4:11)) */
+	ws = &wa[isave[3] - 1];
+	wy = &wa[isave[4] - 1];
+	sy = &wa[isave[5] - 1];
+	ss = &wa[isave[6] - 1];
+	wt = &wa[isave[8] - 1];
+	wn1 = &wa[isave[10] - 1];
+	/* the saved variables of mainlb start at isave(22) */
+	imain = &isave[21];
+
+	keep = (int *) malloc((npair + 1) * sizeof(int));
+	col = 0;
+	for (k = 0; k < npair; ++k) {
+		dr = ddot(&n, &s[k * n], &c__1, &y[k * n], &c__1);
+		if (dr > DBL_EPSILON * ddot(&n, &s[k * n], &c__1, &s[k * n], &c__1)) {
+			keep[col++] = k;
+		}
+	}
+	if (col > m) {
+		for (k = 0; k < m; ++k) keep[k] = keep[col - m + k];
+		col = m;
+	}
+	if (col == 0) {
+		free(keep);
+		return 0;
+	}
+
+	/*     Store the pairs in WS and WY from column 1, and form */
+	/*      the lower triangle of SY and the upper triangle of SS. */
+	for (j = 0; j < col; ++j) {
+		dcopy(&n, &s[keep[j] * n], &c__1, &ws[j * n], &c__1);
+		dcopy(&n, &y[keep[j] * n], &c__1, &wy[j * n], &c__1);
+	}
+	for (j = 0; j < col; ++j) {
+		for (i = j; i < col; ++i) {
+			sy[i + j * m] = ddot(&n, &ws[i * n], &c__1, &wy[j * n], &c__1);
+		}
+		for (i = 0; i <= j; ++i) {
+			ss[i + j * m] = ddot(&n, &ws[i * n], &c__1, &ws[j * n], &c__1);
+		}
+	}
+	/*     Set theta=yy/ys from the newest pair. */
+	k = col - 1;
+	rr = ddot(&n, &wy[k * n], &c__1, &wy[k * n], &c__1);
+	theta = rr / sy[k + k * m];
+
+	formt(m, wt, sy, ss, &col, &theta, &info);
+	free(keep);
+	if (info != 0) {
+		return 0;
+	}
+
+	/*     Form the lower triangle of WN1 with all variables free: */
+	/*         [Y'Y     R'] */
+	/*         [R       0 ] */
+	/*      where R is the upper triangular part of S'Y. */
+	for (i = 0; i < 4 * m * m; ++i) wn1[i] = 0.;
+	for (j = 0; j < col; ++j) {
+		for (i = j; i < col; ++i) {
+			wn1[i + j * 2 * m] = ddot(&n, &wy[i * n], &c__1, &wy[j * n], &c__1);
+		}
+		for (i = 0; i <= j; ++i) {
+			wn1[m + i + j * 2 * m] = ddot(&n, &ws[i * n], &c__1, &wy[j * n], &c__1);
+		}
+	}
+	/*     All variables are free. */
+	for (i = 0; i < n; ++i) iwa[i] = i + 1;
+
+	/*     Save the variables read by mainlb on reentry. */
+	lsave[3] = 1;           /* updatd */
+	imain[5] = 1;           /* head */
+	imain[6] = col;         /* col */
+	imain[7] = col;         /* itail */
+	imain[8] = 1;           /* iter: count enter/leave from the free set above */
+	imain[9] = col;         /* iupdat */
+	imain[16] = n;          /* nfree */
+	dsave[0] = theta;
+	return col;
+} /* setulb_seed */
+
+
+int setulb_pairs(int n, int m, double *wa, int *isave, double *s, double *y)
+{
+	/*     ************
+
+	 Subroutine setulb_pairs
+
+	 This subroutine copies the correction pairs of the limited memory
+	 BFGS matrix after a run of setulb into s and y, which are double
+	 precision arrays of dimension n x m, oldest pair first, and
+	 returns the number of pairs.
+
+	 ************
+	 */
+
+	int k, pointr, col, head;
+	double *ws, *wy;
+
+	ws = &wa[isave[3] - 1];
+	wy = &wa[isave[4] - 1];
+	head = isave[26];
+	col = isave[27];
+	pointr = head;
+	for (k = 0; k < col; ++k) {
+		dcopy(&n, &ws[(pointr - 1) * n], &c__1, &s[k * n], &c__1);
+		dcopy(&n, &wy[(pointr - 1) * n], &c__1, &y[k * n], &c__1);
+		pointr = pointr % m + 1;
+	}
+	return col;
+} /* setulb_pairs */
+
+
 void mainlb(int n, int m, double *x,
 		double *l, double *u, int *nbd, double *f, double *g,
 		double factr, double *pgtol, double *ws, double * wy,
@@ -104,6 +104,14 @@ void setulb(int n, int m, double *x, double *l, double *u, int *nbd,
 		double *wa, int * iwa, char *task, int iprint,
 		int *lsave, int *isave, double *dsave);
 
+// Put correction pairs s, y (n x npair, oldest first) of a previous optimization into the memory of setulb
+// Called after the first return of setulb ('FG_START'); returns the number of pairs used
+int setulb_seed(int n, int m, double *s, double *y, int npair,
+		double *wa, int *iwa, int *lsave, int *isave, double *dsave);
+
+// Copy the correction pairs in the memory of setulb to s, y (n x m, oldest first); returns the number of pairs
+int setulb_pairs(int n, int m, double *wa, int *isave, double *s, double *y);
+
 void mainlb(int n, int m, double *x,
 		double *l, double *u, int *nbd, double *f, double *g,
 		double factr, double *pgtol, double *ws, double * wy,
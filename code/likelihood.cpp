@@ -1,11 +1,30 @@
 #include "likelihood.hpp"
 
 
-void initialize_lnl_table(vector<vector<double>>& L_sk_k, const vector<int>& obs, const evo_tree& rtree, int model, int nstate, int is_total){
+// The site kernels are compiled for AVX-512, AVX2 and the baseline instruction set, and the version for the CPU is chosen when the program is loaded
+// Multiplications and additions are not contracted into FMA, so the likelihoods are the same on all CPUs
+// The clones are only built when the compiler supports the target_clones and optimize attributes on x86-64 with glibc (which resolves the version at load time),
+// so other compilers and targets build the baseline version without any flag. NO_KERNEL_CLONES can still be defined to build only the baseline version
+// The kernels are vectorized over the states of the parent node rather than over site patterns, as a pattern-major layout does not fit the data:
+// the tips of each pattern have their own nonzero states (see get_prob_tip), each pattern is rescaled on its own, and the tables of a pattern are
+// kept together in LNL_PASS for the gradient, edge and sparse kernels and for splitting the patterns among OpenMP threads
+#ifdef __has_attribute
+#if __has_attribute(target_clones) && __has_attribute(optimize) && defined(__x86_64__) && defined(__GLIBC__) && !defined(__INTEL_COMPILER) && !defined(NO_KERNEL_CLONES)
+#define KERNEL_CLONES __attribute__((target_clones("avx512f", "avx2", "default"), optimize("fp-contract=off")))
+#define KERNEL_INLINE inline __attribute__((always_inline))
+#endif
+#endif
+#ifndef KERNEL_CLONES
+#define KERNEL_CLONES
+#define KERNEL_INLINE inline
+#endif
+
+
+void initialize_lnl_table(double* L_sk_k, const vector<int>& obs, const evo_tree& rtree, int model, int nstate, int is_total){
     // int debug = 0;
-    // construct a table for each state of each node
-    // int ntotn = 2 * rtree.nleaf - 1;
-    // vector<vector<double>> L_sk_k(ntotn, vector<double>(nstate, 0));
+    // clear the table for each state of each node, which may hold values of a previous site
+    int ntotn = 2 * rtree.nleaf - 1;
+    fill(L_sk_k, L_sk_k + ntotn * nstate, 0.0);
 
     int Ns = rtree.nleaf - 1;
     if(model > 1){
@@ -16,22 +35,22 @@ void initialize_lnl_table(vector<vector<double>>& L_sk_k, const vector<int>& obs
                 int si = (obs[i] * (obs[i] + 1))/2;
                 int ei = si + obs[i];
                 for(int k = si; k <= ei; k++){
-                    L_sk_k[i][k] = 1.0;
+                    L_sk_k[i * nstate + k] = 1.0;
                 }
             }else{ // With allele-specific copy number, only the specific site needs to be filled
-                L_sk_k[i][obs[i]] = 1.0;
+                L_sk_k[i * nstate + obs[i]] = 1.0;
             }
         }
         // set unaltered 1/1
-        L_sk_k[Ns][4] = 1.0;
+        L_sk_k[Ns * nstate + 4] = 1.0;
     }else{
         for(int i = 0; i < Ns; ++i){
           for(int j = 0; j < nstate; ++j){
-    	         if(j == obs[i]) L_sk_k[i][j] = 1.0;
+    	         if(j == obs[i]) L_sk_k[i * nstate + j] = 1.0;
           }
         }
         // set unaltered
-        L_sk_k[Ns][2] = 1.0;
+        L_sk_k[Ns * nstate + 2] = 1.0;
     }
 
     // if(debug){
@@ -43,7 +62,7 @@ void initialize_lnl_table(vector<vector<double>>& L_sk_k, const vector<int>& obs
     //   cout << "\nLikelihood for tips:\n";
     //   for(int i = 0; i < rtree.nleaf; ++i){
     //       for(int j = 0; j < nstate; ++j){
-    //         cout << "\t" << L_sk_k[i][j];
+    //         cout << "\t" << L_sk_k[i * nstate + j];
     //       }
     //       cout << endl;
     //   }
@@ -53,18 +72,86 @@ void initialize_lnl_table(vector<vector<double>>& L_sk_k, const vector<int>& obs
 
 
 
+void get_tip_lnl_decomp(double* L_tip, int cn, int num_wgd, int num_change, const OBS_DECOMP& obs_decomp, const set<vector<int>>& comps){
+    int debug = 0;
+    int nstate = comps.size();
+    fill(L_tip, L_tip + nstate, 0.0);
+
+    // Fill all the possible state combinations
+    int k = -1;
+    for (auto& c : comps){
+        k++;
+        if(debug){
+            cout << "\tcn vector:";
+            for(int k = 0; k < c.size(); k++){
+                cout << "\t" << c[k];
+            }
+            cout << endl;
+        }
+        int alpha = c[0];  // wgd component
+        // If a sample has one WGD event, the correponding component must be the same
+        if(num_wgd >= 0 && alpha != num_wgd) continue;
+
+        // WGD may occur before, at least one chromosome gain before or after WGD
+        if(num_change >= 1 && (c[1] <= 0 && c[3] <= 0)){
+            if(debug) cout << "\t\tpotential chromosome gain is " << num_change << endl;
+            continue;
+        }
+        if(num_change <= -1 && (c[1] >= 0 && c[3] >= 0)){
+            if(debug) cout << "\t\tpotential chromosome loss is " << num_change << endl;
+            continue;
+        }
+        // assuming m_max >= 1. It is likely that all copies of a segment is lost before chromosome gain/loss
+        for(int m1 = 0; m1 <= obs_decomp.m_max && L_tip[k] == 0; m1++){
+            for(int m2 = 0; m2 <= obs_decomp.m_max; m2++){
+                int sum = (2 << alpha) + m1 * c[1] + c[2] + 2 * m2 * c[3] + 2 * c[4];
+                if(sum == cn){
+                    if(debug) cout << "\t\tfilling 1 here" << endl;
+                    L_tip[k] = 1.0;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+
+void build_tip_lnl_decomp(OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, int infer_wgd, int infer_chr, int cn_max){
+    int nstate = comps.size();
+    obs_decomp.tip_comps = NULL;
+    obs_decomp.tip_lnl.clear();
+
+    vector<int> wgd_values{-1};
+    if(infer_wgd){
+        wgd_values.clear();
+        for(int num_wgd = 0; num_wgd <= obs_decomp.max_wgd; num_wgd++) wgd_values.push_back(num_wgd);
+    }
+    int max_change = infer_chr ? 1 : 0;
+
+    for(int cn = 0; cn <= cn_max; cn++){
+        for(auto num_wgd : wgd_values){
+            for(int num_change = -max_change; num_change <= max_change; num_change++){
+                vector<double> L_tip(nstate, 0.0);
+                get_tip_lnl_decomp(L_tip.data(), cn, num_wgd, num_change, obs_decomp, comps);
+                obs_decomp.tip_lnl[vector<int>{cn, num_wgd, num_change}] = L_tip;
+            }
+        }
+    }
+    obs_decomp.tip_comps = &comps;
+}
+
+
 // L_sk_k has one row for each tree node and one column for each possible state; chr starting from 1
 // This function is critical in obtaining correct likelihood. If one tip is not initialized, the final likelihood will be 0.
-vector<vector<double>> initialize_lnl_table_decomp(vector<int>& obs, OBS_DECOMP& obs_decomp, int chr, const evo_tree& rtree, const set<vector<int>>& comps, int infer_wgd, int infer_chr, int cn_max, int is_total){
+void initialize_lnl_table_decomp(double* L_sk_k, vector<int>& obs, OBS_DECOMP& obs_decomp, int chr, const evo_tree& rtree, const set<vector<int>>& comps, int infer_wgd, int infer_chr, int cn_max, int is_total){
     int debug = 0;
-    // construct a table for each state of each node
+    // clear the table for each state of each node, which may hold values of a previous site
     int ntotn = 2 * rtree.nleaf - 1;
     int nstate = comps.size();
-    vector<vector<double>> L_sk_k(ntotn, vector<double>(nstate, 0));
+    fill(L_sk_k, L_sk_k + ntotn * nstate, 0.0);
 
     for(int i = 0; i < rtree.nleaf - 1; ++i){
         // For total copy number, all the possible combinations have to be considered.
-        // Set related allele specific cases to be 1, with index from obs[i] * (obs[i] + 1)/2 to obs[i] * (obs[i] + 1)/2 + obs[i]. The index is computed based on pre-specified order.
         int cn = obs[i];
         int num_change = 0;
         if(infer_chr && chr > 0){
@@ -73,72 +160,35 @@ vector<vector<double>> initialize_lnl_table_decomp(vector<int>& obs, OBS_DECOMP&
         if(!is_total){    // changing input allel-specific copy number to total
             cn = state_to_total_cn(obs[i], cn_max);
         }
+        int num_wgd = infer_wgd ? obs_decomp.obs_num_wgd[i] : -1;
         if(debug) cout << "\nStart filling likelihood table for sample "  << i + 1 << " chromosome " << chr  << " copy number " << cn << endl;
-        // Fill all the possible state combinations
-        int k = 0;
-        for (auto c : comps){
-            if(debug){
-                cout << "\tcn vector:";
-                for(int k = 0; k < c.size(); k++){
-                    cout << "\t" << c[k];
-                }
-                cout << endl;
-            }
-            int alpha = c[0];  // wgd component
-            // If a sample has one WGD event, the correponding component must be the same
-            if(infer_wgd && alpha != obs_decomp.obs_num_wgd[i]) continue;
-
-            // WGD may occur before, at least one chromosome gain before or after WGD
-            if(num_change >= 1 && (c[1] <= 0 && c[3] <= 0)){
-                if(debug){
-                    cout << "\t\tpotential chromosome gain in sample "  << i + 1 << " chromosome " << chr << " is " << num_change << endl;
-                }
-                continue;
-            }
-            if(num_change <= -1 && (c[1] >= 0 && c[3] >= 0)){
-                if(debug){
-                    cout << "\t\tpotential chromosome loss in sample "  << i + 1 << " chromosome " << chr << " is " << num_change << endl;
-                }
-                continue;
-            }
-            // int sum = pow(2, alpha + 1) + c[5] * c[1] + c[2] + 2 * c[6] * c[3] + 2 * c[4];
-            // if(sum == cn){
-            //     if(debug) cout << "\t\tfilling 1 here" << endl;
-            //     L_sk_k[i][k] = 1.0;
-            // }
-            // assuming m_max >= 1. It is likely that all copies of a segment is lost before chromosome gain/loss
-            for(int m1 = 0; m1 <= obs_decomp.m_max; m1++){
-                for(int m2 = 0; m2 <= obs_decomp.m_max; m2++){
-                    int sum = pow(2, alpha + 1) + m1 * c[1] + c[2] + 2 * m2 * c[3] + 2 * c[4];
-                    if(sum == cn){
-                        if(debug) cout << "\t\tfilling 1 here" << endl;
-                        L_sk_k[i][k] = 1.0;
-                    }
-                }
-            }
-            k++;
+
+        double* L_tip = L_sk_k + i * nstate;
+        map<vector<int>, vector<double>>::const_iterator it = obs_decomp.tip_lnl.end();
+        if(obs_decomp.tip_comps == &comps){
+            // only the sign of the number of chr-level events is used
+            it = obs_decomp.tip_lnl.find(vector<int>{cn, num_wgd, (num_change > 0) - (num_change < 0)});
         }
-        // each row should have one entry being 1
-        int sum = 0;
-        for(int j = 0; j < L_sk_k[i].size(); j++){
-            sum += L_sk_k[i][j];
+        if(it != obs_decomp.tip_lnl.end()){
+            copy(it->second.begin(), it->second.end(), L_tip);
+        }else{
+            get_tip_lnl_decomp(L_tip, cn, num_wgd, num_change, obs_decomp, comps);
         }
-        if(sum < 1){
+
+        // each row should have one entry being 1
+        if(all_of(L_tip, L_tip + nstate, [](double x) { return x == 0; })){
             cout << "Error in filling table for copy number " << cn << " in sample " << i + 1 << " chromosome " << chr << endl << endl;
         }
     }
     // set likelihood for normal sample
-    // Fill all the possible state combinations
-    for (int j = 0; j < comps.size(); j++){
-        int k = 0;
-        for (auto v : comps){
-            bool zeros = all_of(v.begin(), v.end(), [](int i) { return i == 0; });
-            if(zeros){
-                L_sk_k[rtree.nleaf - 1][k] = 1.0;
-                break;
-            }
-            k++;
+    int k = 0;
+    for (auto& v : comps){
+        bool zeros = all_of(v.begin(), v.end(), [](int i) { return i == 0; });
+        if(zeros){
+            L_sk_k[(rtree.nleaf - 1) * nstate + k] = 1.0;
+            break;
         }
+        k++;
     }
 
     if(debug){
@@ -150,17 +200,16 @@ vector<vector<double>> initialize_lnl_table_decomp(vector<int>& obs, OBS_DECOMP&
       cout << "\nLikelihood for tips:\n";
       for(int i = 0; i < rtree.nleaf; ++i){
           for(int j = 0; j < nstate; ++j){
-            cout << "\t" << L_sk_k[i][j];
+            cout << "\t" << L_sk_k[i * nstate + j];
           }
           cout << endl;
       }
     }
-    return L_sk_k;
 }
 
 
 // Assume the likelihood table is for each allele-specific copy number
-double get_prob_children_decomp(vector<vector<double>>& L_sk_k, const evo_tree& rtree, map<int, set<vector<int>>>& decomp_table, int sk, int cn_max, int nstate, PROB_DECOMP& prob_decomp, DIM_DECOMP& dim_decomp, int ni, int nj, int bli, int blj, int is_total){
+double get_prob_children_decomp(const double* L_sk_k, const evo_tree& rtree, map<int, set<vector<int>>>& decomp_table, int sk, int cn_max, int nstate, PROB_DECOMP& prob_decomp, DIM_DECOMP& dim_decomp, int ni, int nj, int bli, int blj, int is_total){
     int debug = 0;
     int s_wgd, s_chr, s_seg;
     int e_wgd, e_chr, e_seg;
@@ -186,7 +235,7 @@ double get_prob_children_decomp(vector<vector<double>>& L_sk_k, const evo_tree&
                 double prob_wgd = prob_decomp.pbli_wgd[s_wgd + e_wgd * dim_decomp.dim_wgd];
                 double prob_chr = prob_decomp.pbli_chr[s_chr + e_chr * dim_decomp.dim_chr];
                 double prob_seg = prob_decomp.pbli_seg[s_seg + e_seg * dim_decomp.dim_seg];
-                double prob = prob_wgd * prob_chr * prob_seg * L_sk_k[ni][si];
+                double prob = prob_wgd * prob_chr * prob_seg * L_sk_k[ni * nstate + si];
                 Li += prob;
                 if(debug) cout << prob_wgd << "\t" << prob_chr << "\t" << prob_seg << "\t" << prob << "\n";
             }
@@ -213,7 +262,7 @@ double get_prob_children_decomp(vector<vector<double>>& L_sk_k, const evo_tree&
                 double prob_wgd = prob_decomp.pblj_wgd[s_wgd + e_wgd * dim_decomp.dim_wgd];
                 double prob_chr = prob_decomp.pblj_chr[s_chr + e_chr * dim_decomp.dim_chr];
                 double prob_seg = prob_decomp.pblj_seg[s_seg + e_seg * dim_decomp.dim_seg];
-                double prob = prob_wgd * prob_chr * prob_seg * L_sk_k[nj][sj];
+                double prob = prob_wgd * prob_chr * prob_seg * L_sk_k[nj * nstate + sj];
                 Lj += prob;
                 if(debug) cout << prob_wgd << "\t" << prob_chr << "\t" << prob_seg << "\t" << prob << "\n";
             }
@@ -225,7 +274,7 @@ double get_prob_children_decomp(vector<vector<double>>& L_sk_k, const evo_tree&
 }
 
 // Assume the likelihood table is for each combination of states
-double get_prob_children_decomp2(vector<vector<double>>& L_sk_k, const evo_tree& rtree, const set<vector<int>>& comps, int sk, int cn_max, int nstate, PROB_DECOMP& prob_decomp, DIM_DECOMP& dim_decomp, int ni, int nj, int bli, int blj, int is_total){
+double get_prob_children_decomp2(const double* L_sk_k, const evo_tree& rtree, const set<vector<int>>& comps, int sk, int cn_max, int nstate, PROB_DECOMP& prob_decomp, DIM_DECOMP& dim_decomp, int ni, int nj, int bli, int blj, int is_total){
     int debug = 0;
     int s_wgd, s_chr, s_seg, s_chr2, s_seg2;
     int e_wgd, e_chr, e_seg, e_chr2, e_seg2;
@@ -267,7 +316,7 @@ double get_prob_children_decomp2(vector<vector<double>>& L_sk_k, const evo_tree&
         prob_seg2 = 1;
         prob_chr_all = 1;
         prob_seg_all = 1;
-        if(L_sk_k[ni][si] > 0){
+        if(L_sk_k[ni * nstate + si] > 0){
             e_wgd = e[0];
             e_chr = e[1];
             e_seg = e[2];
@@ -284,7 +333,7 @@ double get_prob_children_decomp2(vector<vector<double>>& L_sk_k, const evo_tree&
                 prob_seg2 = prob_decomp.pbli_seg[(s_seg2 + delta_seg) + (e_seg2 + delta_seg) * dim_seg];
                 prob_seg_all = prob_seg * prob_seg2;
             }
-            prob = prob_wgd * prob_chr_all * prob_seg_all * L_sk_k[ni][si];
+            prob = prob_wgd * prob_chr_all * prob_seg_all * L_sk_k[ni * nstate + si];
             if(debug){
                 cout << "End state " << si << "\t" << e_wgd << "\t" << e_chr << "\t" << e_seg << "\t" << e_chr2 << "\t" << e_seg2 << "\n";
                 cout << "Prob for each event " << "\t" << prob_wgd << "\t" << prob_chr << "\t" << prob_seg << "\t" << prob_chr2 << "\t" << prob_seg2 << "\t" << prob << "\n";
@@ -306,7 +355,7 @@ double get_prob_children_decomp2(vector<vector<double>>& L_sk_k, const evo_tree&
         prob_seg2 = 1;
         prob_chr_all = 1;
         prob_seg_all = 1;
-        if(L_sk_k[nj][sj] > 0){
+        if(L_sk_k[nj * nstate + sj] > 0){
             e_wgd = e[0];
             e_chr = e[1];
             e_seg = e[2];
@@ -323,7 +372,7 @@ double get_prob_children_decomp2(vector<vector<double>>& L_sk_k, const evo_tree&
                 prob_seg2 = prob_decomp.pblj_seg[(s_seg2 + delta_seg) + (e_seg2 + delta_seg) * dim_seg];
                 prob_seg_all = prob_seg * prob_seg2;
             }
-            prob = prob_wgd * prob_chr_all * prob_seg_all * L_sk_k[nj][sj];
+            prob = prob_wgd * prob_chr_all * prob_seg_all * L_sk_k[nj * nstate + sj];
             if(debug){
                 cout << "End state " << sj << "\t" << e_wgd << "\t" << e_chr << "\t" << e_seg << "\t" << e_chr2 << "\t" << e_seg2 << "\n";
                 cout << prob_wgd << "\t" << prob_chr << "\t" << prob_seg << "\t" << prob_chr2 << "\t" << prob_seg2 << "\t" << prob << "\n";
@@ -339,188 +388,490 @@ double get_prob_children_decomp2(vector<vector<double>>& L_sk_k, const evo_tree&
 
 
 
-// Get the likelihood on one site of a chromosome (assuming higher level events on nodes)
-// z: possible changes in copy number caused by chromosome gain/loss
-void get_likelihood_site(vector<vector<double>>& L_sk_k, const evo_tree& rtree, const vector<int>& knodes, const vector<double>& blens, const vector<double*>& pmat_per_blen, const int& has_wgd, const int& z, const int& model, const int& nstate){
-  int debug = 0;
-  if(debug){
-      cout << "Computing likelihood for one site" << endl;
-  }
+// Multiply P-matrix pmat (column major) by the partial likelihoods L_c of a child, for all the states of the parent
+// The loop over parent states is innermost and contiguous, so it is vectorized, while each sum still adds up the child states in order
+// NS: number of states known at compile time, or 0 to use nstate
+// T: double, or float in single precision
+template <int NS, typename T>
+KERNEL_INLINE void get_prob_child(const T* pmat, const T* L_c, int nstate, T* prob){
+    const int n = NS > 0 ? NS : nstate;
+    for(int s = 0; s < n; ++s){
+        prob[s] = 0;
+    }
+    for(int y = 0; y < n; ++y){
+        // L_c >= 0, and all the children are 0 for some states after WGD or chromosome changes
+        T ly = L_c[y];
+        if(ly == 0) continue;
+        const T* p = pmat + y * n;
+        for(int s = 0; s < n; ++s){
+            prob[s] += p[s] * ly;
+        }
+    }
+}
 
-  for(int kn = 0; kn < knodes.size(); ++kn){
-    int k = knodes[kn];
-    int ni = rtree.edges[rtree.nodes[k].e_ot[0]].end;
-    double bli = rtree.edges[rtree.nodes[k].e_ot[0]].length;
-    int nj = rtree.edges[rtree.nodes[k].e_ot[1]].end;
-    double blj = rtree.edges[rtree.nodes[k].e_ot[1]].length;
 
-    // find index of bli and blj in blens
-    auto pi = std::equal_range(blens.begin(), blens.end(), bli);
-    // assert(distance(pi.first, pi.second) == 1);
-    int idx_bli = std::distance(blens.begin(), pi.first);
+// The same for a tip, only gathering the columns of pmat for the nnz states with nonzero likelihood in states, in increasing order as in get_prob_child
+// A tip has one such state for allele-specific copy numbers and obs + 1 for total copy numbers, so most of the columns are skipped without being checked
+template <int NS, typename T>
+KERNEL_INLINE void get_prob_tip(const T* pmat, const T* L_c, const int* states, int nnz, int nstate, T* prob){
+    const int n = NS > 0 ? NS : nstate;
+    for(int s = 0; s < n; ++s){
+        prob[s] = 0;
+    }
+    for(int j = 0; j < nnz; ++j){
+        int y = states[j];
+        T ly = L_c[y];
+        const T* p = pmat + y * n;
+        for(int s = 0; s < n; ++s){
+            prob[s] += p[s] * ly;
+        }
+    }
+}
+
+
+// The same for a child in the Mk model, where P(t) has p_same = pmat[0] on the diagonal and p_diff = pmat[1] off it, so each state of the parent takes O(1) time
+template <int NS, typename T>
+KERNEL_INLINE void get_prob_child_mk(const T* pmat, const T* L_c, int nstate, T* prob){
+    const int n = NS > 0 ? NS : nstate;
+    T p_same = pmat[0];
+    T p_diff = pmat[1];
+    T sum_L = 0;
+    for(int y = 0; y < n; ++y){
+        sum_L += L_c[y];
+    }
+    for(int s = 0; s < n; ++s){
+        prob[s] = p_diff * sum_L + (p_same - p_diff) * L_c[s];
+    }
+}
+
 
-    auto pj = std::equal_range(blens.begin(), blens.end(), blj);
-    // assert(distance(pj.first, pj.second) == 1);
-    int idx_blj = std::distance(blens.begin(), pj.first);
+// inlined into get_likelihood_site_fused, so that it is compiled for each instruction set
+template <int NS, typename T>
+KERNEL_INLINE void get_likelihood_site_fused_ns(T* L_sk_k, const evo_tree& rtree, const vector<int>& knodes, const vector<int>& blen_per_edge, const vector<T*>& pmat_per_blen, const vector<int>& variants, const int* tip_start, const int* tip_states, int model, int nstate, int* nscale_k, T* v_tip){
+  const int n = NS > 0 ? NS : nstate;
+  int ntotn = 2 * rtree.nleaf - 1;
+  int nvariant = variants.size();
+  int nk = knodes.size();
+  int root_state = 2;
+  if(model == BOUNDA) root_state = 4;
+  // v_tip holds the products of the tips, followed by those of the internal children
+  T* v_child = v_tip + 2 * n;
 
-    double* pbli = pmat_per_blen[idx_bli];
-    double* pblj = pmat_per_blen[idx_blj];
+  for(int kn = 0; kn < nk; ++kn){
+    int k = knodes[kn];
+    int nc[2];
+    const T* pbl[2];
+    for(int i = 0; i < 2; i++){
+        int eid = rtree.nodes[k].e_ot[i];
+        nc[i] = rtree.edges[eid].end;
+        pbl[i] = pmat_per_blen[blen_per_edge[eid]];
+
+        // the tips are the same in all the variants
+        if(nc[i] < rtree.nleaf && model == MK){
+            get_prob_child_mk<NS>(pbl[i], L_sk_k + nc[i] * n, n, v_tip + i * n);
+        }else if(nc[i] < rtree.nleaf){
+            int nnz = tip_start[nc[i] + 1] - tip_start[nc[i]];
+            get_prob_tip<NS>(pbl[i], L_sk_k + nc[i] * n, tip_states + tip_start[nc[i]], nnz, n, v_tip + i * n);
+        }
+    }
 
-    if(debug){
-      cout << "node:" << rtree.nodes[k].id + 1 << " -> " << ni + 1 << " , " << bli << "\t" <<  nj + 1 << " , " << blj << endl;
-      cout << "Get Pmatrix for branch length " << bli << "\t" << blens[idx_bli] << endl;
-      r8mat_print(nstate, nstate, pmat_per_blen[idx_bli], "  P matrix:");
-      cout << "Get Pmatrix for branch length " << blj << "\t" << blens[idx_blj] << endl;
-      r8mat_print(nstate, nstate, pmat_per_blen[idx_blj], "  P matrix:");
-    }
-
-    //loop over possible values of sk
-    if(k == rtree.nleaf){    // root node is always normal
-        if(debug) cout << "Getting likelihood for root node " << k << endl;
-        int nsk = 2;
-        if(model == BOUNDA) nsk = 4;
-        L_sk_k[k][nsk] = get_prob_children(L_sk_k, rtree, pbli, pblj, nsk, ni, nj, bli, blj, model, nstate);
-    }else{
-        for(int sk = 0; sk < nstate; ++sk){
-            int nsk = sk;  // state after changes by other large scale events
-            if(has_wgd) nsk = 2 * sk;
-            nsk += z;
-            if(debug) cout << "likelihood for state " << nsk << endl;
-            if(nsk < 0 || nsk >= nstate) continue;
-            // cout << " getting likelihood of children nodes " << endl;
-            L_sk_k[k][nsk] = get_prob_children(L_sk_k, rtree, pbli, pblj, nsk, ni, nj, bli, blj, model, nstate);
+    for(int v = 0; v < nvariant; ++v){
+        T* L_v = L_sk_k + (size_t) v * ntotn * n;
+        int has_wgd = variants[v] / 3;
+        int z = variants[v] % 3 - 1;
+
+        const T* prob[2];
+        for(int i = 0; i < 2; i++){
+            if(nc[i] < rtree.nleaf){
+                prob[i] = v_tip + i * n;
+            }else if(model == MK){
+                get_prob_child_mk<NS>(pbl[i], L_v + nc[i] * n, n, v_child + i * n);
+                prob[i] = v_child + i * n;
+            }else{
+                get_prob_child<NS>(pbl[i], L_v + nc[i] * n, n, v_child + i * n);
+                prob[i] = v_child + i * n;
+            }
+        }
+
+        T* L_k = L_v + k * n;
+        if(k == rtree.nleaf){    // root node is always normal
+            L_k[root_state] = prob[0][root_state] * prob[1][root_state];
+        }else{
+            for(int sk = 0; sk < n; ++sk){
+                int nsk = sk;  // state after changes by other large scale events
+                if(has_wgd) nsk = 2 * sk;
+                nsk += z;
+                if(nsk < 0 || nsk >= n) continue;
+                L_k[nsk] = prob[0][nsk] * prob[1][nsk];
+            }
         }
+        nscale_k[v * nk + kn] = scale_lnl_row(L_k, n);
     }
   }
-  if(debug){
-    print_tree_lnl(rtree, L_sk_k, nstate);
+}
+
+
+// shared by the versions in double and single precision
+template <typename T>
+KERNEL_INLINE void get_likelihood_site_fused_real(T* L_sk_k, const evo_tree& rtree, const vector<int>& knodes, const vector<int>& blen_per_edge, const vector<T*>& pmat_per_blen, const vector<int>& variants, const int* tip_start, const int* tip_states, int model, int nstate, int* nscale_k, T* v_tip){
+  // kernels for the number of states with cn_max = 4, 5, 6, 8, for total (model BOUNDT) and allele-specific (model BOUNDA) copy numbers
+  switch(nstate){
+      case 5: get_likelihood_site_fused_ns<5, T>(L_sk_k, rtree, knodes, blen_per_edge, pmat_per_blen, variants, tip_start, tip_states, model, nstate, nscale_k, v_tip); break;
+      case 6: get_likelihood_site_fused_ns<6, T>(L_sk_k, rtree, knodes, blen_per_edge, pmat_per_blen, variants, tip_start, tip_states, model, nstate, nscale_k, v_tip); break;
+      case 7: get_likelihood_site_fused_ns<7, T>(L_sk_k, rtree, knodes, blen_per_edge, pmat_per_blen, variants, tip_start, tip_states, model, nstate, nscale_k, v_tip); break;
+      case 9: get_likelihood_site_fused_ns<9, T>(L_sk_k, rtree, knodes, blen_per_edge, pmat_per_blen, variants, tip_start, tip_states, model, nstate, nscale_k, v_tip); break;
+      case 15: get_likelihood_site_fused_ns<15, T>(L_sk_k, rtree, knodes, blen_per_edge, pmat_per_blen, variants, tip_start, tip_states, model, nstate, nscale_k, v_tip); break;
+      case 21: get_likelihood_site_fused_ns<21, T>(L_sk_k, rtree, knodes, blen_per_edge, pmat_per_blen, variants, tip_start, tip_states, model, nstate, nscale_k, v_tip); break;
+      case 28: get_likelihood_site_fused_ns<28, T>(L_sk_k, rtree, knodes, blen_per_edge, pmat_per_blen, variants, tip_start, tip_states, model, nstate, nscale_k, v_tip); break;
+      case 45: get_likelihood_site_fused_ns<45, T>(L_sk_k, rtree, knodes, blen_per_edge, pmat_per_blen, variants, tip_start, tip_states, model, nstate, nscale_k, v_tip); break;
+      default: get_likelihood_site_fused_ns<0, T>(L_sk_k, rtree, knodes, blen_per_edge, pmat_per_blen, variants, tip_start, tip_states, model, nstate, nscale_k, v_tip);
+  }
+}
+
+
+KERNEL_CLONES
+void get_likelihood_site_fused(double* L_sk_k, const evo_tree& rtree, const vector<int>& knodes, const vector<int>& blen_per_edge, const vector<double*>& pmat_per_blen, const vector<int>& variants, const int* tip_start, const int* tip_states, int model, int nstate, int* nscale_k, double* v_tip){
+  get_likelihood_site_fused_real<double>(L_sk_k, rtree, knodes, blen_per_edge, pmat_per_blen, variants, tip_start, tip_states, model, nstate, nscale_k, v_tip);
+}
+
+
+KERNEL_CLONES
+void get_likelihood_site_fused(float* L_sk_k, const evo_tree& rtree, const vector<int>& knodes, const vector<int>& blen_per_edge, const vector<float*>& pmat_per_blen, const vector<int>& variants, const int* tip_start, const int* tip_states, int model, int nstate, int* nscale_k, float* v_tip){
+  get_likelihood_site_fused_real<float>(L_sk_k, rtree, knodes, blen_per_edge, pmat_per_blen, variants, tip_start, tip_states, model, nstate, nscale_k, v_tip);
+}
+
+
+void get_likelihood_site_sparse(double* L_sk_k, const evo_tree& rtree, const vector<int>& knodes, const vector<int>& blen_per_edge, const vector<UNIF_WEIGHTS>& unif_per_blen, const QMAT_SPARSE& qmat_sparse, const vector<int>& variants, int model, int nstate, int* nscale_k, double* work){
+  int ntotn = 2 * rtree.nleaf - 1;
+  int nvariant = variants.size();
+  int nk = knodes.size();
+  int root_state = 2;
+  if(model == BOUNDA) root_state = 4;
+  double* v_tip = work;
+  double* v_child = work + 2 * nstate;
+  double* work_unif = work + 4 * nstate;
+
+  for(int kn = 0; kn < nk; ++kn){
+    int k = knodes[kn];
+    int nc[2];
+    const UNIF_WEIGHTS* unif[2];
+    for(int i = 0; i < 2; i++){
+        int eid = rtree.nodes[k].e_ot[i];
+        nc[i] = rtree.edges[eid].end;
+        unif[i] = &unif_per_blen[blen_per_edge[eid]];
+
+        // the tips are the same in all the variants
+        if(nc[i] < rtree.nleaf){
+            apply_transition_matrix_sparse(qmat_sparse, *unif[i], L_sk_k + nc[i] * nstate, v_tip + i * nstate, work_unif);
+        }
+    }
+
+    for(int v = 0; v < nvariant; ++v){
+        double* L_v = L_sk_k + (size_t) v * ntotn * nstate;
+        int has_wgd = variants[v] / 3;
+        int z = variants[v] % 3 - 1;
+
+        const double* prob[2];
+        for(int i = 0; i < 2; i++){
+            if(nc[i] < rtree.nleaf){
+                prob[i] = v_tip + i * nstate;
+            }else{
+                apply_transition_matrix_sparse(qmat_sparse, *unif[i], L_v + nc[i] * nstate, v_child + i * nstate, work_unif);
+                prob[i] = v_child + i * nstate;
+            }
+        }
+
+        double* L_k = L_v + k * nstate;
+        if(k == rtree.nleaf){    // root node is always normal
+            L_k[root_state] = prob[0][root_state] * prob[1][root_state];
+        }else{
+            for(int sk = 0; sk < nstate; ++sk){
+                int nsk = sk;  // state after changes by other large scale events
+                if(has_wgd) nsk = 2 * sk;
+                nsk += z;
+                if(nsk < 0 || nsk >= nstate) continue;
+                L_k[nsk] = prob[0][nsk] * prob[1][nsk];
+            }
+        }
+        nscale_k[v * nk + kn] = scale_lnl_row(L_k, nstate);
+    }
   }
 }
 
 
 
+void build_comp_decomp(const set<vector<int>>& comps, const DIM_DECOMP& dim_decomp, COMP_DECOMP& comp_decomp){
+    int nstate = comps.size();
+    if(comp_decomp.comps == &comps && comp_decomp.nstate == nstate && comp_decomp.dim_wgd == dim_decomp.dim_wgd && comp_decomp.dim_chr == dim_decomp.dim_chr && comp_decomp.dim_seg == dim_decomp.dim_seg){
+        return;
+    }
+
+    int dim_wgd = dim_decomp.dim_wgd;
+    int dim_chr = dim_decomp.dim_chr;
+    int dim_seg = dim_decomp.dim_seg;
+    // The indices for chromosome and segment matrix have to be ajusted
+    int delta_chr = (dim_chr - 1)/2;
+    int delta_seg = (dim_seg - 1)/2;
+
+    comp_decomp.comps = &comps;
+    comp_decomp.nstate = nstate;
+    comp_decomp.dim_wgd = dim_wgd;
+    comp_decomp.dim_chr = dim_chr;
+    comp_decomp.dim_seg = dim_seg;
+    comp_decomp.root_state = -1;
+
+    vector<int>* rows[5] = {&comp_decomp.row_wgd, &comp_decomp.row_chr, &comp_decomp.row_seg, &comp_decomp.row_chr2, &comp_decomp.row_seg2};
+    vector<int>* cols[5] = {&comp_decomp.col_wgd, &comp_decomp.col_chr, &comp_decomp.col_seg, &comp_decomp.col_chr2, &comp_decomp.col_seg2};
+    // a matrix of dimension 1 is replaced by a single 1, so its row and column are always 0
+    int dims[5] = {dim_wgd, dim_chr, dim_seg, dim_chr, dim_seg};
+    int deltas[5] = {0, delta_chr, delta_seg, delta_chr, delta_seg};
+    for(int i = 0; i < 5; i++){
+        rows[i]->assign(nstate, 0);
+        cols[i]->assign(nstate, 0);
+    }
+
+    int sk = 0;
+    for(auto& v : comps){
+        for(int i = 0; i < 5; i++){
+            if(dims[i] > 1){
+                (*rows[i])[sk] = v[i] + deltas[i];
+                (*cols[i])[sk] = (v[i] + deltas[i]) * dims[i];
+            }
+        }
+        bool zeros = all_of(v.begin(), v.end(), [](int i) { return i == 0; });
+        if(zeros && comp_decomp.root_state < 0) comp_decomp.root_state = sk;
+        sk++;
+    }
+
+    // values taken by each component in comps
+    vector<set<int>> values(5);
+    for(auto& v : comps){
+        for(int i = 0; i < 5; i++){
+            values[i].insert(v[i]);
+        }
+    }
+
+    // Find the order of contraction with the fewest terms, counting the entries at each stage from the projections of comps
+    vector<int> order{0, 1, 2, 3, 4};
+    vector<int> best_order = order;
+    long best_cost = -1;
+    do{
+        long cost = 0;
+        for(int k = 1; k <= 5; k++){
+            set<vector<int>> child_part, parent_part;
+            for(auto& v : comps){
+                vector<int> c, p;
+                for(int i = 0; i < 5; i++){
+                    if(i < k) p.push_back(v[order[i]]);
+                    else c.push_back(v[order[i]]);
+                }
+                child_part.insert(c);
+                parent_part.insert(p);
+            }
+            cost += (long) child_part.size() * parent_part.size() * values[order[k - 1]].size();
+        }
+        if(best_cost < 0 || cost < best_cost){
+            best_cost = cost;
+            best_order = order;
+        }
+    }while(next_permutation(order.begin(), order.end()));
+
+    // Entries of a stage are stored as full 5-tuples, with parent values for the contracted components and child values for the others
+    // The input of the first stage is the child states, and the output of the last stage is the parent states, both in the order of comps
+    comp_decomp.stages.clear();
+    comp_decomp.max_entry = nstate;
+    vector<vector<int>> prev_entries(comps.begin(), comps.end());
+    for(int k = 1; k <= 5; k++){
+        int m = best_order[k - 1];
+        map<vector<int>, int> prev_index;
+        for(int e = 0; e < prev_entries.size(); e++){
+            prev_index[prev_entries[e]] = e;
+        }
+
+        vector<vector<int>> entries;
+        if(k == 5){
+            entries = vector<vector<int>>(comps.begin(), comps.end());
+        }else{
+            set<vector<int>> child_part, parent_part;
+            for(auto& v : comps){
+                vector<int> c(v), p(v);
+                for(int i = 0; i < 5; i++){
+                    if(i < k) c[best_order[i]] = 0;
+                    else p[best_order[i]] = 0;
+                }
+                child_part.insert(c);
+                parent_part.insert(p);
+            }
+            for(auto& c : child_part){
+                for(auto& p : parent_part){
+                    vector<int> e(c);
+                    for(int i = 0; i < k; i++){
+                        e[best_order[i]] = p[best_order[i]];
+                    }
+                    entries.push_back(e);
+                }
+            }
+        }
+
+        STAGE_DECOMP stage;
+        stage.comp = m;
+        stage.start.push_back(0);
+        vector<vector<int>> kept;
+        for(auto& e : entries){
+            int nterm = 0;
+            vector<int> t(e);
+            for(auto x : values[m]){
+                t[m] = x;
+                auto it = prev_index.find(t);
+                if(it == prev_index.end()) continue;
+                stage.in.push_back(it->second);
+                stage.col.push_back(dims[m] > 1 ? (x + deltas[m]) * dims[m] : 0);
+                nterm++;
+            }
+            // entries without terms are always 0, but all the parent states are needed at the last stage
+            if(nterm == 0 && k < 5) continue;
+            stage.row.push_back(dims[m] > 1 ? e[m] + deltas[m] : 0);
+            stage.start.push_back(stage.in.size());
+            kept.push_back(e);
+        }
+        stage.nentry = kept.size();
+        comp_decomp.max_entry = max(comp_decomp.max_entry, stage.nentry);
+        comp_decomp.stages.push_back(stage);
+        prev_entries = kept;
+    }
+}
+
+
+KERNEL_CLONES
+void get_prob_child_decomp_factored(const double* L_c, const COMP_DECOMP& comp_decomp, const double* pmat_wgd, const double* pmat_chr, const double* pmat_seg, double* work, double* prob){
+    const double* pmats[5] = {pmat_wgd, pmat_chr, pmat_seg, pmat_chr, pmat_seg};
+    int nstage = comp_decomp.stages.size();
+    const double* T_in = L_c;
+    for(int k = 0; k < nstage; k++){
+        const STAGE_DECOMP& stage = comp_decomp.stages[k];
+        const double* pmat = pmats[stage.comp];
+        const int* start = stage.start.data();
+        const int* in = stage.in.data();
+        const int* col = stage.col.data();
+        double* T_out = prob;
+        if(k < nstage - 1) T_out = work + (k % 2) * comp_decomp.max_entry;
+
+        for(int e = 0; e < stage.nentry; ++e){
+            const double* p = pmat + stage.row[e];
+            double sum = 0.0;
+            for(int t = start[e]; t < start[e + 1]; ++t){
+                sum += p[col[t]] * T_in[in[t]];
+            }
+            T_out[e] = sum;
+        }
+        T_in = T_out;
+    }
+}
+
+
 // Get the likelihood on one site of a chromosome
 // Assuming each observed copy number is composed of three type of events.
 // Sum over all possible states for initial and final nodes
 // Allow at most one WGD event along a branch
-void get_likelihood_site_decomp(vector<vector<double>>& L_sk_k, const evo_tree& rtree, const set<vector<int>>& comps, const vector<int>& knodes, PMAT_DECOMP& pmat_decomp, DIM_DECOMP& dim_decomp, int cn_max, int is_total){
+int get_likelihood_site_decomp(double* L_sk_k, const evo_tree& rtree, const COMP_DECOMP& comp_decomp, const vector<int>& knodes, PMAT_DECOMP& pmat_decomp, double* work, int* nscale_k){
   int debug = 0;
 
-  int dim_wgd = dim_decomp.dim_wgd;
-  int dim_chr = dim_decomp.dim_chr;
-  int dim_seg = dim_decomp.dim_seg;
-  int nstate = comps.size();
+  int dim_wgd = comp_decomp.dim_wgd;
+  int dim_chr = comp_decomp.dim_chr;
+  int dim_seg = comp_decomp.dim_seg;
+  int nstate = comp_decomp.nstate;
 
   if(debug){
       cout << "Computing likelihood for one site" << endl;
       cout << dim_wgd << "\t" << dim_chr << "\t"  << dim_seg << "\t"  << nstate << endl;
   }
 
+  // used in place of the P-matrix of a component which does not change
+  const double one = 1.0;
+  double* L_i_sk = work + 2 * comp_decomp.max_entry;
+  double* L_j_sk = L_i_sk + nstate;
+  int nscale = 0;
+
   for(int kn = 0; kn < knodes.size(); ++kn){
         int k = knodes[kn];
-        int ni = rtree.edges[rtree.nodes[k].e_ot[0]].end;
-        double bli = rtree.edges[rtree.nodes[k].e_ot[0]].length;
-        int nj = rtree.edges[rtree.nodes[k].e_ot[1]].end;
-        double blj = rtree.edges[rtree.nodes[k].e_ot[1]].length;
+        int ei = rtree.nodes[k].e_ot[0];
+        int ej = rtree.nodes[k].e_ot[1];
+        int ni = rtree.edges[ei].end;
+        double bli = rtree.edges[ei].length;
+        int nj = rtree.edges[ej].end;
+        double blj = rtree.edges[ej].length;
 
-        double *pbli_wgd, *pblj_wgd;
-        double *pbli_chr, *pblj_chr;
-        double *pbli_seg, *pblj_seg;
+        const double *pbli_wgd = &one, *pblj_wgd = &one;
+        const double *pbli_chr = &one, *pblj_chr = &one;
+        const double *pbli_seg = &one, *pblj_seg = &one;
 
         if(dim_wgd > 1){
-            pbli_wgd = pmat_decomp.pmats_wgd[bli];
-            pblj_wgd = pmat_decomp.pmats_wgd[blj];
+            pbli_wgd = pmat_decomp.wgd_per_edge[ei];
+            pblj_wgd = pmat_decomp.wgd_per_edge[ej];
         }
         if(dim_chr > 1){
-            pbli_chr = pmat_decomp.pmats_chr[bli];
-            pblj_chr = pmat_decomp.pmats_chr[blj];
+            pbli_chr = pmat_decomp.chr_per_edge[ei];
+            pblj_chr = pmat_decomp.chr_per_edge[ej];
         }
         if(dim_seg > 1){
-            pbli_seg = pmat_decomp.pmats_seg[bli];
-            pblj_seg = pmat_decomp.pmats_seg[blj];
+            pbli_seg = pmat_decomp.seg_per_edge[ei];
+            pblj_seg = pmat_decomp.seg_per_edge[ej];
         }
 
-        PROB_DECOMP prob_decomp;
-        prob_decomp.pbli_wgd = pbli_wgd;
-        prob_decomp.pblj_wgd = pblj_wgd;
-        prob_decomp.pbli_chr = pbli_chr;
-        prob_decomp.pblj_chr = pblj_chr;
-        prob_decomp.pbli_seg = pbli_seg;
-        prob_decomp.pblj_seg = pblj_seg;
-
-
         if(debug) cout << "node:" << rtree.nodes[k].id + 1 << " -> " << ni + 1 << " , " << bli << "\t" <<  nj + 1 << " , " << blj << endl;
 
+        const double* L_i = L_sk_k + ni * nstate;
+        const double* L_j = L_sk_k + nj * nstate;
+
         // loop over possible observed states of start nodes
         if(k == rtree.nleaf){    // root node is always normal
-            // int sk = 4;
-            // L_sk_k[k][sk] = get_prob_children_decomp(L_sk_k, rtree, decomp_table, sk, cn_max, nstate, prob_decomp, dim_decomp, ni, nj, bli, blj, is_total);
             if(debug) cout << "Getting likelihood for root node " << k << endl;
-            int sk = 0;
-            for(auto v : comps){
-                bool zeros = all_of(v.begin(), v.end(), [](int i) { return i == 0; });
-                if(zeros){
-                    L_sk_k[k][sk] = get_prob_children_decomp2(L_sk_k, rtree, comps, sk, cn_max, nstate, prob_decomp, dim_decomp, ni, nj, bli, blj, is_total);
-                    break;
-                }
-                sk++;
+            int sk = comp_decomp.root_state;
+            if(sk >= 0){
+                double Li = get_prob_child_decomp(L_i, comp_decomp, sk, pbli_wgd, pbli_chr, pbli_seg);
+                double Lj = get_prob_child_decomp(L_j, comp_decomp, sk, pblj_wgd, pblj_chr, pblj_seg);
+                L_sk_k[k * nstate + sk] = Li * Lj;
             }
         }
         else{
+            get_prob_child_decomp_factored(L_i, comp_decomp, pbli_wgd, pbli_chr, pbli_seg, work, L_i_sk);
+            get_prob_child_decomp_factored(L_j, comp_decomp, pblj_wgd, pblj_chr, pblj_seg, work, L_j_sk);
             for(int sk = 0; sk < nstate; ++sk){
-                // cout << " getting likelihood of children nodes " << endl;
-                // L_sk_k[k][sk] = get_prob_children_decomp(L_sk_k, rtree, decomp_table, sk, cn_max, nstate, prob_decomp, dim_decomp, ni, nj, bli, blj, is_total);
-                L_sk_k[k][sk] = get_prob_children_decomp2(L_sk_k, rtree, comps, sk, cn_max, nstate, prob_decomp, dim_decomp, ni, nj, bli, blj, is_total);
+                L_sk_k[k * nstate + sk] = L_i_sk[sk] * L_j_sk[sk];
             }
         }
+        int nscale_row = scale_lnl_row(L_sk_k + k * nstate, nstate);
+        if(nscale_k) nscale_k[kn] = nscale_row;
+        nscale += nscale_row;
   }
   if(debug > 0){
     print_tree_lnl(rtree, L_sk_k, nstate);
   }
+
+  return nscale;
 }
 
 
-double get_likelihood_chr(map<int, vector<vector<int>>>& vobs, const evo_tree& rtree, const vector<int>& knodes, const vector<double>& blens, const vector<double*>& pmat_per_blen, const int& has_wgd, const int& only_seg, const int& use_repeat, const int& model, const int& nstate, const int& is_total){
+double get_likelihood_chr(map<int, vector<vector<int>>>& vobs, const map<int, vector<int>>& site_weight, const vector<double>& lnl_normal, const vector<double>& lnl_loss, const vector<double>& lnl_gain, const evo_tree& rtree, const int& only_seg){
     int debug = 0;
     double logL = 0.0;    // for all chromosmes
     double chr_gain = 0.0;
     double chr_loss = 0.0;
+    int ns = 0;   // index of the first site pattern of a chromosome in lnl_normal, lnl_loss and lnl_gain
 
     for(int nchr = 1; nchr <= vobs.size(); nchr++){     // for each chromosome
       if(debug) cout << "Computing likelihood on Chr " << nchr << endl;
       double chr_logL = 0;  // for one chromosome
       double chr_logL_normal = 0, chr_logL_gain = 0, chr_logL_loss = 0;
       double site_logL = 0;   // log likelihood for all sites on a chromosome
-      int z = 0;    // no chr gain/loss
-      // cout << " chromosome number change is " << 0 << endl;
-      // Use a map to store computed log likelihood
-      map<vector<int>, vector<vector<double>>> sites_lnl_map;
-
-      for(int nc = 0; nc < vobs[nchr].size(); nc++){    // for each segment on the chromosome
-          // cout << "Number of sites for this chr " << vobs[nchr].size() << endl;
-          // for each site of the chromosome (may be repeated)
-          vector<int> obs = vobs[nchr][nc];
-          vector<vector<double>> L_sk_k(2 * rtree.nleaf - 1, vector<double>(nstate, 0.0));
-
-          if(use_repeat){
-              if(sites_lnl_map.find(obs) == sites_lnl_map.end()){
-                  initialize_lnl_table(L_sk_k, obs, rtree, model, nstate, is_total);
-                  get_likelihood_site(L_sk_k, rtree, knodes, blens, pmat_per_blen, has_wgd, z, model, nstate);
-              }else{
-                  // cout << "sites repeated" << end1;
-                  L_sk_k = sites_lnl_map[obs];
-              }
-          }else{
-              initialize_lnl_table(L_sk_k, obs, rtree, model, nstate, is_total);
-              get_likelihood_site(L_sk_k, rtree, knodes, blens, pmat_per_blen, has_wgd, z, model, nstate);
-          }
-
-          site_logL += extract_tree_lnl(L_sk_k, rtree.nleaf - 1, model);
-
-          if(debug){
-              // cout << "\nLikelihood for site " << nc << " is " << lnl << endl;
-              print_tree_lnl(rtree, L_sk_k, nstate);
-          }
+      int nsite = vobs[nchr].size();
+      // number of sites having each pattern, NULL when the sites are not compressed
+      const vector<int>* chr_weight = site_weight.empty() ? NULL : &site_weight.at(nchr);
+
+      for(int nc = 0; nc < nsite; nc++){    // for each site pattern of the chromosome
+          double lnl = lnl_normal[ns + nc];
+          if(chr_weight) lnl *= (*chr_weight)[nc];
+          site_logL += lnl;
       }
 
       double chr_normal = 1;
@@ -553,26 +904,15 @@ double get_likelihood_chr(map<int, vector<vector<int>>>& vobs, const evo_tree& r
 
       if(!only_seg){
           if(fabs(chr_loss - 0) > SMALL_VAL){
-              z = -1;
               double site_logL = 0.0;   // log likelihood for all sites on a chromosome
-              // cout << " chromosome number change is " << z << endl;
-              for(int nc = 0; nc < vobs[nchr].size(); nc++){
-                  // cout << "Number of sites for this chr " << vobs[nchr].size() << endl;
-                  // for each site of the chromosome
-                  vector<int> obs = vobs[nchr][nc];
-                  vector<vector<double>> L_sk_k(2 * rtree.nleaf - 1, vector<double>(nstate, 0.0));
-                  initialize_lnl_table(L_sk_k, obs, rtree, model, nstate, is_total);
-
-                  get_likelihood_site(L_sk_k, rtree, knodes, blens, pmat_per_blen, has_wgd, z, model, nstate);
-                  site_logL += extract_tree_lnl(L_sk_k, rtree.nleaf - 1, model);
-
-                  if(debug){
-                      print_tree_lnl(rtree, L_sk_k, nstate);
-                  }
+              for(int nc = 0; nc < nsite; nc++){
+                  double lnl = lnl_loss[ns + nc];
+                  if(chr_weight) lnl *= (*chr_weight)[nc];
+                  site_logL += lnl;
               } // for all sites on a chromosome
 
               chr_logL_loss = log(chr_loss) + site_logL;
-              chr_logL += log(1 + exp(chr_logL_loss - chr_logL_normal));
+              chr_logL += log1p_exp(chr_logL_loss - chr_logL_normal);
               if(debug){
                   cout << "\nLikelihood before chr loss for " << nchr << " is " << site_logL << endl;
                   cout << "\nLikelihood after chr loss: " << chr_logL_loss << endl;
@@ -580,29 +920,19 @@ double get_likelihood_chr(map<int, vector<vector<int>>>& vobs, const evo_tree& r
           } // for all chromosome loss
 
           if(fabs(chr_gain - 0) > SMALL_VAL){
-              z = 1;
               double site_logL = 0;   // log likelihood for all sites on a chromosome
-              // cout << " chromosome number change is " << z << endl;
-              for(int nc = 0; nc < vobs[nchr].size(); nc++){
-                  // cout << "Number of sites for this chr " << vobs[nchr].size() << endl;
-                  // for each site of the chromosome
-                  vector<int> obs = vobs[nchr][nc];
-                  vector<vector<double>> L_sk_k(2 * rtree.nleaf - 1, vector<double>(nstate, 0.0));
-                  initialize_lnl_table(L_sk_k, obs, rtree, model, nstate, is_total);
-                  get_likelihood_site(L_sk_k, rtree, knodes, blens, pmat_per_blen, has_wgd, z, model, nstate);
-                  site_logL += extract_tree_lnl(L_sk_k, rtree.nleaf - 1, model);
-
-                  if(debug){
-                      print_tree_lnl(rtree, L_sk_k, nstate);
-                  }
+              for(int nc = 0; nc < nsite; nc++){
+                  double lnl = lnl_gain[ns + nc];
+                  if(chr_weight) lnl *= (*chr_weight)[nc];
+                  site_logL += lnl;
               } // for all sites on a chromosome
 
               chr_logL_gain = log(chr_gain) + site_logL;
               if(chr_logL_loss > 0){
-                  chr_logL += log(1 + 1 / (exp(chr_logL_normal - chr_logL_gain) + exp(chr_logL_loss - chr_logL_gain)));
+                  chr_logL += log1p_exp(chr_logL_gain - (chr_logL_normal + log1p_exp(chr_logL_loss - chr_logL_normal)));
               }
               else{
-                  chr_logL += log(1 + exp(chr_logL_gain - chr_logL_normal));
+                  chr_logL += log1p_exp(chr_logL_gain - chr_logL_normal);
               }
 
               if(debug){
@@ -613,6 +943,7 @@ double get_likelihood_chr(map<int, vector<vector<int>>>& vobs, const evo_tree& r
           // chr_logL = chr_logL_normal + log(1 + exp(chr_logL_loss-chr_logL_normal)) + log(1 + 1 / (exp(chr_logL_normal-chr_logL_gain) + exp(chr_logL_loss-chr_logL_gain)));
       }
       logL += chr_logL;
+      ns += nsite;
       if(debug){
           cout << "\nLikelihood after considering chr gain/loss for  " << nchr << " is " << logL << endl;
       }
@@ -623,51 +954,171 @@ double get_likelihood_chr(map<int, vector<vector<int>>>& vobs, const evo_tree& r
     return logL;
 }
 
+
+double get_chr_lnl_weights(const double* site_logL, double chr_normal, double chr_loss, double chr_gain, int has_loss, int has_gain, double& fA, double& fB, double& fC){
+    double A = log(chr_normal) + site_logL[1];
+    double chr_logL = A;
+    fA = 1;
+    fB = 0;
+    fC = 0;
+
+    double B = 0;
+    if(has_loss){
+        B = log(chr_loss) + site_logL[0];
+        chr_logL += log1p_exp(B - A);
+        fB = 1 / (1 + exp(A - B));
+        fA -= fB;
+    }
+
+    if(has_gain){
+        double C = log(chr_gain) + site_logL[2];
+        if(B > 0){
+            double r = 1 / (exp(A - C) + exp(B - C));
+            double wA = 1 / (1 + exp(B - A));
+            chr_logL += log1p_exp(C - (A + log1p_exp(B - A)));
+            fC = r / (1 + r);
+            fA -= fC * wA;
+            fB -= fC * (1 - wA);
+        }else{
+            chr_logL += log1p_exp(C - A);
+            fC = 1 / (1 + exp(A - C));
+            fA -= fC;
+        }
+    }
+
+    return chr_logL;
+}
+
+
+// Follows get_likelihood_chr, with the log likelihood of a chromosome written as f(A, B, C) in get_chr_lnl_weights
+double get_likelihood_chr_grad(map<int, vector<vector<int>>>& vobs, const map<int, vector<int>>& site_weight, const vector<double>* lnl_site, const vector<double>* dlnl_site, int npar, const evo_tree& rtree, const int& only_seg, vector<double>& grad){
+    double logL = 0.0;    // for all chromosmes
+    double chr_gain = only_seg ? 0.0 : rtree.chr_gain_rate;
+    double chr_loss = only_seg ? 0.0 : rtree.chr_loss_rate;
+    int has_gain = fabs(chr_gain - 0) > SMALL_VAL;
+    int has_loss = fabs(chr_loss - 0) > SMALL_VAL;
+
+    double chr_normal = 1;
+    if(has_loss) chr_normal -= chr_loss;
+    if(has_gain) chr_normal -= chr_gain;
+
+    grad.assign(npar + 2, 0.0);
+    // sum of the log likelihood of all sites on a chromosome after chromosome loss, without chromosome change and after chromosome gain, and its gradient
+    double site_logL[3];
+    vector<double> dsite_logL[3];
+    int ns = 0;   // index of the first site pattern of a chromosome
+
+    for(int nchr = 1; nchr <= vobs.size(); nchr++){     // for each chromosome
+      int nsite = vobs[nchr].size();
+      const vector<int>* chr_weight = site_weight.empty() ? NULL : &site_weight.at(nchr);
+
+      for(int z = 0; z < 3; z++){
+          site_logL[z] = 0.0;
+          dsite_logL[z].assign(npar, 0.0);
+          if((z == 0 && !has_loss) || (z == 2 && !has_gain)) continue;
+          for(int nc = 0; nc < nsite; nc++){
+              double w = chr_weight ? (*chr_weight)[nc] : 1;
+              site_logL[z] += w * lnl_site[z][ns + nc];
+              const double* dlnl = dlnl_site[z].data() + (size_t) (ns + nc) * npar;
+              for(int i = 0; i < npar; i++){
+                  dsite_logL[z][i] += w * dlnl[i];
+              }
+          }
+      }
+
+      double fA, fB, fC;
+      double chr_logL = get_chr_lnl_weights(site_logL, chr_normal, chr_loss, chr_gain, has_loss, has_gain, fA, fB, fC);
+
+      for(int i = 0; i < npar; i++){
+          grad[i] += fA * dsite_logL[1][i] + fB * dsite_logL[0][i] + fC * dsite_logL[2][i];
+      }
+      if(has_gain) grad[npar] += fC / chr_gain - fA / chr_normal;
+      if(has_loss) grad[npar + 1] += fB / chr_loss - fA / chr_normal;
+
+      logL += chr_logL;
+      ns += nsite;
+    } // for each chromosome
+
+    return logL;
+}
+
+
+// Follows get_likelihood_chr_grad for one parameter, with the second derivative of f(A, B, C) = log(exp(A) + exp(B) + exp(C)) being that of a mixture:
+// fA * A'' + fB * B'' + fC * C'' + fA * A'^2 + fB * B'^2 + fC * C'^2 - f'^2
+double get_likelihood_chr_deriv(map<int, vector<vector<int>>>& vobs, const map<int, vector<int>>& site_weight, const vector<double>* lnl_site, const vector<double>* dlnl_site, const vector<double>* d2lnl_site, const evo_tree& rtree, const int& only_seg, double& dlnl, double& d2lnl){
+    double logL = 0.0;    // for all chromosmes
+    double chr_gain = only_seg ? 0.0 : rtree.chr_gain_rate;
+    double chr_loss = only_seg ? 0.0 : rtree.chr_loss_rate;
+    int has_gain = fabs(chr_gain - 0) > SMALL_VAL;
+    int has_loss = fabs(chr_loss - 0) > SMALL_VAL;
+
+    double chr_normal = 1;
+    if(has_loss) chr_normal -= chr_loss;
+    if(has_gain) chr_normal -= chr_gain;
+
+    dlnl = 0.0;
+    d2lnl = 0.0;
+    double site_logL[3], dsite_logL[3], d2site_logL[3];
+    int ns = 0;   // index of the first site pattern of a chromosome
+
+    for(int nchr = 1; nchr <= vobs.size(); nchr++){     // for each chromosome
+      int nsite = vobs[nchr].size();
+      const vector<int>* chr_weight = site_weight.empty() ? NULL : &site_weight.at(nchr);
+
+      for(int z = 0; z < 3; z++){
+          site_logL[z] = 0.0;
+          dsite_logL[z] = 0.0;
+          d2site_logL[z] = 0.0;
+          if((z == 0 && !has_loss) || (z == 2 && !has_gain)) continue;
+          for(int nc = 0; nc < nsite; nc++){
+              double w = chr_weight ? (*chr_weight)[nc] : 1;
+              site_logL[z] += w * lnl_site[z][ns + nc];
+              dsite_logL[z] += w * dlnl_site[z][ns + nc];
+              d2site_logL[z] += w * d2lnl_site[z][ns + nc];
+          }
+      }
+
+      double f[3];
+      double chr_logL = get_chr_lnl_weights(site_logL, chr_normal, chr_loss, chr_gain, has_loss, has_gain, f[1], f[0], f[2]);
+
+      double d1 = 0.0, d2 = 0.0;
+      for(int z = 0; z < 3; z++){
+          d1 += f[z] * dsite_logL[z];
+          d2 += f[z] * (d2site_logL[z] + dsite_logL[z] * dsite_logL[z]);
+      }
+      dlnl += d1;
+      d2lnl += d2 - d1 * d1;
+
+      logL += chr_logL;
+      ns += nsite;
+    } // for each chromosome
+
+    return logL;
+}
+
+
 // Used when WGD is considered, dealing with mutations of different types at different levels
-double get_likelihood_chr_decomp(map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const evo_tree& rtree, const set<vector<int>>& comps, const vector<int>& knodes, PMAT_DECOMP& pmat_decomp, DIM_DECOMP& dim_decomp, int infer_wgd, int infer_chr, int use_repeat, int cn_max, int is_total){
+double get_likelihood_chr_decomp(map<int, vector<vector<int>>>& vobs, const map<int, vector<int>>& site_weight, const vector<double>& lnl_site){
     int debug = 0;
     double logL = 0;    // for all chromosmes
+    int ns = 0;   // index of the first site pattern of a chromosome in lnl_site
 
-    int nstate = comps.size();
     for(int nchr = 1; nchr <= vobs.size(); nchr++){     // for each chromosome
+      int nsite = vobs[nchr].size();
       if(debug){
         cout << "Computing likelihood on Chr " << nchr << endl;
-        cout << "Number of sites for this chr " << vobs[nchr].size() << endl;
+        cout << "Number of sites for this chr " << nsite << endl;
       }
       double site_logL = 0;   // log likelihood for all sites on a chromosome
-      // Use a map to store computed log likelihood
-      map<vector<int>, vector<vector<double>>> sites_lnl_map;
-      // cout << " chromosome number change is " << 0 << endl;
-      for(int nc = 0; nc < vobs[nchr].size(); nc++){    // for each segment on the chromosome
-          // for each site of the chromosome (may be repeated)
-          vector<int> obs = vobs[nchr][nc];
-          vector<vector<double>> L_sk_k;
-          if(use_repeat){
-              if(sites_lnl_map.find(obs) == sites_lnl_map.end()){
-                  L_sk_k = initialize_lnl_table_decomp(obs, obs_decomp, nchr, rtree, comps, infer_wgd, infer_chr, cn_max, is_total);
-                  get_likelihood_site_decomp(L_sk_k, rtree, comps, knodes, pmat_decomp, dim_decomp, cn_max, is_total);
-                  sites_lnl_map[obs] = L_sk_k;
-              }else{
-                  if(debug) cout << "\tsites repeated" << endl;
-                  L_sk_k = sites_lnl_map[obs];
-              }
-          }else{
-              L_sk_k = initialize_lnl_table_decomp(obs, obs_decomp, nchr, rtree, comps, infer_wgd, infer_chr, cn_max, is_total);
-              get_likelihood_site_decomp(L_sk_k, rtree, comps, knodes, pmat_decomp, dim_decomp, cn_max, is_total);
-          }
-
-          site_logL += extract_tree_lnl_decomp(L_sk_k, comps, rtree.nleaf - 1);
-
-          if(debug){
-              // cout << "Crtree.nleaf - 1 at this site: ";
-              for(int i = 0; i < obs.size(); i++){
-                  cout << "\t" << obs[i];
-              }
-              cout << endl;
-              print_tree_lnl(rtree, L_sk_k, nstate);
-          }
+      // number of sites having each pattern, NULL when the sites are not compressed
+      const vector<int>* chr_weight = site_weight.empty() ? NULL : &site_weight.at(nchr);
+      for(int nc = 0; nc < nsite; nc++){    // for each site pattern of the chromosome
+          double lnl = lnl_site[ns + nc];
+          if(chr_weight) lnl *= (*chr_weight)[nc];
+          site_logL += lnl;
       }
       logL += site_logL;
+      ns += nsite;
       if(debug){
           cout << "\nLikelihood for chromosome " << nchr << " is " << site_logL << endl;
       }
@@ -676,54 +1127,785 @@ double get_likelihood_chr_decomp(map<int, vector<vector<int>>>& vobs, OBS_DECOMP
 }
 
 
-// Compute the likelihood of dummy sites consisting entirely of 2s for the tree
-double get_likelihood_invariant_decomp(OBS_DECOMP& obs_decomp, evo_tree& rtree, const set<vector<int>>& comps, const vector<int>& knodes, PMAT_DECOMP& pmat_decomp, DIM_DECOMP& dim_decomp, int infer_wgd, int infer_chr, int cn_max, int is_total){
-    int debug = 0;
-    double logL = 0;
-    if(debug) cout << "Correcting for the skip of invariant sites" << endl;
-
-    // Suppose the value is 2 for all samples
-    int normal_cn  = 2;
-    vector<int> obs(rtree.nleaf - 1, normal_cn);
-    vector<vector<double>> L_sk_k = initialize_lnl_table_decomp(obs, obs_decomp, 0, rtree, comps, infer_wgd, infer_chr, cn_max, is_total);
-    get_likelihood_site_decomp(L_sk_k, rtree, comps, knodes, pmat_decomp, dim_decomp, cn_max, is_total);
-    logL = extract_tree_lnl_decomp(L_sk_k, comps, rtree.nleaf - 1);
+void check_lnl_cache(LNL_CACHE& lnl_cache, int data_version, int ntotn, int nstate, const vector<double>& rates){
+    if(lnl_cache.data_version != data_version || lnl_cache.ntotn != ntotn || lnl_cache.nstate != nstate){
+        lnl_cache.passes.clear();
+        lnl_cache.data_version = data_version;
+        lnl_cache.ntotn = ntotn;
+        lnl_cache.nstate = nstate;
+        lnl_cache.rates = rates;
+        return;
+    }
 
-    if(debug){
-        cout << "The likelihood of invariant sites is " << logL << endl;
+    if(lnl_cache.rates != rates){
+        // the tips are still valid, but all the transition matrices have changed
+        for(auto& it : lnl_cache.passes){
+            fill(it.second.children.begin(), it.second.children.end(), -1);
+        }
+        lnl_cache.rates = rates;
     }
-    return logL;
 }
 
 
-// Incorporate chromosome gain/loss and WGD
-// Model 2: Treat total copy number as the observed data and the allele-specific information is missing
-double get_likelihood_revised(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type){
-  // int debug = 0;
-  // if(debug) cout << "\tget_likelihood by matrix exponential" << endl;
+// Allocate the tables of a pass (in single precision if use_float is 1), marking all the internal nodes to be computed
+void alloc_lnl_pass(LNL_PASS& lnl_pass, map<int, vector<vector<int>>>& sites, int ntotn, int nstate, const vector<int>& variants, int use_float = 0){
+    int npattern = 0;
+    for(auto& it : sites){
+        npattern += it.second.size();
+    }
+    int nvariant = variants.size();
 
-  if(!is_tree_valid(rtree, lnl_type.max_tobs, lnl_type.patient_age, lnl_type.cons)){
-       return SMALL_LNL;
-   }
+    lnl_pass.npattern = npattern;
+    lnl_pass.variants = variants;
+    if(use_float){
+        lnl_pass.L.clear();
+        lnl_pass.Lf.assign((size_t) npattern * nvariant * ntotn * nstate, 0.0f);
+    }else{
+        lnl_pass.Lf.clear();
+        lnl_pass.L.assign((size_t) npattern * nvariant * ntotn * nstate, 0.0);
+    }
+    lnl_pass.nscale.assign((size_t) npattern * nvariant * ntotn, 0);
+    lnl_pass.tip_start.assign(1, 0);
+    lnl_pass.tip_states.clear();
+    lnl_pass.children.assign(2 * ntotn, -1);
+    lnl_pass.blens.assign(2 * ntotn, 0.0);
+}
 
-  int model = lnl_type.model;
-  int cn_max = lnl_type.cn_max;
-  int is_total = lnl_type.is_total;
 
-  // For copy number instantaneous changes
-  int nstate = cn_max + 1;
-  if(model == BOUNDA) nstate = (cn_max + 1) * (cn_max + 2) / 2;
+void add_tip_states(const double* L_sk_k, int nleaf, int nstate, vector<int>& tip_start, vector<int>& tip_states){
+    for(int i = 0; i < nleaf; i++){
+        const double* L_i = L_sk_k + i * nstate;
+        for(int s = 0; s < nstate; s++){
+            if(L_i[s] > 0) tip_states.push_back(s);
+        }
+        tip_start.push_back(tip_states.size());
+    }
+}
 
-  // may be different for each tree due to change of mutation rate
+
+void init_lnl_pass(LNL_PASS& lnl_pass, map<int, vector<vector<int>>>& sites, const evo_tree& rtree, int model, int nstate, int is_total, const vector<int>& variants, int use_float){
+    int ntotn = 2 * rtree.nleaf - 1;
+    int nvariant = variants.size();
+    size_t dim_table = (size_t) ntotn * nstate;
+    alloc_lnl_pass(lnl_pass, sites, ntotn, nstate, variants, use_float);
+
+    // the tips are filled in double precision and rounded when the table is in single precision
+    LNL_BUFFER lnl_buffer;
+    int p = 0;
+    for(auto& it : sites){
+        for(auto& obs : it.second){
+            if(use_float){
+                double* L_tip = lnl_buffer.reserve(ntotn, nstate);
+                initialize_lnl_table(L_tip, obs, rtree, model, nstate, is_total);
+                add_tip_states(L_tip, rtree.nleaf, nstate, lnl_pass.tip_start, lnl_pass.tip_states);
+                float* L_sk_k = lnl_pass.Lf.data() + (size_t) p * nvariant * dim_table;
+                for(int v = 0; v < nvariant; v++){
+                    copy(L_tip, L_tip + dim_table, L_sk_k + v * dim_table);
+                }
+            }else{
+                double* L_sk_k = lnl_pass.L.data() + (size_t) p * nvariant * dim_table;
+                initialize_lnl_table(L_sk_k, obs, rtree, model, nstate, is_total);
+                add_tip_states(L_sk_k, rtree.nleaf, nstate, lnl_pass.tip_start, lnl_pass.tip_states);
+                for(int v = 1; v < nvariant; v++){
+                    copy(L_sk_k, L_sk_k + dim_table, L_sk_k + v * dim_table);
+                }
+            }
+            p++;
+        }
+    }
+}
+
+
+vector<int> get_dirty_nodes(const LNL_PASS& lnl_pass, const evo_tree& rtree, const vector<int>& knodes){
+    // knodes is in post-order, so a node is visited after its children and inherits their status
+    vector<int> is_dirty(2 * rtree.nleaf - 1, 0);
+    vector<int> dirty_nodes;
+
+    for(auto k : knodes){
+        int ni = rtree.edges[rtree.nodes[k].e_ot[0]].end;
+        double bli = rtree.edges[rtree.nodes[k].e_ot[0]].length;
+        int nj = rtree.edges[rtree.nodes[k].e_ot[1]].end;
+        double blj = rtree.edges[rtree.nodes[k].e_ot[1]].length;
+
+        if(is_dirty[ni] || is_dirty[nj] || lnl_pass.children[2 * k] != ni || lnl_pass.children[2 * k + 1] != nj || lnl_pass.blens[2 * k] != bli || lnl_pass.blens[2 * k + 1] != blj){
+            is_dirty[k] = 1;
+            dirty_nodes.push_back(k);
+        }
+    }
+
+    return dirty_nodes;
+}
+
+
+void set_clean_nodes(LNL_PASS& lnl_pass, const evo_tree& rtree, const vector<int>& dirty_nodes){
+    for(auto k : dirty_nodes){
+        lnl_pass.children[2 * k] = rtree.edges[rtree.nodes[k].e_ot[0]].end;
+        lnl_pass.blens[2 * k] = rtree.edges[rtree.nodes[k].e_ot[0]].length;
+        lnl_pass.children[2 * k + 1] = rtree.edges[rtree.nodes[k].e_ot[1]].end;
+        lnl_pass.blens[2 * k + 1] = rtree.edges[rtree.nodes[k].e_ot[1]].length;
+    }
+}
+
+
+void start_pmat_cache(PMAT_CACHE& pmat_cache, const double* q, int n){
+    int dim_mat = n * n;
+    if(pmat_cache.q.size() != dim_mat || !equal(q, q + dim_mat, pmat_cache.q.begin())){
+        pmat_cache.q.assign(q, q + dim_mat);
+        pmat_cache.pmats.clear();
+    }
+    pmat_cache.ncall++;
+}
+
+
+void get_pmats_cached(PMAT_CACHE& pmat_cache, const QMAT_EIGEN& qmat_eigen, const vector<double>& blens, vector<double*>& pmat_per_blen, vector<float*>* pmat_per_blen_float){
+    int n = qmat_eigen.n;
+    vector<double> blens_new;
+    vector<double*> pmats_new;
+
+    pmat_per_blen.resize(blens.size());
+    for(int i = 0; i < blens.size(); i++){
+        auto it = pmat_cache.pmats.find(blens[i]);
+        if(it == pmat_cache.pmats.end()){
+            PMAT_ENTRY entry;
+            entry.pmat.assign(n * n, 0.0);
+            it = pmat_cache.pmats.insert(make_pair(blens[i], entry)).first;
+            blens_new.push_back(blens[i]);
+            pmats_new.push_back(it->second.pmat.data());
+        }
+        it->second.last_use = pmat_cache.ncall;
+        pmat_per_blen[i] = it->second.pmat.data();
+    }
+
+    if(!blens_new.empty()){
+        get_transition_matrices_eigen(qmat_eigen, blens_new.data(), pmats_new.data(), blens_new.size());
+    }
+
+    if(pmat_per_blen_float){
+        pmat_per_blen_float->resize(blens.size());
+        for(int i = 0; i < blens.size(); i++){
+            PMAT_ENTRY& entry = pmat_cache.pmats[blens[i]];
+            if(entry.pmat_float.empty()){
+                entry.pmat_float.assign(entry.pmat.begin(), entry.pmat.end());
+            }
+            (*pmat_per_blen_float)[i] = entry.pmat_float.data();
+        }
+    }
+}
+
+
+void add_distinct_blens(const evo_tree& rtree, const vector<int>& knodes, vector<double>& blens){
+    for(auto k : knodes){
+        for(int i = 0; i < 2; i++){
+            blens.push_back(rtree.edges[rtree.nodes[k].e_ot[i]].length);
+        }
+    }
+    sort(blens.begin(), blens.end());
+    blens.erase(unique(blens.begin(), blens.end()), blens.end());
+}
+
+
+void get_blen_per_edge(const evo_tree& rtree, const vector<int>& knodes, const vector<double>& blens, vector<int>& blen_per_edge){
+    blen_per_edge.assign(rtree.edges.size(), -1);
+    for(auto k : knodes){
+        for(int i = 0; i < 2; i++){
+            int eid = rtree.nodes[k].e_ot[i];
+            auto it = lower_bound(blens.begin(), blens.end(), rtree.edges[eid].length);
+            assert(it != blens.end() && *it == rtree.edges[eid].length);
+            blen_per_edge[eid] = distance(blens.begin(), it);
+        }
+    }
+}
+
+
+void set_pmat_decomp_per_edge(PMAT_DECOMP& pmat_decomp, const evo_tree& rtree, const vector<int>& knodes){
+    int nedge = rtree.edges.size();
+    pmat_decomp.wgd_per_edge.assign(nedge, NULL);
+    pmat_decomp.chr_per_edge.assign(nedge, NULL);
+    pmat_decomp.seg_per_edge.assign(nedge, NULL);
+    for(auto k : knodes){
+        for(int i = 0; i < 2; i++){
+            int eid = rtree.nodes[k].e_ot[i];
+            double bl = rtree.edges[eid].length;
+            if(!pmat_decomp.pmats_wgd.empty()) pmat_decomp.wgd_per_edge[eid] = pmat_decomp.pmats_wgd.at(bl);
+            if(!pmat_decomp.pmats_chr.empty()) pmat_decomp.chr_per_edge[eid] = pmat_decomp.pmats_chr.at(bl);
+            if(!pmat_decomp.pmats_seg.empty()) pmat_decomp.seg_per_edge[eid] = pmat_decomp.pmats_seg.at(bl);
+        }
+    }
+}
+
+
+void end_pmat_cache(PMAT_CACHE& pmat_cache){
+    if(pmat_cache.pmats.size() <= MAX_PMAT_CACHE) return;
+
+    // only remove half of the cache at a time, so that it is not sorted in each call
+    vector<pair<long, double>> old_pmats;
+    for(auto& it : pmat_cache.pmats){
+        if(it.second.last_use < pmat_cache.ncall) old_pmats.push_back(make_pair(it.second.last_use, it.first));
+    }
+    sort(old_pmats.begin(), old_pmats.end());
+    for(int i = 0; i < old_pmats.size() && pmat_cache.pmats.size() > MAX_PMAT_CACHE / 2; i++){
+        pmat_cache.pmats.erase(old_pmats[i].second);
+    }
+}
+
+
+void get_pmats_mk(double mu, int nstate, const vector<double>& blens, vector<double>& pmats, vector<double*>& pmat_per_blen, vector<float>* pmats_float, vector<float*>* pmat_per_blen_float){
+    int dim_mat = nstate * nstate;
+    pmats.assign(blens.size() * dim_mat, 0.0);
+    pmat_per_blen.resize(blens.size());
+    for(int i = 0; i < blens.size(); i++){
+        pmat_per_blen[i] = pmats.data() + i * dim_mat;
+        get_transition_matrix_mk(mu, pmat_per_blen[i], blens[i], nstate);
+    }
+
+    if(pmats_float && pmat_per_blen_float){
+        pmats_float->assign(pmats.begin(), pmats.end());
+        pmat_per_blen_float->resize(blens.size());
+        for(int i = 0; i < blens.size(); i++){
+            (*pmat_per_blen_float)[i] = pmats_float->data() + i * dim_mat;
+        }
+    }
+}
+
+
+// L: table of the pass, lnl_pass.L or lnl_pass.Lf
+// get_site(L_p, tip_start, nscale_k, work): recompute the dirty nodes of one site pattern, with a buffer of 6 * nstate values
+template <typename T, typename F>
+void update_lnl_pass_real(LNL_PASS& lnl_pass, T* L, const vector<int>& dirty_nodes, const evo_tree& rtree, int model, int nstate, const F& get_site, vector<double>& lnl_site){
+    int ntotn = 2 * rtree.nleaf - 1;
+    int nvariant = lnl_pass.variants.size();
+    int nk = dirty_nodes.size();
+    lnl_site.resize((size_t) lnl_pass.npattern * nvariant);
+
+    // site patterns are independent, and their log likelihoods are summed up in a fixed order afterwards
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+    vector<int> nscale_k(nvariant * nk, 0);
+    vector<T> work(6 * nstate, 0);
+    #ifdef _OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for(int p = 0; p < lnl_pass.npattern; ++p){
+        T* L_p = L + (size_t) p * nvariant * ntotn * nstate;
+        int* nscale_p = lnl_pass.nscale.data() + (size_t) p * nvariant * ntotn;
+
+        if(nk > 0){
+            // only the states reachable after WGD and chromosome change are filled, so the old values have to be cleared
+            for(int v = 0; v < nvariant; ++v){
+                T* L_sk_k = L_p + (size_t) v * ntotn * nstate;
+                for(auto k : dirty_nodes){
+                    fill(L_sk_k + k * nstate, L_sk_k + (k + 1) * nstate, 0);
+                }
+            }
+            const int* tip_start = lnl_pass.tip_start.data() + (size_t) p * rtree.nleaf;
+            get_site(L_p, tip_start, nscale_k.data(), work.data());
+            for(int v = 0; v < nvariant; ++v){
+                for(int kn = 0; kn < nk; ++kn){
+                    nscale_p[v * ntotn + dirty_nodes[kn]] = nscale_k[v * nk + kn];
+                }
+            }
+        }
+
+        for(int v = 0; v < nvariant; ++v){
+            const int* nscale_v = nscale_p + v * ntotn;
+            int nscale = accumulate(nscale_v + rtree.nleaf, nscale_v + ntotn, 0);
+            lnl_site[p * nvariant + v] = extract_tree_lnl(L_p + (size_t) v * ntotn * nstate, rtree.nleaf - 1, model, nstate, nscale);
+        }
+    }
+    }
+}
+
+
+void update_lnl_pass(LNL_PASS& lnl_pass, const vector<int>& dirty_nodes, const evo_tree& rtree, const vector<int>& blen_per_edge, const vector<double*>& pmat_per_blen, int model, int nstate, vector<double>& lnl_site, const vector<float*>& pmat_per_blen_float){
+    const vector<int>& variants = lnl_pass.variants;
+    const int* tip_states = lnl_pass.tip_states.data();
+    if(lnl_pass.Lf.empty()){
+        auto get_site = [&](double* L_p, const int* tip_start, int* nscale_k, double* work){
+            get_likelihood_site_fused(L_p, rtree, dirty_nodes, blen_per_edge, pmat_per_blen, variants, tip_start, tip_states, model, nstate, nscale_k, work);
+        };
+        update_lnl_pass_real(lnl_pass, lnl_pass.L.data(), dirty_nodes, rtree, model, nstate, get_site, lnl_site);
+        return;
+    }
+
+    assert(pmat_per_blen_float.size() == pmat_per_blen.size());
+    auto get_site = [&](float* L_p, const int* tip_start, int* nscale_k, float* work){
+        get_likelihood_site_fused(L_p, rtree, dirty_nodes, blen_per_edge, pmat_per_blen_float, variants, tip_start, tip_states, model, nstate, nscale_k, work);
+    };
+    update_lnl_pass_real(lnl_pass, lnl_pass.Lf.data(), dirty_nodes, rtree, model, nstate, get_site, lnl_site);
+}
+
+
+void update_lnl_pass_sparse(LNL_PASS& lnl_pass, const vector<int>& dirty_nodes, const evo_tree& rtree, const vector<int>& blen_per_edge, const vector<UNIF_WEIGHTS>& unif_per_blen, const QMAT_SPARSE& qmat_sparse, int model, int nstate, vector<double>& lnl_site){
+    assert(lnl_pass.Lf.empty());
+    auto get_site = [&](double* L_p, const int* tip_start, int* nscale_k, double* work){
+        get_likelihood_site_sparse(L_p, rtree, dirty_nodes, blen_per_edge, unif_per_blen, qmat_sparse, lnl_pass.variants, model, nstate, nscale_k, work);
+    };
+    update_lnl_pass_real(lnl_pass, lnl_pass.L.data(), dirty_nodes, rtree, model, nstate, get_site, lnl_site);
+}
+
+
+bool is_sparse_pmat_faster(const QMAT_SPARSE& qmat_sparse, const vector<double>& blens, int npmat_new, long npattern, int nvariant){
+    // number of multiplications: n^3 to form each new P-matrix and n^2 for each dense product, against nnz for each term of uniformization
+    double n = qmat_sparse.n;
+    double nnz = qmat_sparse.col.size();
+    double cost_dense = npmat_new * n * n * n;
+    double cost_sparse = 0.0;
+    UNIF_WEIGHTS unif;
+    for(auto bl : blens){
+        get_uniformization_weights(qmat_sparse, bl, unif);
+        cost_dense += (double) npattern * nvariant * n * n;
+        cost_sparse += (double) npattern * nvariant * unif.nstep * unif.weights.size() * nnz;
+    }
+    return cost_sparse < cost_dense;
+}
+
+
+// U holds the derivatives of the likelihood at the root with respect to the partial likelihoods of each node, rescaled at each node as only ratios are used
+// For the branch above child c of node k, with v_c = P * L_c, the likelihood of the site is sum_s W_c(s) * v_c(s), where W_c(s) = U_k(s) * v_sibling(s) for the states filled at node k
+void get_lnl_pass_grad(const LNL_PASS& lnl_pass, int v, const evo_tree& rtree, const vector<int>& knodes, const vector<double>& pmat_edge, const vector<double>& dpmat_edge, int nderiv, int model, int nstate, vector<double>& dlnl_site){
+    int ntotn = 2 * rtree.nleaf - 1;
+    int nvariant = lnl_pass.variants.size();
+    int has_wgd = lnl_pass.variants[v] / 3;
+    int z = lnl_pass.variants[v] % 3 - 1;
+    int nedge = rtree.edges.size();
+    int npar = nedge + 2;
+    int dim_mat = nstate * nstate;
+    int root_state = 2;
+    if(model == BOUNDA) root_state = 4;
+
+    // states filled at the internal nodes other than the root, as in get_likelihood_site_fused
+    vector<int> is_filled(nstate, 0);
+    for(int sk = 0; sk < nstate; ++sk){
+        int nsk = sk;
+        if(has_wgd) nsk = 2 * sk;
+        nsk += z;
+        if(nsk < 0 || nsk >= nstate) continue;
+        is_filled[nsk] = 1;
+    }
+
+    dlnl_site.assign((size_t) lnl_pass.npattern * npar, 0.0);
+
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+    vector<double> U((size_t) ntotn * nstate, 0.0);
+    vector<double> vc[2] = {vector<double>(nstate, 0.0), vector<double>(nstate, 0.0)};
+    vector<double> W(nstate, 0.0);
+    #ifdef _OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for(int p = 0; p < lnl_pass.npattern; ++p){
+        const double* L_sk_k = lnl_pass.L.data() + ((size_t) p * nvariant + v) * ntotn * nstate;
+        double* dlnl = dlnl_site.data() + (size_t) p * npar;
+
+        fill(U.begin(), U.end(), 0.0);
+        U[rtree.nleaf * nstate + root_state] = 1.0;
+
+        // knodes is in post-order, so parents are visited before children in reverse order
+        for(int kn = knodes.size() - 1; kn >= 0; --kn){
+            int k = knodes[kn];
+            const double* U_k = U.data() + k * nstate;
+            int eids[2] = {rtree.nodes[k].e_ot[0], rtree.nodes[k].e_ot[1]};
+
+            for(int i = 0; i < 2; i++){
+                const double* pmat = pmat_edge.data() + (size_t) eids[i] * dim_mat;
+                const double* L_c = L_sk_k + rtree.edges[eids[i]].end * nstate;
+                for(int s = 0; s < nstate; ++s){
+                    double vs = 0.0;
+                    for(int y = 0; y < nstate; ++y){
+                        vs += pmat[s + y * nstate] * L_c[y];
+                    }
+                    vc[i][s] = vs;
+                }
+            }
+
+            for(int i = 0; i < 2; i++){
+                int eid = eids[i];
+                int c = rtree.edges[eid].end;
+                const double* L_c = L_sk_k + c * nstate;
+
+                double lnl = 0.0;
+                for(int s = 0; s < nstate; ++s){
+                    W[s] = 0.0;
+                    if(k != rtree.nleaf && !is_filled[s]) continue;
+                    W[s] = U_k[s] * vc[1 - i][s];
+                    lnl += W[s] * vc[i][s];
+                }
+                // the site is impossible
+                if(lnl <= 0) continue;
+
+                for(int d = 0; d < nderiv; d++){
+                    const double* dpmat = dpmat_edge.data() + ((size_t) eid * nderiv + d) * dim_mat;
+                    double dl = 0.0;
+                    for(int s = 0; s < nstate; ++s){
+                        if(W[s] == 0) continue;
+                        double dvs = 0.0;
+                        for(int y = 0; y < nstate; ++y){
+                            dvs += dpmat[s + y * nstate] * L_c[y];
+                        }
+                        dl += W[s] * dvs;
+                    }
+                    // the first derivative is for the branch length, the others for the rates of duplication and deletion
+                    if(d == 0) dlnl[eid] += dl / lnl;
+                    else dlnl[nedge + d - 1] += dl / lnl;
+                }
+
+                if(c >= rtree.nleaf){
+                    const double* pmat = pmat_edge.data() + (size_t) eid * dim_mat;
+                    double* U_c = U.data() + c * nstate;
+                    double umax = 0.0;
+                    for(int y = 0; y < nstate; ++y){
+                        double uy = 0.0;
+                        for(int s = 0; s < nstate; ++s){
+                            uy += W[s] * pmat[s + y * nstate];
+                        }
+                        U_c[y] = uy;
+                        umax = max(umax, uy);
+                    }
+                    if(umax > 0){
+                        for(int y = 0; y < nstate; ++y){
+                            U_c[y] /= umax;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    }
+}
+
+
+void get_lnl_pass_edge(const LNL_PASS& lnl_pass, const evo_tree& rtree, const vector<int>& knodes, int eid, const vector<double*>& pmat_per_edge, const double* qmat, int model, int nstate, const vector<double>& lnl_site, LNL_EDGE& lnl_edge){
+    int ntotn = 2 * rtree.nleaf - 1;
+    int nvariant = lnl_pass.variants.size();
+    int npv = lnl_pass.npattern * nvariant;
+    int root_state = 2;
+    if(model == BOUNDA) root_state = 4;
+
+    // states filled at the internal nodes other than the root for each variant, as in get_lnl_pass_grad
+    vector<vector<int>> is_filled(nvariant, vector<int>(nstate, 0));
+    for(int v = 0; v < nvariant; v++){
+        int has_wgd = lnl_pass.variants[v] / 3;
+        int z = lnl_pass.variants[v] % 3 - 1;
+        for(int sk = 0; sk < nstate; ++sk){
+            int nsk = sk;
+            if(has_wgd) nsk = 2 * sk;
+            nsk += z;
+            if(nsk < 0 || nsk >= nstate) continue;
+            is_filled[v][nsk] = 1;
+        }
+    }
+
+    // edges from the root to edge eid, following the edges below knodes
+    vector<int> eid_in(ntotn, -1);
+    for(auto k : knodes){
+        for(int i = 0; i < 2; i++){
+            int e = rtree.nodes[k].e_ot[i];
+            eid_in[rtree.edges[e].end] = e;
+        }
+    }
+    vector<int> path;
+    for(int e = eid; e >= 0; e = eid_in[rtree.edges[e].start]){
+        path.push_back(e);
+    }
+    reverse(path.begin(), path.end());
+
+    lnl_edge.nstate = nstate;
+    lnl_edge.npattern = lnl_pass.npattern;
+    lnl_edge.variants = lnl_pass.variants;
+    lnl_edge.W.assign((size_t) npv * 3 * nstate, 0.0);
+    lnl_edge.L_c.assign((size_t) npv * nstate, 0.0);
+    lnl_edge.offset.assign(npv, LARGE_LNL);
+
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+    vector<double> U(nstate, 0.0);
+    #ifdef _OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for(int pv = 0; pv < npv; ++pv){
+        const vector<int>& filled = is_filled[pv % nvariant];
+        const double* L_sk_k = lnl_pass.L.data() + (size_t) pv * ntotn * nstate;
+        double* W = lnl_edge.W.data() + (size_t) pv * 3 * nstate;
+
+        // W at each edge of the path is the likelihood above its parent times that of the subtree on the other side
+        fill(U.begin(), U.end(), 0.0);
+        U[root_state] = 1.0;
+        for(int i = 0; i < path.size(); i++){
+            int e = path[i];
+            int k = rtree.edges[e].start;
+            int e_sib = rtree.nodes[k].e_ot[0] == e ? rtree.nodes[k].e_ot[1] : rtree.nodes[k].e_ot[0];
+            const double* pmat_sib = pmat_per_edge[e_sib];
+            const double* L_sib = L_sk_k + rtree.edges[e_sib].end * nstate;
+            for(int s = 0; s < nstate; ++s){
+                W[s] = 0.0;
+                if(k != rtree.nleaf && !filled[s]) continue;
+                double vs = 0.0;
+                for(int y = 0; y < nstate; ++y){
+                    vs += pmat_sib[s + y * nstate] * L_sib[y];
+                }
+                W[s] = U[s] * vs;
+            }
+            if(i == path.size() - 1) break;
+
+            const double* pmat = pmat_per_edge[e];
+            double umax = 0.0;
+            for(int y = 0; y < nstate; ++y){
+                double uy = 0.0;
+                for(int s = 0; s < nstate; ++s){
+                    uy += W[s] * pmat[s + y * nstate];
+                }
+                U[y] = uy;
+                umax = max(umax, uy);
+            }
+            if(umax > 0){
+                for(int y = 0; y < nstate; ++y){
+                    U[y] /= umax;
+                }
+            }
+        }
+
+        double* WQ = W + nstate;
+        double* WQ2 = W + 2 * nstate;
+        for(int y = 0; y < nstate; ++y){
+            double wq = 0.0;
+            for(int s = 0; s < nstate; ++s){
+                wq += W[s] * qmat[s + y * nstate];
+            }
+            WQ[y] = wq;
+        }
+        for(int y = 0; y < nstate; ++y){
+            double wq2 = 0.0;
+            for(int s = 0; s < nstate; ++s){
+                wq2 += WQ[s] * qmat[s + y * nstate];
+            }
+            WQ2[y] = wq2;
+        }
+
+        const double* L_c = L_sk_k + rtree.edges[eid].end * nstate;
+        copy(L_c, L_c + nstate, lnl_edge.L_c.begin() + (size_t) pv * nstate);
+
+        // the rescaling of W and L_c is kept in the offset to the log likelihood of the site
+        const double* pmat = pmat_per_edge[eid];
+        double lnl = 0.0;
+        for(int s = 0; s < nstate; ++s){
+            if(W[s] == 0) continue;
+            double vs = 0.0;
+            for(int y = 0; y < nstate; ++y){
+                vs += pmat[s + y * nstate] * L_c[y];
+            }
+            lnl += W[s] * vs;
+        }
+        if(lnl > 0 && lnl_site[pv] > LARGE_LNL){
+            lnl_edge.offset[pv] = lnl_site[pv] - log(lnl);
+        }
+    }
+    }
+}
+
+
+void get_lnl_edge_deriv(const LNL_EDGE& lnl_edge, const double* pmat, vector<double>& lnl_site, vector<double>& dlnl_site, vector<double>& d2lnl_site){
+    int nstate = lnl_edge.nstate;
+    int npv = lnl_edge.offset.size();
+    lnl_site.resize(npv);
+    dlnl_site.resize(npv);
+    d2lnl_site.resize(npv);
+
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+    vector<double> vc(nstate, 0.0);
+    #ifdef _OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for(int pv = 0; pv < npv; ++pv){
+        lnl_site[pv] = LARGE_LNL;
+        dlnl_site[pv] = 0.0;
+        d2lnl_site[pv] = 0.0;
+        // the site is impossible
+        if(lnl_edge.offset[pv] <= LARGE_LNL) continue;
+
+        const double* L_c = lnl_edge.L_c.data() + (size_t) pv * nstate;
+        for(int s = 0; s < nstate; ++s){
+            double vs = 0.0;
+            for(int y = 0; y < nstate; ++y){
+                vs += pmat[s + y * nstate] * L_c[y];
+            }
+            vc[s] = vs;
+        }
+
+        // W * P(t) * L_c and its derivatives W * Q * P(t) * L_c and W * Q^2 * P(t) * L_c
+        const double* W = lnl_edge.W.data() + (size_t) pv * 3 * nstate;
+        double lnl = 0.0, dl = 0.0, d2l = 0.0;
+        for(int s = 0; s < nstate; ++s){
+            lnl += W[s] * vc[s];
+            dl += W[nstate + s] * vc[s];
+            d2l += W[2 * nstate + s] * vc[s];
+        }
+        if(lnl <= 0) continue;
+
+        lnl_site[pv] = log(lnl) + lnl_edge.offset[pv];
+        dlnl_site[pv] = dl / lnl;
+        d2lnl_site[pv] = d2l / lnl - dlnl_site[pv] * dlnl_site[pv];
+    }
+    }
+}
+
+
+void init_lnl_pass_decomp(LNL_PASS& lnl_pass, map<int, vector<vector<int>>>& sites, OBS_DECOMP& obs_decomp, const evo_tree& rtree, const set<vector<int>>& comps, int infer_wgd, int infer_chr, int cn_max, int is_total){
+    int ntotn = 2 * rtree.nleaf - 1;
+    int nstate = comps.size();
+    alloc_lnl_pass(lnl_pass, sites, ntotn, nstate, vector<int>{1});
+
+    int p = 0;
+    for(auto& it : sites){
+        for(auto& obs : it.second){
+            initialize_lnl_table_decomp(lnl_pass.L.data() + (size_t) p * ntotn * nstate, obs, obs_decomp, it.first, rtree, comps, infer_wgd, infer_chr, cn_max, is_total);
+            p++;
+        }
+    }
+}
+
+
+void update_lnl_pass_decomp(LNL_PASS& lnl_pass, const vector<int>& dirty_nodes, const evo_tree& rtree, const COMP_DECOMP& comp_decomp, PMAT_DECOMP& pmat_decomp, vector<double>& lnl_site){
+    int ntotn = 2 * rtree.nleaf - 1;
+    int nstate = comp_decomp.nstate;
+    lnl_site.resize(lnl_pass.npattern);
+
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+    vector<int> nscale_k(dirty_nodes.size(), 0);
+    vector<double> work(2 * comp_decomp.max_entry + 2 * nstate);
+    #ifdef _OPENMP
+    #pragma omp for schedule(static)
+    #endif
+    for(int p = 0; p < lnl_pass.npattern; ++p){
+        double* L_sk_k = lnl_pass.L.data() + (size_t) p * ntotn * nstate;
+        int* nscale_p = lnl_pass.nscale.data() + (size_t) p * ntotn;
+
+        if(!dirty_nodes.empty()){
+            // only the normal state is filled at the root, so the old values have to be cleared
+            for(auto k : dirty_nodes){
+                fill(L_sk_k + k * nstate, L_sk_k + (k + 1) * nstate, 0.0);
+            }
+            get_likelihood_site_decomp(L_sk_k, rtree, comp_decomp, dirty_nodes, pmat_decomp, work.data(), nscale_k.data());
+            for(int kn = 0; kn < dirty_nodes.size(); ++kn){
+                nscale_p[dirty_nodes[kn]] = nscale_k[kn];
+            }
+        }
+
+        int nscale = accumulate(nscale_p + rtree.nleaf, nscale_p + ntotn, 0);
+        lnl_site[p] = extract_tree_lnl_decomp(L_sk_k, comp_decomp, rtree.nleaf - 1, nscale);
+    }
+    }
+}
+
+
+double get_likelihood_variants(map<int, vector<vector<int>>>& sites, const map<int, vector<int>>& site_weight, const vector<double>& lnl_variant, const vector<int>& variants, int npattern, const evo_tree& rtree, int only_seg){
+  int nvariant = variants.size();
+  double logL = 0.0;
+
+  int max_wgd = only_seg ? 0 : 1;
+  for(int has_wgd = 0; has_wgd <= max_wgd; has_wgd++){
+      // log likelihood of each site pattern after chromosome loss, without chromosome change and after chromosome gain
+      vector<double> lnl_site[3];
+      for(int v = 0; v < nvariant; v++){
+          if(variants[v] / 3 != has_wgd) continue;
+          vector<double>& lnl_z = lnl_site[variants[v] % 3];
+          lnl_z.resize(npattern);
+          for(int p = 0; p < npattern; p++){
+              lnl_z[p] = lnl_variant[p * nvariant + v];
+          }
+      }
+
+      double lnl_chr = get_likelihood_chr(sites, site_weight, lnl_site[1], lnl_site[0], lnl_site[2], rtree, only_seg);
+      if(only_seg){
+          // if(debug) cout << "Computing the likelihood without consideration of WGD" << endl;
+          logL += lnl_chr;
+      }else{
+          // if(debug) cout << "Computing the likelihood with consideration of WGD" << endl;
+          logL += has_wgd ? rtree.wgd_rate * lnl_chr : (1 - rtree.wgd_rate) * lnl_chr;
+      }
+  }
+
+  return logL;
+}
+
+
+double get_likelihood_variants_deriv(map<int, vector<vector<int>>>& sites, const map<int, vector<int>>& site_weight, const vector<double>& lnl_variant, const vector<double>& dlnl_variant, const vector<double>& d2lnl_variant, const vector<int>& variants, int npattern, const evo_tree& rtree, int only_seg, double& dlnl, double& d2lnl){
+  int nvariant = variants.size();
+  double logL = 0.0;
+  dlnl = 0.0;
+  d2lnl = 0.0;
+
+  int max_wgd = only_seg ? 0 : 1;
+  for(int has_wgd = 0; has_wgd <= max_wgd; has_wgd++){
+      vector<double> lnl_site[3];
+      vector<double> dlnl_site[3];
+      vector<double> d2lnl_site[3];
+      for(int v = 0; v < nvariant; v++){
+          if(variants[v] / 3 != has_wgd) continue;
+          int iz = variants[v] % 3;
+          lnl_site[iz].resize(npattern);
+          dlnl_site[iz].resize(npattern);
+          d2lnl_site[iz].resize(npattern);
+          for(int p = 0; p < npattern; p++){
+              lnl_site[iz][p] = lnl_variant[p * nvariant + v];
+              dlnl_site[iz][p] = dlnl_variant[p * nvariant + v];
+              d2lnl_site[iz][p] = d2lnl_variant[p * nvariant + v];
+          }
+      }
+
+      double dlnl_chr, d2lnl_chr;
+      double lnl_chr = get_likelihood_chr_deriv(sites, site_weight, lnl_site, dlnl_site, d2lnl_site, rtree, only_seg, dlnl_chr, d2lnl_chr);
+      double weight = 1.0;
+      if(!only_seg){
+          weight = has_wgd ? rtree.wgd_rate : 1 - rtree.wgd_rate;
+      }
+      logL += weight * lnl_chr;
+      dlnl += weight * dlnl_chr;
+      d2lnl += weight * d2lnl_chr;
+  }
+
+  return logL;
+}
+
+
+// Incorporate chromosome gain/loss and WGD
+// Model 2: Treat total copy number as the observed data and the allele-specific information is missing
+double get_likelihood_revised(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type){
+  // int debug = 0;
+  // if(debug) cout << "\tget_likelihood by matrix exponential" << endl;
+
+  if(!is_tree_valid(rtree, lnl_type.max_tobs, lnl_type.patient_age, lnl_type.cons)){
+       return SMALL_LNL;
+   }
+
+  int model = lnl_type.model;
+  int cn_max = lnl_type.cn_max;
+  int is_total = lnl_type.is_total;
+
+  // For copy number instantaneous changes
+  int nstate = cn_max + 1;
+  if(model == BOUNDA) nstate = (cn_max + 1) * (cn_max + 2) / 2;
+
+  // may be different for each tree due to change of mutation rate
   int dim_mat = nstate * nstate;
   double *qmat = new double[dim_mat];
   memset(qmat, 0.0, dim_mat * sizeof(double));
 
-  // model == BOUNDT || model == BOUNDA
-  assert(model > 0);
+  // P(t) of the Mk model is obtained in closed form, without Q
   if(model == BOUNDA){
       get_rate_matrix_allele_specific(qmat, rtree.dup_rate, rtree.del_rate, cn_max);
-  }else{
+  }else if(model == BOUNDT){
       get_rate_matrix_bounded(qmat, rtree.dup_rate, rtree.del_rate, cn_max);
   }
 
@@ -732,45 +1914,21 @@ double get_likelihood_revised(evo_tree& rtree, map<int, vector<vector<int>>>& vo
   //   check_matrix_row_sum(qmat, nstate);
   // }
 
-  // Find the transition probability matrix for each branch
+  // P(t) of all the branches are obtained from the same decomposition of Q
+  if(model != MK) get_eigen_decomposition(qmat, nstate, lnl_type.qmat_eigen);
+
+  // Find the distinct branch lengths, with the index of each edge for the kernels to look up their transition probabilities
+  PMAT_CACHE& pmat_cache = lnl_type.pmat_cache;
+  start_pmat_cache(pmat_cache, qmat, nstate);
   vector<int> knodes = lnl_type.knodes;
-  // map<double, double*> pmats;
   vector<double> blens;
+  vector<int> blen_per_edge;
   vector<double*> pmat_per_blen;
-
-  for(int kn = 0; kn < knodes.size(); ++kn){
-    int k = knodes[kn];
-    double bli = rtree.edges[rtree.nodes[k].e_ot[0]].length;
-    double blj = rtree.edges[rtree.nodes[k].e_ot[1]].length;
-
-    if(find(blens.begin(), blens.end(), bli) == blens.end()){
-        double *pmati = new double[dim_mat];
-        memset(pmati, 0.0, dim_mat * sizeof(double));
-        get_transition_matrix_bounded(qmat, pmati, bli, nstate);
-        pmat_per_blen.push_back(pmati);
-        blens.push_back(bli);
-        // if(debug){
-        //     cout << "Get Pmatrix for branch length " << bli << endl;
-        //     r8mat_print(nstate, nstate, pmati, "  P matrix:" );
-        // }
-    }
-    if(find(blens.begin(), blens.end(), blj) == blens.end()){
-        double *pmatj = new double[dim_mat];
-        memset(pmatj, 0.0, dim_mat * sizeof(double));
-        get_transition_matrix_bounded(qmat, pmatj, blj, nstate);
-        pmat_per_blen.push_back(pmatj);
-        blens.push_back(blj);
-        // if(debug){
-        //     cout << "Get Pmatrix for branch length " << blj << endl;
-        //     r8mat_print(nstate, nstate, pmatj, "  P matrix:" );
-        // }
-    }
-  }
-
-  // sort pmats according to branch lengths
-  auto p = sort_permutation(blens, [&](const double& a, const double& b){ return a < b; });
-  blens = apply_permutation(blens, p);
-  pmat_per_blen = apply_permutation(pmat_per_blen, p);
+  vector<float*> pmat_per_blen_float;
+  vector<double> pmats_mk;
+  vector<float> pmats_mk_float;
+  add_distinct_blens(rtree, knodes, blens);
+  get_blen_per_edge(rtree, knodes, blens, blen_per_edge);
 
   // if(debug){
   //     for(int i = 0; i < pmat_per_blen.size(); ++i){
@@ -780,16 +1938,62 @@ double get_likelihood_revised(evo_tree& rtree, map<int, vector<vector<int>>>& vo
   //     }
   // }
 
+  // Evaluate each unique site pattern once if the patterns have been extracted from vobs
+  map<int, vector<vector<int>>>& sites = lnl_type.site_pattern.obs.empty() ? vobs : lnl_type.site_pattern.obs;
+  const map<int, vector<int>>& site_weight = lnl_type.site_pattern.weight;
+
+  // partial likelihoods kept from the previous call, only valid for the same rates of duplication/deletion
+  LNL_CACHE& lnl_cache = lnl_type.lnl_cache;
+  vector<double> rates{rtree.mu, rtree.dup_rate, rtree.del_rate};
+  check_lnl_cache(lnl_cache, lnl_type.data_version, 2 * rtree.nleaf - 1, nstate, rates);
+
   double logL = 0.0;
 
-  if(lnl_type.only_seg){
-      // if(debug) cout << "Computing the likelihood without consideration of WGD" << endl;
-      logL += get_likelihood_chr(vobs, rtree, knodes, blens, pmat_per_blen, 0, lnl_type.only_seg, lnl_type.use_repeat, model, nstate, is_total);
+  // all the combinations of WGD status and chromosome change are computed in one traversal
+  vector<int> variants = get_lnl_variants(rtree, lnl_type.only_seg);
+  int nvariant = variants.size();
+  // the tables in single precision are kept apart, so that switching precision does not recompute the other ones
+  LNL_PASS& lnl_pass = lnl_type.use_float ? lnl_cache.passes[PASS_SITES_FLOAT] : lnl_cache.passes[PASS_SITES];
+  if((lnl_pass.L.empty() && lnl_pass.Lf.empty()) || lnl_pass.variants != variants){
+      init_lnl_pass(lnl_pass, sites, rtree, model, nstate, is_total, variants, lnl_type.use_float);
+  }
+  vector<int> dirty_nodes = get_dirty_nodes(lnl_pass, rtree, knodes);
+
+  // For many states and few site patterns, P(t) is applied to the partial likelihoods by uniformization with the sparse rate matrix
+  // Otherwise, the transition matrix of each branch is formed, only computing those not used in previous calls with the same rates
+  // The choice is made for a full traversal of the tree, so that it does not depend on the nodes or matrices kept from previous calls
+  bool use_sparse = false;
+  vector<UNIF_WEIGHTS> unif_per_blen;
+  if(model != MK && !lnl_type.use_float && nstate > MAX_NSTATE_DENSE){
+      get_sparse_rate_matrix(qmat, nstate, lnl_type.qmat_sparse);
+      vector<double> blens_all;
+      for(auto k : knodes){
+          for(int i = 0; i < 2; i++){
+              blens_all.push_back(rtree.edges[rtree.nodes[k].e_ot[i]].length);
+          }
+      }
+      use_sparse = is_sparse_pmat_faster(lnl_type.qmat_sparse, blens_all, blens.size(), lnl_pass.npattern, nvariant);
+  }
+  if(use_sparse){
+      unif_per_blen.resize(blens.size());
+      for(int i = 0; i < blens.size(); i++){
+          get_uniformization_weights(lnl_type.qmat_sparse, blens[i], unif_per_blen[i]);
+      }
+  }else if(model == MK){
+      get_pmats_mk(rtree.mu, nstate, blens, pmats_mk, pmat_per_blen, &pmats_mk_float, lnl_type.use_float ? &pmat_per_blen_float : NULL);
+  }else{
+      get_pmats_cached(pmat_cache, lnl_type.qmat_eigen, blens, pmat_per_blen, lnl_type.use_float ? &pmat_per_blen_float : NULL);
+  }
+
+  vector<double> lnl_variant;
+  if(use_sparse){
+      update_lnl_pass_sparse(lnl_pass, dirty_nodes, rtree, blen_per_edge, unif_per_blen, lnl_type.qmat_sparse, model, nstate, lnl_variant);
   }else{
-      // if(debug) cout << "Computing the likelihood with consideration of WGD" << endl;
-      logL += (1 - rtree.wgd_rate) * get_likelihood_chr(vobs, rtree, knodes, blens, pmat_per_blen, 0, lnl_type.only_seg, lnl_type.use_repeat, model, nstate, is_total);
-      logL += rtree.wgd_rate * get_likelihood_chr(vobs, rtree, knodes, blens, pmat_per_blen, 1, lnl_type.only_seg, lnl_type.use_repeat, model, nstate, is_total);
+      update_lnl_pass(lnl_pass, dirty_nodes, rtree, blen_per_edge, pmat_per_blen, model, nstate, lnl_variant, pmat_per_blen_float);
   }
+  set_clean_nodes(lnl_pass, rtree, dirty_nodes);
+
+  logL += get_likelihood_variants(sites, site_weight, lnl_variant, variants, lnl_pass.npattern, rtree, lnl_type.only_seg);
 
 
   // if(debug) cout << "Final likelihood before correcting acquisition bias: " << logL << endl;
@@ -798,56 +2002,28 @@ double get_likelihood_revised(evo_tree& rtree, map<int, vector<vector<int>>>& vo
       // if(debug) cout << "Correcting for the skip of invariant sites" << endl;
 
       // Compute the likelihood of dummy sites consisting entirely of 2s for the tree
-      double lnl_invar = 0.0;
       // Suppose the value is 2 for all samples
       int normal_cn = 2;
       if(!is_total){
           normal_cn = 4;
       }
 
-      vector<int> obs(rtree.nleaf - 1, normal_cn);
-      vector<vector<double>> L_sk_k(2 * rtree.nleaf - 1, vector<double>(nstate, 0.0));
-      initialize_lnl_table(L_sk_k, obs, rtree, model, nstate, is_total);
-
-      for(int kn = 0; kn < knodes.size(); ++kn){
-          int k = knodes[kn];
-          int ni = rtree.edges[rtree.nodes[k].e_ot[0]].end;
-          double bli = rtree.edges[rtree.nodes[k].e_ot[0]].length;
-          int nj = rtree.edges[rtree.nodes[k].e_ot[1]].end;
-          double blj = rtree.edges[rtree.nodes[k].e_ot[1]].length;
-
-          DBIterPair pi = equal_range(blens.begin(), blens.end(), bli);
-          // assert(distance(pi.first, pi.second) == 1);
-          int idx_bli = distance(blens.begin(), pi.first);
-          DBIterPair pj = equal_range(blens.begin(), blens.end(), blj);
-          // assert(distance(pj.first, pj.second) == 1);
-          int idx_blj = distance(blens.begin(), pj.first);
-
-          //loop over possible values of sk
-          for(int sk = 0; sk < nstate; ++sk){
-            double Li = 0.0;
-            for(int si = 0; si < nstate; ++si){
-                if(model == MK){
-                  Li += get_transition_prob(rtree.mu, bli, sk, si) * L_sk_k[ni][si];
-                }else{
-                  Li += pmat_per_blen[idx_bli][sk + si * nstate] * L_sk_k[ni][si];
-                }
-            }
-            double Lj = 0.0;
-            for(int sj = 0; sj < nstate; ++sj){
-                if(model == MK){
-                     Lj += get_transition_prob(rtree.mu, blj, sk, sj) * L_sk_k[nj][sj];
-                }else{
-                     Lj += pmat_per_blen[idx_blj][sk + sj * nstate] * L_sk_k[nj][sj];
-                }
-            }
-
-            L_sk_k[k][sk] = Li * Lj;
-         }
+      LNL_PASS& lnl_pass = lnl_cache.passes[PASS_INVAR];
+      if(lnl_pass.L.empty()){
+          map<int, vector<vector<int>>> invar_sites{{0, {vector<int>(rtree.nleaf - 1, normal_cn)}}};
+          init_lnl_pass(lnl_pass, invar_sites, rtree, model, nstate, is_total, vector<int>{1});
       }
+      vector<int> dirty_nodes = get_dirty_nodes(lnl_pass, rtree, knodes);
+      vector<double> lnl_site;
+      if(use_sparse){
+          update_lnl_pass_sparse(lnl_pass, dirty_nodes, rtree, blen_per_edge, unif_per_blen, lnl_type.qmat_sparse, model, nstate, lnl_site);
+      }else{
+          update_lnl_pass(lnl_pass, dirty_nodes, rtree, blen_per_edge, pmat_per_blen, model, nstate, lnl_site);
+      }
+      set_clean_nodes(lnl_pass, rtree, dirty_nodes);
+      double lnl_invar = lnl_site[0];
 
-      lnl_invar = extract_tree_lnl(L_sk_k, rtree.nleaf - 1, model);
-
+      // always in double precision, as it is multiplied by the number of invariant bins
       double bias = lnl_type.num_invar_bins * lnl_invar;
       logL = logL + bias;
 
@@ -865,11 +2041,435 @@ double get_likelihood_revised(evo_tree& rtree, map<int, vector<vector<int>>>& vo
   // }
 
   delete [] qmat;
-  for_each(pmat_per_blen.begin(), pmat_per_blen.end(), DeleteObject());
+  end_pmat_cache(pmat_cache);
 
   return logL;
 }
 
+vector<double> get_likelihood_revised_batch(vector<evo_tree>& trees, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type){
+  int ntree = trees.size();
+  vector<double> lnls(ntree, SMALL_LNL);
+
+  vector<int> tids;   // valid trees
+  for(int t = 0; t < ntree; t++){
+      if(is_tree_valid(trees[t], lnl_type.max_tobs, lnl_type.patient_age, lnl_type.cons)){
+          tids.push_back(t);
+      }
+  }
+  if(tids.empty()) return lnls;
+
+  // the rate matrix and the variants are only shared by trees with the same rates
+  const evo_tree& rtree = trees[tids[0]];
+  bool same_rates = true;
+  for(auto t : tids){
+      const evo_tree& ti = trees[t];
+      if(ti.nleaf != rtree.nleaf || ti.mu != rtree.mu || ti.dup_rate != rtree.dup_rate || ti.del_rate != rtree.del_rate || ti.chr_gain_rate != rtree.chr_gain_rate || ti.chr_loss_rate != rtree.chr_loss_rate || ti.wgd_rate != rtree.wgd_rate){
+          same_rates = false;
+          break;
+      }
+  }
+  if(!same_rates){
+      for(auto t : tids){
+          lnls[t] = get_likelihood_revised(trees[t], vobs, lnl_type);
+      }
+      return lnls;
+  }
+
+  int model = lnl_type.model;
+  int cn_max = lnl_type.cn_max;
+  int is_total = lnl_type.is_total;
+  int nstate = cn_max + 1;
+  if(model == BOUNDA) nstate = (cn_max + 1) * (cn_max + 2) / 2;
+  int dim_mat = nstate * nstate;
+  int ntotn = 2 * rtree.nleaf - 1;
+  size_t dim_table = (size_t) ntotn * nstate;
+  vector<int> knodes = lnl_type.knodes;
+
+  double *qmat = new double[dim_mat];
+  memset(qmat, 0.0, dim_mat * sizeof(double));
+  if(model == BOUNDA){
+      get_rate_matrix_allele_specific(qmat, rtree.dup_rate, rtree.del_rate, cn_max);
+  }else if(model == BOUNDT){
+      get_rate_matrix_bounded(qmat, rtree.dup_rate, rtree.del_rate, cn_max);
+  }
+  if(model != MK) get_eigen_decomposition(qmat, nstate, lnl_type.qmat_eigen);
+
+  // one P-matrix for each distinct branch length in all the trees, sorted by branch length
+  vector<double> blens;
+  for(auto t : tids){
+      add_distinct_blens(trees[t], knodes, blens);
+  }
+  PMAT_CACHE& pmat_cache = lnl_type.pmat_cache;
+  start_pmat_cache(pmat_cache, qmat, nstate);
+  vector<double*> pmat_per_blen;
+  vector<double> pmats_mk;
+  if(model == MK){
+      get_pmats_mk(rtree.mu, nstate, blens, pmats_mk, pmat_per_blen);
+  }else{
+      get_pmats_cached(pmat_cache, lnl_type.qmat_eigen, blens, pmat_per_blen);
+  }
+  vector<vector<int>> blen_per_edge(tids.size());
+  for(int b = 0; b < tids.size(); b++){
+      get_blen_per_edge(trees[tids[b]], knodes, blens, blen_per_edge[b]);
+  }
+
+  map<int, vector<vector<int>>>& sites = lnl_type.site_pattern.obs.empty() ? vobs : lnl_type.site_pattern.obs;
+  const map<int, vector<int>>& site_weight = lnl_type.site_pattern.weight;
+  vector<const vector<int>*> patterns;
+  for(auto& it : sites){
+      for(auto& obs : it.second){
+          patterns.push_back(&obs);
+      }
+  }
+  int npattern = patterns.size();
+
+  vector<int> variants = get_lnl_variants(rtree, lnl_type.only_seg);
+  int nvariant = variants.size();
+  int nbatch = tids.size();
+  // log likelihood of variant v of pattern p for the b-th valid tree at lnl_variant[b][p * nvariant + v]
+  vector<vector<double>> lnl_variant(nbatch, vector<double>((size_t) npattern * nvariant, 0.0));
+
+  // the site patterns are streamed once, and all the trees are computed with the tips of a pattern filled once
+  #ifdef _OPENMP
+  #pragma omp parallel
+  #endif
+  {
+  LNL_BUFFER lnl_buffer;
+  double* L_tip = lnl_buffer.reserve(ntotn, nstate);
+  AlignedVector L((size_t) nvariant * dim_table, 0.0);
+  vector<int> nscale_k(nvariant * knodes.size(), 0);
+  vector<double> v_tip(4 * nstate, 0.0);
+  vector<int> tip_start, tip_states;
+  #ifdef _OPENMP
+  #pragma omp for schedule(static)
+  #endif
+  for(int p = 0; p < npattern; ++p){
+      initialize_lnl_table(L_tip, *patterns[p], rtree, model, nstate, is_total);
+      tip_start.assign(1, 0);
+      tip_states.clear();
+      add_tip_states(L_tip, rtree.nleaf, nstate, tip_start, tip_states);
+      for(int b = 0; b < nbatch; b++){
+          const evo_tree& ti = trees[tids[b]];
+          for(int v = 0; v < nvariant; v++){
+              // rows of the tips are copied, and those of internal nodes are cleared as only reachable states are filled
+              copy(L_tip, L_tip + dim_table, L.data() + v * dim_table);
+          }
+          get_likelihood_site_fused(L.data(), ti, knodes, blen_per_edge[b], pmat_per_blen, variants, tip_start.data(), tip_states.data(), model, nstate, nscale_k.data(), v_tip.data());
+          for(int v = 0; v < nvariant; v++){
+              int nscale = accumulate(nscale_k.begin() + v * knodes.size(), nscale_k.begin() + (v + 1) * knodes.size(), 0);
+              lnl_variant[b][p * nvariant + v] = extract_tree_lnl(L.data() + v * dim_table, ti.nleaf - 1, model, nstate, nscale);
+          }
+      }
+  }
+  }
+
+  // log likelihood of an invariant bin for each tree
+  vector<double> lnl_invar(nbatch, 0.0);
+  if(lnl_type.correct_bias){
+      int normal_cn = 2;
+      if(!is_total){
+          normal_cn = 4;
+      }
+      vector<int> obs(rtree.nleaf - 1, normal_cn);
+      vector<int> variant_invar{1};
+      AlignedVector L(dim_table, 0.0);
+      vector<int> nscale_k(knodes.size(), 0);
+      vector<double> v_tip(4 * nstate, 0.0);
+      vector<int> tip_start{0}, tip_states;
+      initialize_lnl_table(L.data(), obs, rtree, model, nstate, is_total);
+      add_tip_states(L.data(), rtree.nleaf, nstate, tip_start, tip_states);
+      for(int b = 0; b < nbatch; b++){
+          const evo_tree& ti = trees[tids[b]];
+          initialize_lnl_table(L.data(), obs, ti, model, nstate, is_total);
+          get_likelihood_site_fused(L.data(), ti, knodes, blen_per_edge[b], pmat_per_blen, variant_invar, tip_start.data(), tip_states.data(), model, nstate, nscale_k.data(), v_tip.data());
+          int nscale = accumulate(nscale_k.begin(), nscale_k.end(), 0);
+          lnl_invar[b] = extract_tree_lnl(L.data(), ti.nleaf - 1, model, nstate, nscale);
+      }
+  }
+
+  for(int b = 0; b < nbatch; b++){
+      evo_tree& ti = trees[tids[b]];
+      double logL = get_likelihood_variants(sites, site_weight, lnl_variant[b], variants, npattern, ti, lnl_type.only_seg);
+      if(lnl_type.correct_bias){
+          logL += lnl_type.num_invar_bins * lnl_invar[b];
+      }
+      if(std::isnan(logL) || logL < SMALL_LNL) logL = SMALL_LNL;
+      lnls[tids[b]] = logL;
+  }
+
+  delete [] qmat;
+  end_pmat_cache(pmat_cache);
+
+  return lnls;
+}
+
+
+double get_likelihood_revised_grad(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type, vector<double>& grad, int is_rate_grad){
+  int nedge = rtree.edges.size();
+  grad.assign(nedge + 5, 0.0);
+
+  // the partial likelihoods of all the nodes in each pass are kept in lnl_type.lnl_cache, in double precision for the derivatives
+  int use_float = lnl_type.use_float;
+  lnl_type.use_float = 0;
+  double logL = get_likelihood_revised(rtree, vobs, lnl_type);
+  lnl_type.use_float = use_float;
+  if(logL <= SMALL_LNL){
+      return logL;
+  }
+
+  int model = lnl_type.model;
+  int cn_max = lnl_type.cn_max;
+  int only_seg = lnl_type.only_seg;
+
+  int nstate = cn_max + 1;
+  if(model == BOUNDA) nstate = (cn_max + 1) * (cn_max + 2) / 2;
+  int dim_mat = nstate * nstate;
+
+  // The rate matrix is linear in the rates of duplication and deletion
+  vector<double> qmat(dim_mat, 0.0);
+  vector<double> dqmat_dup(dim_mat, 0.0);
+  vector<double> dqmat_del(dim_mat, 0.0);
+  if(model == BOUNDA){
+      get_rate_matrix_allele_specific(qmat.data(), rtree.dup_rate, rtree.del_rate, cn_max);
+      get_rate_matrix_allele_specific(dqmat_dup.data(), 1.0, 0.0, cn_max);
+      get_rate_matrix_allele_specific(dqmat_del.data(), 0.0, 1.0, cn_max);
+  }else{
+      get_rate_matrix_bounded(qmat.data(), rtree.dup_rate, rtree.del_rate, cn_max);
+      get_rate_matrix_bounded(dqmat_dup.data(), 1.0, 0.0, cn_max);
+      get_rate_matrix_bounded(dqmat_del.data(), 0.0, 1.0, cn_max);
+  }
+
+  // P(t) of each edge and its derivatives with respect to t (Q * P(t)), and the rates of duplication and deletion if required
+  int nderiv = is_rate_grad ? 3 : 1;
+  vector<double> pmat_edge((size_t) nedge * dim_mat, 0.0);
+  vector<double> dpmat_edge((size_t) nedge * nderiv * dim_mat, 0.0);
+  vector<double> blen_edge(nedge);
+  vector<double*> pmat_per_edge(nedge);
+  for(int e = 0; e < nedge; e++){
+      blen_edge[e] = rtree.edges[e].length;
+      pmat_per_edge[e] = pmat_edge.data() + (size_t) e * dim_mat;
+  }
+  get_transition_matrices_eigen(lnl_type.qmat_eigen, blen_edge.data(), pmat_per_edge.data(), nedge);
+  for(int e = 0; e < nedge; e++){
+      double blen = blen_edge[e];
+      double* pmat = pmat_per_edge[e];
+      double* dpmat = dpmat_edge.data() + (size_t) e * nderiv * dim_mat;
+      for(int i = 0; i < nstate; i++){
+          for(int j = 0; j < nstate; j++){
+              double dp = 0.0;
+              for(int k = 0; k < nstate; k++){
+                  dp += qmat[i + k * nstate] * pmat[k + j * nstate];
+              }
+              dpmat[i + j * nstate] = dp;
+          }
+      }
+      if(is_rate_grad){
+          get_transition_matrix_deriv(qmat.data(), dqmat_dup.data(), dpmat + dim_mat, blen, nstate);
+          get_transition_matrix_deriv(qmat.data(), dqmat_del.data(), dpmat + 2 * dim_mat, blen, nstate);
+      }
+  }
+
+  map<int, vector<vector<int>>>& sites = lnl_type.site_pattern.obs.empty() ? vobs : lnl_type.site_pattern.obs;
+  const map<int, vector<int>>& site_weight = lnl_type.site_pattern.weight;
+  LNL_CACHE& lnl_cache = lnl_type.lnl_cache;
+  const vector<int>& knodes = lnl_type.knodes;
+  // no node needs to be updated, so update_lnl_pass only extracts the log likelihood of each site pattern
+  vector<int> no_dirty_nodes;
+  vector<int> no_blen_per_edge;
+  vector<double*> no_pmats;
+
+  // gradient with respect to the length of each edge, the rates of duplication and deletion, and then the rates of chromosome gain and loss
+  int npar = nedge + 2;
+  vector<double> grad_chr;
+
+  LNL_PASS& lnl_pass = lnl_cache.passes.at(PASS_SITES);
+  int nvariant = lnl_pass.variants.size();
+  vector<double> lnl_variant;
+  update_lnl_pass(lnl_pass, no_dirty_nodes, rtree, no_blen_per_edge, no_pmats, model, nstate, lnl_variant);
+
+  int max_wgd = only_seg ? 0 : 1;
+  for(int has_wgd = 0; has_wgd <= max_wgd; has_wgd++){
+      vector<double> lnl_site[3];
+      vector<double> dlnl_site[3];
+      for(int v = 0; v < nvariant; v++){
+          if(lnl_pass.variants[v] / 3 != has_wgd) continue;
+          int iz = lnl_pass.variants[v] % 3;
+          lnl_site[iz].resize(lnl_pass.npattern);
+          for(int p = 0; p < lnl_pass.npattern; p++){
+              lnl_site[iz][p] = lnl_variant[p * nvariant + v];
+          }
+          get_lnl_pass_grad(lnl_pass, v, rtree, knodes, pmat_edge, dpmat_edge, nderiv, model, nstate, dlnl_site[iz]);
+      }
+
+      double lnl_chr = get_likelihood_chr_grad(sites, site_weight, lnl_site, dlnl_site, npar, rtree, only_seg, grad_chr);
+      double weight = 1.0;
+      if(!only_seg){
+          weight = has_wgd ? rtree.wgd_rate : 1 - rtree.wgd_rate;
+          grad[nedge + 4] += has_wgd ? lnl_chr : -lnl_chr;
+      }
+      for(int i = 0; i < npar + 2; i++){
+          grad[i] += weight * grad_chr[i];
+      }
+  }
+
+  if(lnl_type.correct_bias){
+      LNL_PASS& lnl_invar = lnl_cache.passes.at(PASS_INVAR);
+      vector<double> dlnl_site;
+      get_lnl_pass_grad(lnl_invar, 0, rtree, knodes, pmat_edge, dpmat_edge, nderiv, model, nstate, dlnl_site);
+      for(int i = 0; i < npar; i++){
+          grad[i] += lnl_type.num_invar_bins * dlnl_site[i];
+      }
+  }
+
+  if(!is_rate_grad){
+      fill(grad.begin() + nedge, grad.end(), 0.0);
+  }
+
+  return logL;
+}
+
+
+double get_likelihood_revised_edge(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type, int eid, LNL_EDGE* lnl_edges){
+  // the partial likelihoods of all the nodes in each pass are kept in lnl_type.lnl_cache, in double precision as in get_likelihood_revised_grad
+  int use_float = lnl_type.use_float;
+  lnl_type.use_float = 0;
+  double logL = get_likelihood_revised(rtree, vobs, lnl_type);
+  lnl_type.use_float = use_float;
+  if(logL <= SMALL_LNL){
+      return logL;
+  }
+
+  int model = lnl_type.model;
+  int cn_max = lnl_type.cn_max;
+
+  int nstate = cn_max + 1;
+  if(model == BOUNDA) nstate = (cn_max + 1) * (cn_max + 2) / 2;
+
+  vector<double> qmat(nstate * nstate, 0.0);
+  if(model == BOUNDA){
+      get_rate_matrix_allele_specific(qmat.data(), rtree.dup_rate, rtree.del_rate, cn_max);
+  }else{
+      get_rate_matrix_bounded(qmat.data(), rtree.dup_rate, rtree.del_rate, cn_max);
+  }
+
+  // P(t) of each edge, usually found in the cache after get_likelihood_revised
+  PMAT_CACHE& pmat_cache = lnl_type.pmat_cache;
+  start_pmat_cache(pmat_cache, qmat.data(), nstate);
+  const vector<int>& knodes = lnl_type.knodes;
+  vector<double> blens;
+  vector<int> blen_per_edge;
+  vector<double*> pmat_per_blen;
+  add_distinct_blens(rtree, knodes, blens);
+  get_blen_per_edge(rtree, knodes, blens, blen_per_edge);
+  get_pmats_cached(pmat_cache, lnl_type.qmat_eigen, blens, pmat_per_blen);
+  vector<double*> pmat_per_edge(rtree.edges.size(), NULL);
+  for(int e = 0; e < rtree.edges.size(); e++){
+      if(blen_per_edge[e] >= 0) pmat_per_edge[e] = pmat_per_blen[blen_per_edge[e]];
+  }
+
+  LNL_CACHE& lnl_cache = lnl_type.lnl_cache;
+  // no node needs to be updated, so update_lnl_pass only extracts the log likelihood of each site pattern
+  vector<int> no_dirty_nodes;
+  vector<int> no_blen_per_edge;
+  vector<double*> no_pmats;
+
+  LNL_PASS& lnl_pass = lnl_cache.passes.at(PASS_SITES);
+  vector<double> lnl_site;
+  update_lnl_pass(lnl_pass, no_dirty_nodes, rtree, no_blen_per_edge, no_pmats, model, nstate, lnl_site);
+  get_lnl_pass_edge(lnl_pass, rtree, knodes, eid, pmat_per_edge, qmat.data(), model, nstate, lnl_site, lnl_edges[0]);
+
+  if(lnl_type.correct_bias){
+      LNL_PASS& lnl_invar = lnl_cache.passes.at(PASS_INVAR);
+      update_lnl_pass(lnl_invar, no_dirty_nodes, rtree, no_blen_per_edge, no_pmats, model, nstate, lnl_site);
+      get_lnl_pass_edge(lnl_invar, rtree, knodes, eid, pmat_per_edge, qmat.data(), model, nstate, lnl_site, lnl_edges[1]);
+  }
+
+  end_pmat_cache(pmat_cache);
+
+  return logL;
+}
+
+
+double get_likelihood_revised_edge_deriv(const evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type, const LNL_EDGE* lnl_edges, double blen, double& dlnl, double& d2lnl){
+  int nstate = lnl_edges[0].nstate;
+  vector<double> pmat(nstate * nstate, 0.0);
+  get_transition_matrix_eigen(lnl_type.qmat_eigen, pmat.data(), blen);
+
+  map<int, vector<vector<int>>>& sites = lnl_type.site_pattern.obs.empty() ? vobs : lnl_type.site_pattern.obs;
+  const map<int, vector<int>>& site_weight = lnl_type.site_pattern.weight;
+
+  vector<double> lnl_site, dlnl_site, d2lnl_site;
+  get_lnl_edge_deriv(lnl_edges[0], pmat.data(), lnl_site, dlnl_site, d2lnl_site);
+  double logL = get_likelihood_variants_deriv(sites, site_weight, lnl_site, dlnl_site, d2lnl_site, lnl_edges[0].variants, lnl_edges[0].npattern, rtree, lnl_type.only_seg, dlnl, d2lnl);
+
+  if(lnl_type.correct_bias){
+      get_lnl_edge_deriv(lnl_edges[1], pmat.data(), lnl_site, dlnl_site, d2lnl_site);
+      logL += lnl_type.num_invar_bins * lnl_site[0];
+      dlnl += lnl_type.num_invar_bins * dlnl_site[0];
+      d2lnl += lnl_type.num_invar_bins * d2lnl_site[0];
+  }
+
+  if(std::isnan(logL) || logL < SMALL_LNL) logL = SMALL_LNL;
+
+  return logL;
+}
+
+
+void copy_lnl_type(const LNL_TYPE& lnl_type, LNL_TYPE& lnl_copy){
+  // the partial likelihoods of lnl_copy are cleared by check_lnl_cache when the data change
+  if(lnl_copy.data_version != lnl_type.data_version){
+      lnl_copy.site_pattern = lnl_type.site_pattern;
+      lnl_copy.data_version = lnl_type.data_version;
+  }
+  lnl_copy.model = lnl_type.model;
+  lnl_copy.cn_max = lnl_type.cn_max;
+  lnl_copy.is_total = lnl_type.is_total;
+  lnl_copy.cons = lnl_type.cons;
+  lnl_copy.max_tobs = lnl_type.max_tobs;
+  lnl_copy.patient_age = lnl_type.patient_age;
+  lnl_copy.use_repeat = lnl_type.use_repeat;
+  lnl_copy.correct_bias = lnl_type.correct_bias;
+  lnl_copy.num_invar_bins = lnl_type.num_invar_bins;
+  lnl_copy.only_seg = lnl_type.only_seg;
+  lnl_copy.infer_wgd = lnl_type.infer_wgd;
+  lnl_copy.infer_chr = lnl_type.infer_chr;
+  lnl_copy.knodes = lnl_type.knodes;
+  lnl_copy.use_float = lnl_type.use_float;
+}
+
+
+double check_lnl_float(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type, double& max_site_diff){
+  int model = lnl_type.model;
+  int nstate = lnl_type.cn_max + 1;
+  if(model == BOUNDA) nstate = (lnl_type.cn_max + 1) * (lnl_type.cn_max + 2) / 2;
+
+  int use_float = lnl_type.use_float;
+  lnl_type.use_float = 0;
+  double lnl_double = get_likelihood_revised(rtree, vobs, lnl_type);
+  lnl_type.use_float = 1;
+  double lnl_float = get_likelihood_revised(rtree, vobs, lnl_type);
+  lnl_type.use_float = use_float;
+
+  max_site_diff = 0.0;
+  if(lnl_double <= SMALL_LNL) return 0.0;
+  LNL_CACHE& lnl_cache = lnl_type.lnl_cache;
+  if(lnl_cache.passes.count(PASS_SITES) && lnl_cache.passes.count(PASS_SITES_FLOAT)){
+      // no node needs to be updated, so update_lnl_pass only extracts the log likelihood of each site pattern
+      vector<int> no_dirty_nodes;
+      vector<int> no_blen_per_edge;
+      vector<double*> no_pmats;
+      vector<double> lnl_site_double, lnl_site_float;
+      update_lnl_pass(lnl_cache.passes[PASS_SITES], no_dirty_nodes, rtree, no_blen_per_edge, no_pmats, model, nstate, lnl_site_double);
+      update_lnl_pass(lnl_cache.passes[PASS_SITES_FLOAT], no_dirty_nodes, rtree, no_blen_per_edge, no_pmats, model, nstate, lnl_site_float);
+      for(int i = 0; i < lnl_site_double.size(); i++){
+          max_site_diff = max(max_site_diff, fabs(lnl_site_float[i] - lnl_site_double[i]));
+      }
+  }
+
+  return lnl_float - lnl_double;
+}
+
+
 // Computing likelihood when WGD and chr gain/loss are incorporated
 // Assume likelihood is for allele-specific information
 double get_likelihood_decomp(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type){
@@ -894,90 +2494,64 @@ double get_likelihood_decomp(evo_tree& rtree, map<int, vector<vector<int>>>& vob
   int dim_seg = 2 * max_site_change + 1;
 
   double *qmat_wgd, *qmat_chr, *qmat_seg;
-  double *pmat_wgd, *pmat_chr, *pmat_seg;
   // Find the transition probability matrix for each branch
   map<double, double*> pmats_wgd;
   map<double, double*> pmats_chr;
   map<double, double*> pmats_seg;
-  double *pmati_wgd, *pmatj_wgd;
-  double *pmati_chr, *pmatj_chr;
-  double *pmati_seg, *pmatj_seg;
 
   if(max_wgd > 0){
       qmat_wgd = new double[dim_wgd * dim_wgd];  // WGD
       memset(qmat_wgd, 0.0, (dim_wgd) * (dim_wgd) * sizeof(double));
       get_rate_matrix_wgd(qmat_wgd, rtree.wgd_rate, max_wgd);
+      get_eigen_decomposition(qmat_wgd, dim_wgd, lnl_type.qmat_eigen_wgd);
+      start_pmat_cache(lnl_type.pmat_cache_wgd, qmat_wgd, dim_wgd);
   }
 
   if(max_chr_change > 0){
       qmat_chr = new double[(dim_chr) * (dim_chr)];   // chromosome gain/loss
       memset(qmat_chr, 0.0, (dim_chr) * (dim_chr) * sizeof(double));
       get_rate_matrix_chr_change(qmat_chr, rtree.chr_gain_rate, rtree.chr_loss_rate, max_chr_change);
+      get_eigen_decomposition(qmat_chr, dim_chr, lnl_type.qmat_eigen_chr);
+      start_pmat_cache(lnl_type.pmat_cache_chr, qmat_chr, dim_chr);
   }
 
   if(max_site_change > 0){
       qmat_seg = new double[(dim_seg) * (dim_seg)];  // segment duplication/deletion
       memset(qmat_seg, 0.0, (dim_seg) * (dim_seg) * sizeof(double));
       get_rate_matrix_site_change(qmat_seg, rtree.dup_rate, rtree.del_rate, max_site_change);
+      get_eigen_decomposition(qmat_seg, dim_seg, lnl_type.qmat_eigen_seg);
+      start_pmat_cache(lnl_type.pmat_cache_seg, qmat_seg, dim_seg);
   }
 
   if(debug){
         cout << "Dimension of Qmat " << dim_wgd << "\t" << dim_chr << "\t" << dim_seg << "\n";
   }
 
+  // matrices not used in previous calls with the same rates are computed, for all the branches at once
   vector<int> knodes = lnl_type.knodes;
-  for(int kn = 0; kn < knodes.size(); ++kn){
-         int k = knodes[kn];
-         double bli = rtree.edges[rtree.nodes[k].e_ot[0]].length;
-         double blj = rtree.edges[rtree.nodes[k].e_ot[1]].length;
-
-         // For WGD
-         if(max_wgd > 0){
-             pmati_wgd = new double[(dim_wgd)*(dim_wgd)];
-             pmatj_wgd = new double[(dim_wgd)*(dim_wgd)];
-             memset(pmati_wgd, 0.0, (dim_wgd)*(dim_wgd)*sizeof(double));
-             memset(pmatj_wgd, 0.0, (dim_wgd)*(dim_wgd)*sizeof(double));
-             if(pmats_wgd.count(bli) == 0){
-                 get_transition_matrix_bounded(qmat_wgd, pmati_wgd, bli, dim_wgd);
-                 pmats_wgd[bli] = pmati_wgd;
-             }
-             if(pmats_wgd.count(blj) == 0){
-                 get_transition_matrix_bounded(qmat_wgd, pmatj_wgd, blj, dim_wgd);
-                 pmats_wgd[blj] = pmatj_wgd;
-             }
-         }
-
-         // For chr gain/loss
-         if(max_chr_change > 0){
-             pmati_chr = new double[(dim_chr)*(dim_chr)];
-             pmatj_chr = new double[(dim_chr)*(dim_chr)];
-             memset(pmati_chr, 0.0, (dim_chr)*(dim_chr)*sizeof(double));
-             memset(pmatj_chr, 0.0, (dim_chr)*(dim_chr)*sizeof(double));
-             if(pmats_chr.count(bli) == 0){
-                 get_transition_matrix_bounded(qmat_chr, pmati_chr, bli, dim_chr);
-                 pmats_chr[bli] = pmati_chr;
-             }
-             if(pmats_chr.count(blj) == 0){
-                 get_transition_matrix_bounded(qmat_chr, pmatj_chr, blj, dim_chr);
-                 pmats_chr[blj] = pmatj_chr;
-             }
-         }
-
-         // For segment duplication/deletion
-         if(max_site_change > 0){
-             pmati_seg = new double[(dim_seg)*(dim_seg)];
-             pmatj_seg = new double[(dim_seg)*(dim_seg)];
-             memset(pmati_seg, 0.0, (dim_seg)*(dim_seg)*sizeof(double));
-             memset(pmatj_seg, 0.0, (dim_seg)*(dim_seg)*sizeof(double));
-             if(pmats_seg.count(bli) == 0){
-                 get_transition_matrix_bounded(qmat_seg, pmati_seg, bli, dim_seg);
-                 pmats_seg[bli] = pmati_seg;
-             }
-             if(pmats_seg.count(blj) == 0){
-                 get_transition_matrix_bounded(qmat_seg, pmatj_seg, blj, dim_seg);
-                 pmats_seg[blj] = pmatj_seg;
-            }
-        }
+  vector<double> blens;
+  add_distinct_blens(rtree, knodes, blens);
+  vector<double*> pmat_per_blen;
+  // For WGD
+  if(max_wgd > 0){
+      get_pmats_cached(lnl_type.pmat_cache_wgd, lnl_type.qmat_eigen_wgd, blens, pmat_per_blen);
+      for(int i = 0; i < blens.size(); i++){
+          pmats_wgd[blens[i]] = pmat_per_blen[i];
+      }
+  }
+  // For chr gain/loss
+  if(max_chr_change > 0){
+      get_pmats_cached(lnl_type.pmat_cache_chr, lnl_type.qmat_eigen_chr, blens, pmat_per_blen);
+      for(int i = 0; i < blens.size(); i++){
+          pmats_chr[blens[i]] = pmat_per_blen[i];
+      }
+  }
+  // For segment duplication/deletion
+  if(max_site_change > 0){
+      get_pmats_cached(lnl_type.pmat_cache_seg, lnl_type.qmat_eigen_seg, blens, pmat_per_blen);
+      for(int i = 0; i < blens.size(); i++){
+          pmats_seg[blens[i]] = pmat_per_blen[i];
+      }
   }
   if(debug){
       for(auto it = pmats_wgd.begin(); it != pmats_wgd.end(); ++it){
@@ -1003,18 +2577,51 @@ double get_likelihood_decomp(evo_tree& rtree, map<int, vector<vector<int>>>& vob
   pmat_decomp.pmats_wgd = pmats_wgd;
   pmat_decomp.pmats_chr = pmats_chr;
   pmat_decomp.pmats_seg = pmats_seg;
+  set_pmat_decomp_per_edge(pmat_decomp, rtree, knodes);
 
   DIM_DECOMP dim_decomp;
   dim_decomp.dim_wgd = dim_wgd;
   dim_decomp.dim_chr = dim_chr;
   dim_decomp.dim_seg = dim_seg;
 
+  COMP_DECOMP& comp_decomp = lnl_type.comp_decomp;
+  build_comp_decomp(comps, dim_decomp, comp_decomp);
+
+  // Evaluate each unique site pattern once if the patterns have been extracted from vobs
+  map<int, vector<vector<int>>>& sites = lnl_type.site_pattern.obs.empty() ? vobs : lnl_type.site_pattern.obs;
+
+  // partial likelihoods kept from the previous call, only valid for the same rates
+  int nstate = comps.size();
+  LNL_CACHE& lnl_cache = lnl_type.lnl_cache;
+  vector<double> rates{rtree.dup_rate, rtree.del_rate, rtree.chr_gain_rate, rtree.chr_loss_rate, rtree.wgd_rate};
+  check_lnl_cache(lnl_cache, lnl_type.data_version, 2 * rtree.nleaf - 1, nstate, rates);
+
+  LNL_PASS& lnl_pass = lnl_cache.passes[PASS_DECOMP_SITES];
+  if(lnl_pass.L.empty()){
+      init_lnl_pass_decomp(lnl_pass, sites, obs_decomp, rtree, comps, lnl_type.infer_wgd, lnl_type.infer_chr, cn_max, is_total);
+  }
+  vector<int> dirty_nodes = get_dirty_nodes(lnl_pass, rtree, knodes);
+  vector<double> lnl_site;
+  update_lnl_pass_decomp(lnl_pass, dirty_nodes, rtree, comp_decomp, pmat_decomp, lnl_site);
+  set_clean_nodes(lnl_pass, rtree, dirty_nodes);
+
   // cout << "Number of states is " << nstate << endl;
-  logL = get_likelihood_chr_decomp(vobs, obs_decomp, rtree, comps, knodes, pmat_decomp, dim_decomp, lnl_type.infer_wgd, lnl_type.infer_chr, lnl_type.use_repeat, cn_max, is_total);
+  logL = get_likelihood_chr_decomp(sites, lnl_type.site_pattern.weight, lnl_site);
 
   if(debug) cout << "Final likelihood before correcting acquisition bias: " << logL << endl;
   if(lnl_type.correct_bias){
-      double lnl_invar = get_likelihood_invariant_decomp(obs_decomp, rtree, comps, knodes, pmat_decomp, dim_decomp, lnl_type.infer_wgd, lnl_type.infer_chr, cn_max, is_total);
+      // Compute the likelihood of dummy sites consisting entirely of 2s for the tree
+      LNL_PASS& lnl_pass = lnl_cache.passes[PASS_DECOMP_INVAR];
+      if(lnl_pass.L.empty()){
+          // chromosome 0 is not checked for chromosome gain/loss when filling the table
+          map<int, vector<vector<int>>> invar_sites{{0, {vector<int>(rtree.nleaf - 1, 2)}}};
+          init_lnl_pass_decomp(lnl_pass, invar_sites, obs_decomp, rtree, comps, lnl_type.infer_wgd, lnl_type.infer_chr, cn_max, is_total);
+      }
+      vector<int> dirty_nodes = get_dirty_nodes(lnl_pass, rtree, knodes);
+      vector<double> lnl_site;
+      update_lnl_pass_decomp(lnl_pass, dirty_nodes, rtree, comp_decomp, pmat_decomp, lnl_site);
+      set_clean_nodes(lnl_pass, rtree, dirty_nodes);
+      double lnl_invar = lnl_site[0];
       double bias = lnl_type.num_invar_bins * lnl_invar;
       logL = logL + bias;
       if(debug){
@@ -1033,21 +2640,15 @@ double get_likelihood_decomp(evo_tree& rtree, map<int, vector<vector<int>>>& vob
 
   if(max_wgd > 0){
       delete [] qmat_wgd;
-      for(auto m : pmats_wgd){
-          free(m.second);
-      }
+      end_pmat_cache(lnl_type.pmat_cache_wgd);
   }
   if(max_chr_change > 0){
       delete [] qmat_chr;
-      for(auto m : pmats_chr){
-          free(m.second);
-      }
+      end_pmat_cache(lnl_type.pmat_cache_chr);
   }
   if(max_site_change > 0){
       delete [] qmat_seg;
-      for(auto m : pmats_seg){
-          free(m.second);
-      }
+      end_pmat_cache(lnl_type.pmat_cache_seg);
   }
 
   return logL;
@@ -1090,6 +2691,9 @@ double get_likelihood(const vector<vector<int>>& vobs, evo_tree& rtree, const ve
   memset(pmati, 0.0, dim_mat * sizeof(double));
   memset(pmatj, 0.0, dim_mat * sizeof(double));
 
+  LNL_BUFFER lnl_buffer;
+  double* L_sk_k = lnl_buffer.reserve(2 * rtree.nleaf - 1, nstate);
+
   double logL = 0;
   for(int nc = 0; nc < Nchar; ++nc){
     vector<int> obs = vobs[nc];
@@ -1099,12 +2703,13 @@ double get_likelihood(const vector<vector<int>>& vobs, evo_tree& rtree, const ve
       cout << endl;
     }
 
-    vector<vector<double>> L_sk_k(2 * rtree.nleaf - 1, vector<double>(nstate, 0.0));
     initialize_lnl_table(L_sk_k, obs, rtree, model, nstate, is_total);
     if(debug){
         print_tree_lnl(rtree, L_sk_k, nstate);
     }
 
+    int nscale = 0;
+
     for(int kn = 0; kn < knodes.size(); ++kn){
       int k = knodes[kn];
       int ni = rtree.edges[rtree.nodes[k].e_ot[0]].end;
@@ -1124,41 +2729,45 @@ double get_likelihood(const vector<vector<int>>& vobs, evo_tree& rtree, const ve
 
       if(debug) cout << "node:" << rtree.nodes[k].id + 1 << " -> " << ni + 1 << " , " << bli << "\t" <<  nj + 1 << " , " << blj << endl;
 
+      const double* L_ni = L_sk_k + ni * nstate;
+      const double* L_nj = L_sk_k + nj * nstate;
+      // Mk model: P(t) has one value on the diagonal and another off the diagonal, so the sums over child states are computed once
+      double pi_same = 0, pi_diff = 0, pj_same = 0, pj_diff = 0, sum_i = 0, sum_j = 0;
+      if(model == MK){
+          get_transition_prob_mk(rtree.mu, bli, pi_same, pi_diff);
+          get_transition_prob_mk(rtree.mu, blj, pj_same, pj_diff);
+          sum_i = accumulate(L_ni, L_ni + nstate, 0.0);
+          sum_j = accumulate(L_nj, L_nj + nstate, 0.0);
+      }
       //loop over possible values of sk
       for(int sk = 0; sk < nstate; ++sk){
     	  double Li = 0;
-    	  // loop over possible si
-    	  for(int si = 0; si < nstate; ++si){
-            if (model == MK){
-                Li += get_transition_prob(rtree.mu, bli, sk, si) * L_sk_k[ni][si];
-            }
-            else{
-                Li += pmati[sk + si * nstate] * L_sk_k[ni][si];
-            }
-    	       //cout << "\tscoring: Li\t" << li << "\t" << get_transition_prob(mu, bli, sk, si ) << "\t" << L_sk_k[ni][si] << endl;
-        }
-
     	  double Lj = 0;
-    	  // loop over possible sj
-    	  for(int sj = 0; sj < nstate; ++sj){
-            if (model == MK){
-    	         Lj += get_transition_prob(rtree.mu, blj, sk, sj) * L_sk_k[nj][sj];
-            }
-            else{
-               Lj += pmatj[sk + sj * nstate] * L_sk_k[nj][sj];
-            }
-    	  }
+          if (model == MK){
+              Li = get_prob_child_mk(L_ni, sk, pi_same, pi_diff, sum_i);
+              Lj = get_prob_child_mk(L_nj, sk, pj_same, pj_diff, sum_j);
+          }else{
+        	  // loop over possible si
+        	  for(int si = 0; si < nstate; ++si){
+                  Li += pmati[sk + si * nstate] * L_ni[si];
+              }
+        	  // loop over possible sj
+        	  for(int sj = 0; sj < nstate; ++sj){
+                  Lj += pmatj[sk + sj * nstate] * L_nj[sj];
+        	  }
+          }
 
 	      //cout << "scoring: sk" << sk << "\t" <<  Li << "\t" << Lj << endl;
-	      L_sk_k[k][sk] = Li * Lj;
+	      L_sk_k[k * nstate + sk] = Li * Lj;
       }
+      nscale += scale_lnl_row(L_sk_k + k * nstate, nstate);
 
       if(debug){
     	  print_tree_lnl(rtree, L_sk_k, nstate);
       }
     }
 
-    logL += extract_tree_lnl(L_sk_k, rtree.nleaf - 1, model);
+    logL += extract_tree_lnl(L_sk_k, rtree.nleaf - 1, model, nstate, nscale);
   }
 
   if(debug) cout << "Final likelihood: " << logL << endl;
@@ -1171,35 +2780,50 @@ double get_likelihood(const vector<vector<int>>& vobs, evo_tree& rtree, const ve
 }
 
 
-double extract_tree_lnl(vector<vector<double>>& L_sk_k, int Ns, int model){
+double extract_tree_lnl(const double* L_sk_k, int Ns, int model, int nstate, int nscale){
     int debug = 0;
+    // row of the root
+    const double* L_root = L_sk_k + (Ns + 1) * nstate;
 
     if(debug){
-        for(int j = 0; j < L_sk_k[Ns + 1].size(); ++j){
-          cout << "\t" << L_sk_k[Ns + 1][j];
+        for(int j = 0; j < nstate; ++j){
+          cout << "\t" << L_root[j];
         }
         cout << endl;
     }
 
     if(model == BOUNDA){
         // The index is changed from 2 to 4 (1/1)
-        if(debug) cout << "Likelihood for root is " << L_sk_k[Ns + 1][4] << endl;
-        if(L_sk_k[Ns + 1][4] > 0) return log(L_sk_k[Ns + 1][4]);
+        if(debug) cout << "Likelihood for root is " << L_root[4] << endl;
+        if(L_root[4] > 0) return log(L_root[4]) - nscale * LOG_SCALE_FACTOR;
         else return LARGE_LNL;
     }else{
-        if(debug) cout << "Likelihood for root is " << L_sk_k[Ns + 1][2] << endl;
-        if(L_sk_k[Ns + 1][2] > 0) return log(L_sk_k[Ns + 1][2]);
+        if(debug) cout << "Likelihood for root is " << L_root[2] << endl;
+        if(L_root[2] > 0) return log(L_root[2]) - nscale * LOG_SCALE_FACTOR;
         else return LARGE_LNL;
     }
 }
 
 
+double extract_tree_lnl(const float* L_sk_k, int Ns, int model, int nstate, int nscale){
+    // row of the root
+    const float* L_root = L_sk_k + (Ns + 1) * nstate;
+    int root_state = 2;
+    if(model == BOUNDA) root_state = 4;
+
+    if(L_root[root_state] > 0) return log((double) L_root[root_state]) - nscale * LOG_SCALE_FACTOR_FLOAT;
+    else return LARGE_LNL;
+}
+
+
 
 
 // Get the likelihood of the tree from likelihood table of state combinations
-double extract_tree_lnl_decomp(vector<vector<double>>& L_sk_k, const set<vector<int>>& comps, int Ns){
+double extract_tree_lnl_decomp(const double* L_sk_k, const set<vector<int>>& comps, int Ns, int nscale){
     int debug = 0;
     if(debug) cout << "Extracting likelihood for the root" << endl;
+    // row of the root
+    const double* L_root = L_sk_k + (Ns + 1) * comps.size();
 
     double likelihood = 0;
     int k = 0;
@@ -1208,7 +2832,7 @@ double extract_tree_lnl_decomp(vector<vector<double>>& L_sk_k, const set<vector<
         // if(debug) cout << k << "\t" << v[0] << "\t" << v[1] << "\t" << v[2] << "\t" << v[3] << "\t" << v[4] << endl;
         bool zeros = all_of(v.begin(), v.end(), [](int i){ return i == 0; });
         if(zeros){
-            likelihood = L_sk_k[Ns + 1][k];
+            likelihood = L_root[k];
             break;
         }
         k++;
@@ -1216,23 +2840,32 @@ double extract_tree_lnl_decomp(vector<vector<double>>& L_sk_k, const set<vector<
 
     if(debug){
         for(int j = 0; j < comps.size(); ++j){
-          cout << "\t" << L_sk_k[Ns + 1][j];
+          cout << "\t" << L_root[j];
         }
         cout << endl;
     }
 
-    if(likelihood > 0) return log(likelihood);
+    if(likelihood > 0) return log(likelihood) - nscale * LOG_SCALE_FACTOR;
+    else return LARGE_LNL;
+}
+
+
+double extract_tree_lnl_decomp(const double* L_sk_k, const COMP_DECOMP& comp_decomp, int Ns, int nscale){
+    if(comp_decomp.root_state < 0) return LARGE_LNL;
+    double likelihood = L_sk_k[(Ns + 1) * comp_decomp.nstate + comp_decomp.root_state];
+
+    if(likelihood > 0) return log(likelihood) - nscale * LOG_SCALE_FACTOR;
     else return LARGE_LNL;
 }
 
 
-void print_tree_lnl(const evo_tree& rtree, vector<vector<double>>& L_sk_k, int nstate){
+void print_tree_lnl(const evo_tree& rtree, const double* L_sk_k, int nstate){
     cout << "\nLikelihood so far:\n";
 
     int ntotn = 2 * rtree.nleaf - 1;
     for(int i = 0; i < ntotn; ++i){
         for(int j = 0; j < nstate; ++j){
-          cout << "\t" << L_sk_k[i][j];
+          cout << "\t" << L_sk_k[i * nstate + j];
         }
         cout << endl;
     }
@@ -22,6 +22,128 @@ struct DeleteObject{
 };
 
 
+// Allocator returning memory aligned to ALIGN bytes, used for partial likelihood tables
+template <typename T, size_t ALIGN = 64>
+struct AlignedAllocator{
+  typedef T value_type;
+
+  template <typename U>
+  struct rebind{ typedef AlignedAllocator<U, ALIGN> other; };
+
+  AlignedAllocator(){}
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, ALIGN>&){}
+
+  T* allocate(size_t n){
+    void* ptr = NULL;
+    if(posix_memalign(&ptr, ALIGN, n * sizeof(T)) != 0){
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(ptr);
+  }
+
+  void deallocate(T* ptr, size_t){
+    free(ptr);
+  }
+};
+
+template <typename T, typename U, size_t ALIGN>
+inline bool operator==(const AlignedAllocator<T, ALIGN>&, const AlignedAllocator<U, ALIGN>&){ return true; }
+
+template <typename T, typename U, size_t ALIGN>
+inline bool operator!=(const AlignedAllocator<T, ALIGN>&, const AlignedAllocator<U, ALIGN>&){ return false; }
+
+typedef vector<double, AlignedAllocator<double>> AlignedVector;
+typedef vector<float, AlignedAllocator<float>> AlignedVectorFloat;
+
+
+// Flat partial likelihood table, allocated once and reused across sites and likelihood calls
+// Node-major layout: the likelihood of state s at node k is L[k * nstate + s]
+struct LNL_BUFFER{
+  AlignedVector L;
+
+  // Get a table for a tree with ntotn nodes, only allocating memory when the table grows
+  double* reserve(int ntotn, int nstate){
+    size_t size = (size_t) ntotn * nstate;
+    if(L.size() < size){
+      L.resize(size);
+    }
+    return L.data();
+  }
+};
+
+
+// Keys of the passes in LNL_CACHE
+enum LNL_PASS_KEY {
+  PASS_SITES,         // the sites in get_likelihood_revised
+  PASS_INVAR,         // the invariant site in get_likelihood_revised
+  PASS_DECOMP_SITES,  // the sites in get_likelihood_decomp
+  PASS_DECOMP_INVAR,  // the invariant site in get_likelihood_decomp
+  PASS_SITES_FLOAT    // the sites in get_likelihood_revised in single precision
+};
+
+
+// Partial likelihoods of all the site patterns for one pass of pruning, kept between likelihood calls
+// A pass carries one or more variants, each a combination of WGD status and chromosome change in get_likelihood_revised, which are computed in the same traversal
+// Passes are keyed by LNL_PASS_KEY
+// The table of variant v for pattern p starts at L[(p * nvariant + v) * ntotn * nstate], with the same layout as LNL_BUFFER
+struct LNL_PASS{
+  int npattern;
+  vector<int> variants;   // 3 * has_wgd + z + 1 for each variant, {1} when there is no WGD or chromosome change
+  AlignedVector L;
+  AlignedVectorFloat Lf;  // used instead of L when the partial likelihoods are kept in single precision
+  vector<int> nscale;     // number of rescalings at node k for variant v of pattern p, at nscale[(p * nvariant + v) * ntotn + k]
+  vector<int> tip_start;  // the states with nonzero likelihood at tip i of pattern p are tip_states[tip_start[p * nleaf + i]] to tip_states[tip_start[p * nleaf + i + 1] - 1]
+  vector<int> tip_states;
+  vector<int> children;   // children of node k when its partial likelihoods were computed, at children[2 * k] and children[2 * k + 1], -1 if not computed
+  vector<double> blens;   // lengths of the branches to the children above
+};
+
+
+// Partial likelihoods of all passes, computed for a version of the observations, tree size and rates
+// Only the nodes whose subtree has changed since the last call are recomputed
+struct LNL_CACHE{
+  int data_version;   // LNL_TYPE::data_version of the observations used to fill the tips
+  int ntotn;
+  int nstate;
+  vector<double> rates;   // rates used to compute the transition matrices
+  map<int, LNL_PASS> passes;   // keyed by LNL_PASS_KEY
+};
+
+
+// A transition matrix in PMAT_CACHE, with the last call using it
+struct PMAT_ENTRY{
+  vector<double> pmat;
+  vector<float> pmat_float;   // pmat rounded to float, filled on the first call in single precision
+  long last_use;
+};
+
+
+// Transition matrices P(t) of one rate matrix kept between likelihood calls, keyed by branch length
+// The cache is cleared when the rate matrix changes. When there are more than MAX_PMAT_CACHE matrices,
+// the least recently used ones are dropped at the end of a call, keeping those used in the current call
+struct PMAT_CACHE{
+  vector<double> q;   // rate matrix of the cached matrices
+  long ncall;   // number of calls using the cache
+  map<double, PMAT_ENTRY> pmats;
+};
+
+const int MAX_PMAT_CACHE = 1000;
+
+
+// Partial likelihoods on both sides of one edge for all the site patterns and variants of a pass, used to optimize the length of the edge without traversing the tree
+// With W the derivative of the likelihood at the root with respect to the partial likelihoods P(t) * L_c of the edge,
+// the log likelihood of variant v of pattern p is log(W * P(t) * L_c) + offset[p * nvariant + v], and its derivatives follow from dP/dt = Q * P(t)
+struct LNL_EDGE{
+  int nstate;
+  int npattern;
+  vector<int> variants;
+  vector<double> W;   // W, W * Q and W * Q^2 of variant v of pattern p, starting at (p * nvariant + v) * 3 * nstate
+  vector<double> L_c;   // partial likelihoods of the child of the edge, starting at (p * nvariant + v) * nstate
+  vector<double> offset;   // LARGE_LNL if the site is impossible
+};
+
+
 // information derived from input data for DECOMP model
 struct OBS_DECOMP{
   int m_max;   // maximum copy of a segment before chr-level events, used in likelihood table initialization
@@ -34,6 +156,12 @@ struct OBS_DECOMP{
   vector<int> obs_num_wgd;  // possible number of WGD events, used in likelihood table initialization
   vector<vector<int>> obs_change_chr; // possible number of chr-level events, used in likelihood table initialization
   // vector<int> sample_max_cn;  // not used in likelihood computation
+
+  // likelihood vectors at the tips, filled by build_tip_lnl_decomp for the set of state combinations tip_comps
+  // key: total copy number, number of WGD events (-1 if not inferred), sign of the number of chr-level events
+  // tip_comps and tip_lnl are set and cleared together, and are NULL and empty after aggregate initialization, so obs_decomp has to be rebuilt whenever comps changes
+  const set<vector<int>>* tip_comps;
+  map<vector<int>, vector<double>> tip_lnl;
 };
 
 
@@ -57,10 +185,48 @@ struct DIM_DECOMP{
 };
 
 
+// One stage of the factored sum over child states in model DECOMP, which contracts component comp (0 to 4 for wgd, chr, seg, chr2, seg2)
+// An entry has the parent values for the components contracted so far and the child values for the others, only kept if reachable from comps
+// Entry e sums pmat[row[e] + col[t]] * T[in[t]] for t in [start[e], start[e + 1]), where T is the output of the previous stage
+struct STAGE_DECOMP{
+  int comp;
+  int nentry;
+  vector<int> row;
+  vector<int> start;
+  vector<int> in;
+  vector<int> col;
+};
+
+
+// State combinations of model DECOMP (comps) compiled into flat index tables, built once for the dimensions of the P-matrices
+// For state x with components (wgd, chr, seg, chr2, seg2), the rows of the components in the P-matrices are in row_*[x] and the column offsets (column index * dimension) in col_*[x],
+// so that the transition probability of chr from state x to state y is pmat_chr[row_chr[x] + col_chr[y]]
+struct COMP_DECOMP{
+  const set<vector<int>>* comps;    // the set of state combinations used to build the tables
+  int nstate;
+  int dim_wgd;
+  int dim_chr;
+  int dim_seg;
+  int root_state;   // index of the normal state (all components 0), -1 if not found
+
+  vector<int> row_wgd, row_chr, row_seg, row_chr2, row_seg2;
+  vector<int> col_wgd, col_chr, col_seg, col_chr2, col_seg2;
+
+  // stages of the factored sum over child states, one component contracted at each stage
+  vector<STAGE_DECOMP> stages;
+  int max_entry;    // largest number of entries at a stage
+};
+
+
 struct PMAT_DECOMP{
   map<double, double*> pmats_wgd;
   map<double, double*> pmats_chr;
   map<double, double*> pmats_seg;
+
+  // matrices of each edge, set by set_pmat_decomp_per_edge and used in get_likelihood_site_decomp
+  vector<double*> wgd_per_edge;
+  vector<double*> chr_per_edge;
+  vector<double*> seg_per_edge;
 };
 
 
@@ -88,7 +254,7 @@ struct LNL_TYPE{
   double max_tobs;  // maximum sampling time
   int patient_age;   // used in BFGS constraints
 
-  int use_repeat;   // whether or not to use repeated site patterns, used in get_likelihood_chr*
+  int use_repeat;   // whether or not to use repeated site patterns, used to decide whether to build site_pattern
   int correct_bias; // Whether or not to correct acquisition bias, used in get_likelihood_*
   int num_invar_bins; // used in get_likelihood_*
 
@@ -98,15 +264,45 @@ struct LNL_TYPE{
   int infer_chr; // whether or not to infer chromosome gain/loss status of a sample, called in initialize_lnl_table_decomp
 
   vector<int> knodes;
+
+  SITE_PATTERN site_pattern;  // unique site patterns of vobs, built by get_site_patterns_by_chr and used in place of vobs if not empty
+  LNL_CACHE lnl_cache;  // partial likelihoods kept between calls of get_likelihood_revised or get_likelihood_decomp, cleared when data_version changes
+  int data_version;   // to be increased whenever vobs or site_pattern change, so that copies of lnl_type share lnl_cache as long as they are on the same data
+
+  // eigendecompositions of the rate matrices kept between calls, only recomputed when the rates change
+  QMAT_EIGEN qmat_eigen;  // used in get_likelihood_revised
+  QMAT_EIGEN qmat_eigen_wgd;  // used in get_likelihood_decomp
+  QMAT_EIGEN qmat_eigen_chr;
+  QMAT_EIGEN qmat_eigen_seg;
+  QMAT_SPARSE qmat_sparse;  // used in get_likelihood_revised when P(t) is applied by uniformization
+  COMP_DECOMP comp_decomp;  // used in get_likelihood_decomp, built from comps on the first call
+
+  // transition matrices kept between calls, for single-branch changes to only compute the new matrices
+  PMAT_CACHE pmat_cache;  // used in get_likelihood_revised
+  PMAT_CACHE pmat_cache_wgd;  // used in get_likelihood_decomp
+  PMAT_CACHE pmat_cache_chr;
+  PMAT_CACHE pmat_cache_seg;
+
+  int use_float;  // whether or not to keep the partial likelihoods of the sites in single precision in get_likelihood_revised, used to speed up tree search
 };
 
 const double LARGE_LNL = -1e9;
 const double SMALL_LNL = -1e20;
 const double MAX_NLNL = 1e20;
 
+// The partial likelihoods of a node are multiplied by SCALE_FACTOR (2^256) when all of them are below SCALE_THRESHOLD (2^-256), to avoid underflow on large trees
+// A power of 2 is used so that rescaling does not introduce rounding errors
+const double SCALE_FACTOR = 115792089237316195423570985008687907853269984665640564039457584007913129639936.0;
+const double SCALE_THRESHOLD = 1.0 / SCALE_FACTOR;
+const double LOG_SCALE_FACTOR = 177.445678223346;   // 256 * log(2)
+// The same in single precision, with 2^32 as the largest float is about 2^128
+const float SCALE_FACTOR_FLOAT = 4294967296.0f;
+const float SCALE_THRESHOLD_FLOAT = 1.0f / SCALE_FACTOR_FLOAT;
+const double LOG_SCALE_FACTOR_FLOAT = 22.1807097779182;   // 32 * log(2)
+
 
 /****************** common functions *******************/
-void print_tree_lnl(const evo_tree& rtree, vector<vector<double>>& L_sk_k, int nstate);
+void print_tree_lnl(const evo_tree& rtree, const double* L_sk_k, int nstate);
 
 // From https://stackoverflow.com/questions/17074324/how-can-i-sort-two-vectors-in-the-same-way-with-criteria-that-uses-only-one-of
 template <typename T, typename Compare>
@@ -134,57 +330,99 @@ std::vector<T> apply_permutation(
 
 
 
-/****************** functions for non DECOMP model *******************/
-// Create likelihood vectors at the tip node, one table for each site
-// obs: a vector of CNs for one site
-// L_sk_k has one row for each tree node and one column for each possible state
-// only used in get_likelihood_chr
-// extracted as a function to avoid duplication in selection statement
-void initialize_lnl_table(vector<vector<double>>& L_sk_k, const vector<int>& obs, const evo_tree& rtree, int model, int nstate, int is_total);
+// log(1 + exp(x)), without overflow when x is large, used to add up likelihoods in log space
+inline double log1p_exp(double x){
+    if(x > 0) return x + log1p(exp(-x));
+    return log1p(exp(x));
+}
 
 
-// nstate = cn_max + 1
-// only used in get_likelihood_site
-// extracted as a function to avoid duplication in selection statement
-inline double get_prob_children(vector<vector<double>>& L_sk_k, const evo_tree& rtree, double* pbli, double* pblj, int nsk, int ni, int nj, int bli, int blj, int model, int nstate){
-    double Li = 0.0;
-    for(int si = 0; si < nstate; ++si){
-      if(L_sk_k[ni][si] > 0){
-        if(model == MK){
-          Li += get_transition_prob(rtree.mu, bli, nsk, si) * L_sk_k[ni][si];
-        }else{
-          Li += pbli[nsk + si * nstate] * L_sk_k[ni][si];
+// Rescale the partial likelihoods of one node (one row of L_sk_k) if they are all tiny
+// Returns the number of times the row is multiplied by SCALE_FACTOR
+inline int scale_lnl_row(double* L_k, int nstate){
+    double lmax = *max_element(L_k, L_k + nstate);
+    int nscale = 0;
+    while(lmax > 0 && lmax < SCALE_THRESHOLD){
+        for(int s = 0; s < nstate; ++s){
+            L_k[s] *= SCALE_FACTOR;
         }
-      }
+        lmax *= SCALE_FACTOR;
+        nscale++;
     }
+    return nscale;
+}
 
-    double Lj = 0.0;
-    for(int sj = 0; sj < nstate; ++sj){
-      if(L_sk_k[nj][sj] > 0){
-        if(model == MK){
-          Lj += get_transition_prob(rtree.mu, blj, nsk, sj) * L_sk_k[nj][sj];
-        }else{
-          Lj += pblj[nsk + sj * nstate] * L_sk_k[nj][sj];
+// Returns the number of times the row is multiplied by SCALE_FACTOR_FLOAT
+inline int scale_lnl_row(float* L_k, int nstate){
+    float lmax = *max_element(L_k, L_k + nstate);
+    int nscale = 0;
+    while(lmax > 0 && lmax < SCALE_THRESHOLD_FLOAT){
+        for(int s = 0; s < nstate; ++s){
+            L_k[s] *= SCALE_FACTOR_FLOAT;
         }
-      }
+        lmax *= SCALE_FACTOR_FLOAT;
+        nscale++;
     }
-
-    return Li * Lj;
+    return nscale;
 }
 
 
-
-// Get the likelihood on one site of a chromosome (assuming higher level events on nodes)
-// z: possible changes in copy number caused by chromosome gain/loss
+/****************** functions for non DECOMP model *******************/
+// Create likelihood vectors at the tip node, one table for each site
+// obs: a vector of CNs for one site
+// L_sk_k has one row for each tree node and one column for each possible state, stored row by row in a flat array
 // only used in get_likelihood_chr
 // extracted as a function to avoid duplication in selection statement
-void get_likelihood_site(vector<vector<double>>& L_sk_k, const evo_tree& rtree, const vector<int>& knodes, const vector<double>& blens, const vector<double*>& pmat_per_blen, const int& has_wgd, const int& z, const int& model, const int& nstate);
+void initialize_lnl_table(double* L_sk_k, const vector<int>& obs, const evo_tree& rtree, int model, int nstate, int is_total);
+
+
+// Probability of the subtree below a child given state nsk of its parent in the Mk model, where all the off-diagonal entries of P(t) are p_diff
+// sum_L: sum of the partial likelihoods L_c of the child, computed once for all the parent states
+inline double get_prob_child_mk(const double* L_c, int nsk, double p_same, double p_diff, double sum_L){
+    return p_diff * sum_L + (p_same - p_diff) * L_c[nsk];
+}
+
+
+// Get the likelihood on one site for several variants (3 * has_wgd + z + 1) at once, where z is the change in copy number caused by chromosome gain/loss
+// L_sk_k: the tables of all the variants, one after another
+// The transition matrices of each node and the probabilities of the tips given the state of their parent are shared by all the variants
+// nscale_k: the number of rescalings of variant v at node knodes[kn] is stored at nscale_k[v * knodes.size() + kn]
+// blen_per_edge: the matrix of edge e is pmat_per_blen[blen_per_edge[e]], as obtained by get_blen_per_edge
+// tip_start, tip_states: the states with nonzero likelihood at each tip as filled by add_tip_states, where tip_start points to the offsets of this site
+// v_tip: buffer of 4 * nstate values
+// In the Mk model, only the two distinct entries of each P(t) are used, as in get_likelihood
+// Specialised at compile time for the common numbers of states, with a generic version for the others
+void get_likelihood_site_fused(double* L_sk_k, const evo_tree& rtree, const vector<int>& knodes, const vector<int>& blen_per_edge, const vector<double*>& pmat_per_blen, const vector<int>& variants, const int* tip_start, const int* tip_states, int model, int nstate, int* nscale_k, double* v_tip);
+
+// The same in single precision, with the transition matrices rounded to float and rescaling by SCALE_FACTOR_FLOAT
+void get_likelihood_site_fused(float* L_sk_k, const evo_tree& rtree, const vector<int>& knodes, const vector<int>& blen_per_edge, const vector<float*>& pmat_per_blen, const vector<int>& variants, const int* tip_start, const int* tip_states, int model, int nstate, int* nscale_k, float* v_tip);
 
+// The same as get_likelihood_site_fused, with P(t) applied to the partial likelihoods by uniformization (apply_transition_matrix_sparse) instead of dense P-matrices
+// unif_per_blen: Poisson weights for each branch length, at the same index as the P-matrices in get_likelihood_site_fused
+// work: buffer of 6 * nstate values
+void get_likelihood_site_sparse(double* L_sk_k, const evo_tree& rtree, const vector<int>& knodes, const vector<int>& blen_per_edge, const vector<UNIF_WEIGHTS>& unif_per_blen, const QMAT_SPARSE& qmat_sparse, const vector<int>& variants, int model, int nstate, int* nscale_k, double* work);
 
-// Get the likelihood on a set of chromosmes
+
+// Get the likelihood on a set of chromosmes from the log likelihood of each site pattern
 // only used in get_likelihood_revised
-// extracted as a function to avoid duplication in selection statement
-double get_likelihood_chr(map<int, vector<vector<int>>>& vobs, const evo_tree& rtree, const vector<int>& knodes, const vector<double>& blens, const vector<double*>& pmat_per_blen, const int& has_wgd, const int& only_seg, const int& use_repeat, const int& model, const int& nstate, const int& is_total);
+// site_weight: number of sites having each pattern in vobs, empty if each site is counted once
+// lnl_normal, lnl_loss, lnl_gain: log likelihood of each pattern (ordered by chromosome) without chromosome change, after chromosome loss and after chromosome gain, the latter two only used when the corresponding rate is not 0
+double get_likelihood_chr(map<int, vector<vector<int>>>& vobs, const map<int, vector<int>>& site_weight, const vector<double>& lnl_normal, const vector<double>& lnl_loss, const vector<double>& lnl_gain, const evo_tree& rtree, const int& only_seg);
+
+// Get the likelihood on a set of chromosmes as in get_likelihood_chr, together with its gradient
+// lnl_site: log likelihood of each pattern after chromosome loss, without chromosome change and after chromosome gain (indexed by z + 1)
+// dlnl_site: gradient of lnl_site with respect to npar parameters, stored pattern by pattern
+// grad: gradient with respect to the npar parameters, followed by the rates of chromosome gain and loss
+double get_likelihood_chr_grad(map<int, vector<vector<int>>>& vobs, const map<int, vector<int>>& site_weight, const vector<double>* lnl_site, const vector<double>* dlnl_site, int npar, const evo_tree& rtree, const int& only_seg, vector<double>& grad);
+
+// Get the log likelihood of a chromosome as in get_likelihood_chr, written as f(A, B, C) for the terms without chromosome change (A), after chromosome loss (B) and after chromosome gain (C)
+// site_logL: sum of the log likelihood of all sites on the chromosome after chromosome loss, without chromosome change and after chromosome gain
+// fA, fB, fC: partial derivatives of f with respect to A, B and C, which add up to 1
+double get_chr_lnl_weights(const double* site_logL, double chr_normal, double chr_loss, double chr_gain, int has_loss, int has_gain, double& fA, double& fB, double& fC);
+
+// Get the likelihood on a set of chromosmes as in get_likelihood_chr, together with its first and second derivatives with respect to one parameter
+// dlnl_site, d2lnl_site: derivatives of lnl_site, with the same layout
+double get_likelihood_chr_deriv(map<int, vector<vector<int>>>& vobs, const map<int, vector<int>>& site_weight, const vector<double>* lnl_site, const vector<double>* dlnl_site, const vector<double>* d2lnl_site, const evo_tree& rtree, const int& only_seg, double& dlnl, double& d2lnl);
 
 
 
@@ -194,6 +432,30 @@ double get_likelihood_chr(map<int, vector<vector<int>>>& vobs, const evo_tree& r
 // , int model, int cons, int is_total
 double get_likelihood_revised(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type);
 
+// Get the likelihood of several trees with the same rates as get_likelihood_revised, streaming over the site patterns once
+// The tips of each pattern are filled once for all the trees, and P-matrices are shared by branches of the same length in any tree
+// Trees with different rates are computed one by one; the partial likelihoods are not kept in lnl_type.lnl_cache
+vector<double> get_likelihood_revised_batch(vector<evo_tree>& trees, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type);
+
+// Sum up the log likelihood of all variants (3 * has_wgd + z + 1) of each site pattern over all chromosomes, weighted by the rate of WGD
+// lnl_variant: log likelihood of variant v of pattern p at lnl_variant[p * nvariant + v]
+double get_likelihood_variants(map<int, vector<vector<int>>>& sites, const map<int, vector<int>>& site_weight, const vector<double>& lnl_variant, const vector<int>& variants, int npattern, const evo_tree& rtree, int only_seg);
+
+// Get the likelihood as in get_likelihood_revised, together with its gradient
+// grad: derivatives with respect to the length of each edge (indexed by edge ID), and the rates of duplication, deletion, chromosome gain, chromosome loss and WGD
+// The derivatives for the rates are only computed when is_rate_grad is 1, and are 0 otherwise
+double get_likelihood_revised_grad(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type, vector<double>& grad, int is_rate_grad);
+
+// Compare the likelihood of a tree computed in single precision (lnl_type.use_float = 1) with that in double precision, to check whether single precision is accurate enough for a dataset
+// max_site_diff: maximum absolute difference in the log likelihood of a site pattern, over all the variants
+// Returns the log likelihood in single precision minus that in double precision
+double check_lnl_float(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type, double& max_site_diff);
+
+// Copy the options and site patterns in lnl_type to lnl_copy, without the partial likelihoods, decompositions and transition matrices kept between calls
+// The caches of lnl_copy are kept if it has the same data_version, so that a copy can be refreshed before each use without comparing the site patterns
+// Used to compute likelihoods in several threads at once, each with its own copy
+void copy_lnl_type(const LNL_TYPE& lnl_type, LNL_TYPE& lnl_copy);
+
 
 /* Compute the likelihood without grouping sites by chromosome, only considering segment duplication/deletion (not used)
 Precondition: the tree is valid
@@ -207,7 +469,116 @@ double get_likelihood(const vector<vector<int>>& vobs, evo_tree& rtree, const ve
 
 
 // Get the likelihood of the tree from likelihood table
-double extract_tree_lnl(vector<vector<double>>& L_sk_k, int Ns, int model);
+// nscale: number of rescalings done when filling the table
+double extract_tree_lnl(const double* L_sk_k, int Ns, int model, int nstate, int nscale = 0);
+
+// The same for a table in single precision, where nscale counts rescalings by SCALE_FACTOR_FLOAT
+double extract_tree_lnl(const float* L_sk_k, int Ns, int model, int nstate, int nscale = 0);
+
+
+/************** functions for incremental computation **************/
+
+// Clear the partial likelihoods in the cache if they were computed for another version of the observations (LNL_TYPE::data_version) or tree size
+// If only the rates change, all the nodes are marked to be recomputed
+void check_lnl_cache(LNL_CACHE& lnl_cache, int data_version, int ntotn, int nstate, const vector<double>& rates);
+
+// Allocate the tables of a pass for all the site patterns (ordered by chromosome) and the given variants, and fill the likelihood vectors at the tips
+// use_float: whether or not to keep the tables in single precision (in Lf instead of L)
+void init_lnl_pass(LNL_PASS& lnl_pass, map<int, vector<vector<int>>>& sites, const evo_tree& rtree, int model, int nstate, int is_total, const vector<int>& variants, int use_float = 0);
+
+// Append the states with nonzero likelihood at each of the nleaf tips of a table to tip_states, with the end of the states of each tip to tip_start
+// tip_start starts with 0 for the first site, so that the states of tip i are tip_states[tip_start[i]] to tip_states[tip_start[i + 1] - 1]
+void add_tip_states(const double* L_sk_k, int nleaf, int nstate, vector<int>& tip_start, vector<int>& tip_states);
+
+// Get the internal nodes (in the order of knodes) whose partial likelihoods in a pass are out of date,
+// which are the nodes with different children or branch lengths since they were computed and all their ancestors
+vector<int> get_dirty_nodes(const LNL_PASS& lnl_pass, const evo_tree& rtree, const vector<int>& knodes);
+
+// Record the children and branch lengths of the recomputed nodes
+void set_clean_nodes(LNL_PASS& lnl_pass, const evo_tree& rtree, const vector<int>& dirty_nodes);
+
+// Start a likelihood call with the rate matrix q of size n * n, clearing the cache if q has changed
+void start_pmat_cache(PMAT_CACHE& pmat_cache, const double* q, int n);
+
+// Get P(t) for each branch length in blens from the cache, computing those not found from the decomposition of the rate matrix in one call
+// The pointers stay valid until end_pmat_cache is called
+// pmat_per_blen_float: if not NULL, also get the matrices rounded to float, for a pass in single precision
+void get_pmats_cached(PMAT_CACHE& pmat_cache, const QMAT_EIGEN& qmat_eigen, const vector<double>& blens, vector<double*>& pmat_per_blen, vector<float*>* pmat_per_blen_float = NULL);
+
+// Add the lengths of the branches below knodes to blens, which are kept sorted and distinct
+void add_distinct_blens(const evo_tree& rtree, const vector<int>& knodes, vector<double>& blens);
+
+// Get the index in blens of the length of each edge below knodes (-1 for the other edges)
+// The kernels find the P-matrix of an edge by its id, without searching the branch lengths for each site
+void get_blen_per_edge(const evo_tree& rtree, const vector<int>& knodes, const vector<double>& blens, vector<int>& blen_per_edge);
+
+// Find the matrices of each edge below knodes in the maps of pmat_decomp
+void set_pmat_decomp_per_edge(PMAT_DECOMP& pmat_decomp, const evo_tree& rtree, const vector<int>& knodes);
+
+// Finish a likelihood call, dropping the least recently used matrices if there are too many
+void end_pmat_cache(PMAT_CACHE& pmat_cache);
+
+// Get P(t) of the Mk model with rate mu for each branch length in blens in closed form, without the cache, as they only take one exp() each
+// The matrices are stored in pmats, and pointed to by pmat_per_blen
+// pmats_float, pmat_per_blen_float: if not NULL, also get the matrices rounded to float, for a pass in single precision
+void get_pmats_mk(double mu, int nstate, const vector<double>& blens, vector<double>& pmats, vector<double*>& pmat_per_blen, vector<float>* pmats_float = NULL, vector<float*>* pmat_per_blen_float = NULL);
+
+// Get the variants (3 * has_wgd + z + 1) needed in get_likelihood_revised, skipping chromosome gain or loss when its rate is 0
+inline vector<int> get_lnl_variants(const evo_tree& rtree, int only_seg){
+    vector<int> variants;
+    int max_wgd = only_seg ? 0 : 1;
+    for(int has_wgd = 0; has_wgd <= max_wgd; has_wgd++){
+        for(int z = -1; z <= 1; z++){
+            if(z != 0){
+                if(only_seg) continue;
+                double chr_rate = z < 0 ? rtree.chr_loss_rate : rtree.chr_gain_rate;
+                if(fabs(chr_rate - 0) <= SMALL_VAL) continue;
+            }
+            variants.push_back(3 * has_wgd + z + 1);
+        }
+    }
+    return variants;
+}
+
+// Recompute the partial likelihoods at dirty_nodes for all the site patterns and variants in a pass, and get the log likelihood of each pattern
+// lnl_site: log likelihood of variant v of pattern p at lnl_site[p * nvariant + v]
+// For a pass in single precision, the transition matrices rounded to float are taken from pmat_per_blen_float and the log likelihoods are still in double precision
+void update_lnl_pass(LNL_PASS& lnl_pass, const vector<int>& dirty_nodes, const evo_tree& rtree, const vector<int>& blen_per_edge, const vector<double*>& pmat_per_blen, int model, int nstate, vector<double>& lnl_site, const vector<float*>& pmat_per_blen_float = vector<float*>());
+
+// The same with P(t) applied by uniformization, only for a pass in double precision
+void update_lnl_pass_sparse(LNL_PASS& lnl_pass, const vector<int>& dirty_nodes, const evo_tree& rtree, const vector<int>& blen_per_edge, const vector<UNIF_WEIGHTS>& unif_per_blen, const QMAT_SPARSE& qmat_sparse, int model, int nstate, vector<double>& lnl_site);
+
+// The dense kernels are vectorized and specialised up to 45 states (cn_max = 8 for model BOUNDA), so uniformization is only considered for more states in get_likelihood_revised
+const int MAX_NSTATE_DENSE = 45;
+
+// Whether or not applying P(t) by uniformization to the partial likelihoods of npattern * nvariant tables is expected to cost less than forming dense P-matrices and multiplying by them
+// blens: lengths of the branches to compute, npmat_new: number of dense P-matrices to form
+bool is_sparse_pmat_faster(const QMAT_SPARSE& qmat_sparse, const vector<double>& blens, int npmat_new, long npattern, int nvariant);
+
+// Get the gradient of the log likelihood of each site pattern in a pass with an up-to-date table of partial likelihoods, by a preorder traversal
+// pmat_edge: P(t) of each edge, indexed by edge ID
+// dpmat_edge: nderiv derivatives of P(t) of each edge, with respect to the branch length and then the rates of duplication and deletion
+// dlnl_site: derivatives for variant v with respect to the length of each edge and the rates of duplication and deletion, stored pattern by pattern
+void get_lnl_pass_grad(const LNL_PASS& lnl_pass, int v, const evo_tree& rtree, const vector<int>& knodes, const vector<double>& pmat_edge, const vector<double>& dpmat_edge, int nderiv, int model, int nstate, vector<double>& dlnl_site);
+
+// Get the partial likelihoods on both sides of edge eid for all the site patterns and variants in a pass with an up-to-date table, only following the path from the root to the edge
+// pmat_per_edge: P(t) of each edge below knodes, indexed by edge ID
+// lnl_site: log likelihood of variant v of pattern p at lnl_site[p * nvariant + v], as obtained by update_lnl_pass
+void get_lnl_pass_edge(const LNL_PASS& lnl_pass, const evo_tree& rtree, const vector<int>& knodes, int eid, const vector<double*>& pmat_per_edge, const double* qmat, int model, int nstate, const vector<double>& lnl_site, LNL_EDGE& lnl_edge);
+
+// Get the log likelihood of each site pattern and variant in lnl_edge with P(t) of the edge, together with its first and second derivatives with respect to t, stored with the same layout
+void get_lnl_edge_deriv(const LNL_EDGE& lnl_edge, const double* pmat, vector<double>& lnl_site, vector<double>& dlnl_site, vector<double>& d2lnl_site);
+
+// Get the likelihood as in get_likelihood_variants, together with its first and second derivatives with respect to one parameter
+// dlnl_variant, d2lnl_variant: derivatives of lnl_variant, with the same layout
+double get_likelihood_variants_deriv(map<int, vector<vector<int>>>& sites, const map<int, vector<int>>& site_weight, const vector<double>& lnl_variant, const vector<double>& dlnl_variant, const vector<double>& d2lnl_variant, const vector<int>& variants, int npattern, const evo_tree& rtree, int only_seg, double& dlnl, double& d2lnl);
+
+// Get the likelihood as in get_likelihood_revised, and the partial likelihoods on both sides of edge eid for the site patterns (lnl_edges[0]) and, when the acquisition bias is corrected, the invariant site (lnl_edges[1])
+double get_likelihood_revised_edge(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type, int eid, LNL_EDGE* lnl_edges);
+
+// Get the likelihood with the length of the edge in lnl_edges set to blen, together with its first and second derivatives with respect to blen, without traversing the tree
+// The other branches and the rates are those used in get_likelihood_revised_edge. The constraints on the tree are not checked
+double get_likelihood_revised_edge_deriv(const evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type, const LNL_EDGE* lnl_edges, double blen, double& dlnl, double& d2lnl);
 
 
 /************** functions for model DECOMP **************/
@@ -215,35 +586,88 @@ double extract_tree_lnl(vector<vector<double>>& L_sk_k, int Ns, int model);
 // L_sk_k has one row for each tree node and one column for each possible state; chr starting from 1
 // This function is critical in obtaining correct likelihood. If one tip is not initialized, the final likelihood will be 0.
 // nstate = comps.size();
-vector<vector<double>> initialize_lnl_table_decomp(vector<int>& obs, OBS_DECOMP& obs_decomp, int chr, const evo_tree& rtree, const set<vector<int>>& comps, int infer_wgd, int infer_chr, int cn_max, int is_total = 1);
+void initialize_lnl_table_decomp(double* L_sk_k, vector<int>& obs, OBS_DECOMP& obs_decomp, int chr, const evo_tree& rtree, const set<vector<int>>& comps, int infer_wgd, int infer_chr, int cn_max, int is_total = 1);
+
+// Get the likelihood vector of a sample with total copy number cn, which only depends on its number of WGD events (num_wgd, ignored if negative) and chr-level events (num_change)
+void get_tip_lnl_decomp(double* L_tip, int cn, int num_wgd, int num_change, const OBS_DECOMP& obs_decomp, const set<vector<int>>& comps);
+
+// Precompute the likelihood vectors at the tips for all total copy numbers up to cn_max, called once after reading the data
+// initialize_lnl_table_decomp copies the vectors from obs_decomp when they are built for the same comps
+void build_tip_lnl_decomp(OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, int infer_wgd, int infer_chr, int cn_max);
 
 
 // Assume the likelihood table is for each total copy number (no WGD order considered, deprecated)
-double get_prob_children_decomp(vector<vector<double>>& L_sk_k, const evo_tree& rtree, map<int, set<vector<int>>>& decomp_table, int sk, int cn_max, int nstate, PROB_DECOMP& prob_decomp, DIM_DECOMP& dim_decomp, int ni, int nj, int bli, int blj, int is_total);
+double get_prob_children_decomp(const double* L_sk_k, const evo_tree& rtree, map<int, set<vector<int>>>& decomp_table, int sk, int cn_max, int nstate, PROB_DECOMP& prob_decomp, DIM_DECOMP& dim_decomp, int ni, int nj, int bli, int blj, int is_total);
+
+
+// Assume the likelihood table is for each combination of states (replaced by get_prob_child_decomp)
+double get_prob_children_decomp2(const double* L_sk_k, const evo_tree& rtree, const set<vector<int>>& comps, int sk, int cn_max, int nstate, PROB_DECOMP& prob_decomp, DIM_DECOMP& dim_decomp, int ni, int nj, int bli, int blj, int is_total);
+
+
+// Compile the state combinations into flat index tables for P-matrices of the dimensions in dim_decomp
+// Only rebuilt when comps or the dimensions differ from those used for comp_decomp
+void build_comp_decomp(const set<vector<int>>& comps, const DIM_DECOMP& dim_decomp, COMP_DECOMP& comp_decomp);
 
 
-// Assume the likelihood table is for each combination of states
-double get_prob_children_decomp2(vector<vector<double>>& L_sk_k, const evo_tree& rtree, const set<vector<int>>& comps, int sk, PROB_DECOMP& prob_decomp, DIM_DECOMP& dim_decomp, int ni, int nj, int bli, int blj, int cn_max, int nstate, int is_total);
+// Get the probability of the subtree below a child given state sk of its parent, with L_c being the partial likelihoods of the child
+// pmat_wgd, pmat_chr, pmat_seg: P-matrices of the branch to the child, or a single 1 when the dimension is 1
+// Same as one factor of get_prob_children_decomp2, with the loop over child states free of branches and lookups in comps
+inline double get_prob_child_decomp(const double* L_c, const COMP_DECOMP& comp_decomp, int sk, const double* pmat_wgd, const double* pmat_chr, const double* pmat_seg){
+    const double* p_wgd = pmat_wgd + comp_decomp.row_wgd[sk];
+    const double* p_chr = pmat_chr + comp_decomp.row_chr[sk];
+    const double* p_chr2 = pmat_chr + comp_decomp.row_chr2[sk];
+    const double* p_seg = pmat_seg + comp_decomp.row_seg[sk];
+    const double* p_seg2 = pmat_seg + comp_decomp.row_seg2[sk];
+
+    const int* col_wgd = comp_decomp.col_wgd.data();
+    const int* col_chr = comp_decomp.col_chr.data();
+    const int* col_chr2 = comp_decomp.col_chr2.data();
+    const int* col_seg = comp_decomp.col_seg.data();
+    const int* col_seg2 = comp_decomp.col_seg2.data();
+
+    // states with L_c = 0 add exactly 0
+    double prob = 0.0;
+    for(int si = 0; si < comp_decomp.nstate; ++si){
+        prob += p_wgd[col_wgd[si]] * (p_chr[col_chr[si]] * p_chr2[col_chr2[si]]) * (p_seg[col_seg[si]] * p_seg2[col_seg2[si]]) * L_c[si];
+    }
+    return prob;
+}
+
+
+// Get the probabilities of the subtree below a child given each state of its parent, as get_prob_child_decomp for all sk
+// The transition probability is a product over independent chains, so the sum over child states is done one component at a time on the states reachable from comps
+// work: buffer of size 2 * comp_decomp.max_entry
+void get_prob_child_decomp_factored(const double* L_c, const COMP_DECOMP& comp_decomp, const double* pmat_wgd, const double* pmat_chr, const double* pmat_seg, double* work, double* prob);
 
 
 // Get the likelihood on one site of a chromosome
 // Assuming each observed copy number is composed of three type of events.
 // Sum over all possible states for initial and final nodes
 // Allow at most one WGD event along a branch
-void get_likelihood_site_decomp(vector<vector<double>>& L_sk_k, const evo_tree& rtree, const set<vector<int>>& comps, const vector<int>& knodes, PMAT_DECOMP& pmat_decomp, DIM_DECOMP& dim_decomp, int cn_max, int is_total);
+// Returns the number of rescalings of partial likelihoods, to be passed to extract_tree_lnl_decomp
+// nscale_k: if not NULL, the number of rescalings at each node in knodes is stored in it
+// The matrices of the edges are looked up in pmat_decomp.wgd_per_edge and so on, filled by set_pmat_decomp_per_edge
+// work: buffer of 2 * comp_decomp.max_entry + 2 * comp_decomp.nstate values
+int get_likelihood_site_decomp(double* L_sk_k, const evo_tree& rtree, const COMP_DECOMP& comp_decomp, const vector<int>& knodes, PMAT_DECOMP& pmat_decomp, double* work, int* nscale_k = NULL);
 
-// Used when WGD is considered, dealing with mutations of different types at different levels (no WGD order considered, deprecated)
-double get_likelihood_chr_decomp(map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const evo_tree& rtree, const set<vector<int>>& comps, const vector<int>& knodes, PMAT_DECOMP& pmat_decomp, DIM_DECOMP& dim_decomp, int infer_wgd, int infer_chr, int use_repeat, int cn_max, int is_total);
+// Sum up the log likelihood of site patterns (ordered by chromosome) over all chromosomes
+double get_likelihood_chr_decomp(map<int, vector<vector<int>>>& vobs, const map<int, vector<int>>& site_weight, const vector<double>& lnl_site);
 
+// Allocate the tables of a pass for all the site patterns (ordered by chromosome) and fill the likelihood vectors at the tips
+void init_lnl_pass_decomp(LNL_PASS& lnl_pass, map<int, vector<vector<int>>>& sites, OBS_DECOMP& obs_decomp, const evo_tree& rtree, const set<vector<int>>& comps, int infer_wgd, int infer_chr, int cn_max, int is_total);
 
-// Compute the likelihood of dummy sites consisting entirely of 2s for the tree
-double get_likelihood_invariant_decomp(OBS_DECOMP& obs_decomp, evo_tree& rtree, const set<vector<int>>& comps, const vector<int>& knodes, PMAT_DECOMP& pmat_decomp, DIM_DECOMP& dim_decomp, int infer_wgd, int infer_chr, int cn_max, int is_total);
+// Recompute the partial likelihoods at dirty_nodes for all the site patterns in a pass, and get the log likelihood of each pattern
+void update_lnl_pass_decomp(LNL_PASS& lnl_pass, const vector<int>& dirty_nodes, const evo_tree& rtree, const COMP_DECOMP& comp_decomp, PMAT_DECOMP& pmat_decomp, vector<double>& lnl_site);
 
 // Computing likelihood when WGD and chr gain/loss are incorporated
 // Assume likelihood is for allele-specific information
 double get_likelihood_decomp(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type);
 
 // Get the likelihood of the tree from likelihood table of state combinations
-double extract_tree_lnl_decomp(vector<vector<double>>& L_sk_k, const set<vector<int>>& comps, int Ns);
+// nscale: number of rescalings done when filling the table
+double extract_tree_lnl_decomp(const double* L_sk_k, const set<vector<int>>& comps, int Ns, int nscale = 0);
+
+// Same as above, with the normal state found in comp_decomp
+double extract_tree_lnl_decomp(const double* L_sk_k, const COMP_DECOMP& comp_decomp, int Ns, int nscale = 0);
 
 #endif
@@ -247,6 +247,154 @@ double *r8mat_expm1 ( int n, double a[] )
 }
 //****************************************************************************80
 
+static void r8mat_mm_ws ( int n, double a[], double b[], double c[], double c1[] )
+
+//****************************************************************************80
+//
+//  Purpose:
+//
+//    R8MAT_MM_WS multiplies two square matrices as R8MAT_MM, with a buffer
+//    given by the caller.
+//
+//  Parameters:
+//
+//    Input, int N, the order of the matrices.
+//
+//    Input, double A[N*N], B[N*N], the factors.
+//
+//    Output, double C[N*N], the product A*B, which may be A or B.
+//
+//    Workspace, double C1[N*N].
+//
+{
+  int i;
+  int j;
+  int k;
+
+  for ( i = 0; i < n; i++ )
+  {
+    for ( j = 0; j < n; j++ )
+    {
+      c1[i+j*n] = 0.0;
+      for ( k = 0; k < n; k++ )
+      {
+        c1[i+j*n] = c1[i+j*n] + a[i+k*n] * b[k+j*n];
+      }
+    }
+  }
+
+  r8mat_copy ( n, n, c1, c );
+
+  return;
+}
+//****************************************************************************80
+
+void r8mat_expm1_ws ( int n, double a[], double e[], double work[] )
+
+//****************************************************************************80
+//
+//  Purpose:
+//
+//    R8MAT_EXPM1_WS is R8MAT_EXPM1 without any memory allocation.
+//
+//  Discussion:
+//
+//    The result is written to E, and all the temporary matrices are taken
+//    from WORK, so that the function can be called repeatedly, and from
+//    several threads with a workspace for each thread.  The operations are
+//    the same as in R8MAT_EXPM1, with the same results.
+//
+//  Parameters:
+//
+//    Input, int N, the dimension of the matrix.
+//
+//    Input, double A[N*N], the matrix.
+//
+//    Output, double E[N*N], the estimate for exp(A).
+//
+//    Workspace, double WORK[4*N*N].
+//
+{
+  double *a2;
+  double a_norm;
+  double c;
+  double *d;
+  int ee;
+  int k;
+  const double one = 1.0;
+  int p;
+  const int q = 6;
+  int s;
+  double t;
+  double *tmp;
+  double *x;
+
+  a2 = work;
+  x = work + n * n;
+  d = work + 2 * n * n;
+  tmp = work + 3 * n * n;
+
+  r8mat_copy ( n, n, a, a2 );
+
+  a_norm = r8mat_norm_li ( n, n, a2 );
+
+  ee = ( int ) ( r8_log_2 ( a_norm ) ) + 1;
+
+  s = i4_max ( 0, ee + 1 );
+
+  t = 1.0 / pow ( 2.0, s );
+
+  r8mat_scale ( n, n, t, a2 );
+
+  r8mat_copy ( n, n, a2, x );
+
+  c = 0.5;
+
+  r8mat_identity ( n, e );
+
+  r8mat_add ( n, n, one, e, c, a2, e );
+
+  r8mat_identity ( n, d );
+
+  r8mat_add ( n, n, one, d, -c, a2, d );
+
+  p = 1;
+
+  for ( k = 2; k <= q; k++ )
+  {
+    c = c * ( double ) ( q - k + 1 ) / ( double ) ( k * ( 2 * q - k + 1 ) );
+
+    r8mat_mm_ws ( n, a2, x, x, tmp );
+
+    r8mat_add ( n, n, c, x, one, e, e );
+
+    if ( p )
+    {
+      r8mat_add ( n, n, c, x, one, d, d );
+    }
+    else
+    {
+      r8mat_add ( n, n, -c, x, one, d, d );
+    }
+
+    p = !p;
+  }
+//
+//  E -> inverse(D) * E, where D is overwritten by its factors
+//
+  r8mat_fss ( n, d, n, e );
+//
+//  E -> E^(2*S)
+//
+  for ( k = 1; k <= s; k++ )
+  {
+    r8mat_mm_ws ( n, e, e, e, tmp );
+  }
+
+  return;
+}
+//****************************************************************************80
+
 double *r8mat_expm2 ( int n, double a[] )
 
 //****************************************************************************80
@@ -6,5 +6,6 @@
 //  Real functions.
 //
 double *r8mat_expm1 ( int n, double a[] );
+void r8mat_expm1_ws ( int n, double a[], double e[], double work[] );
 double *r8mat_expm2 ( int n, double a[] );
 double *r8mat_expm3 ( int n, double a[] );
@@ -278,15 +278,21 @@ void get_rate_matrix_wgd(double* m, const double& wgd_rate, const int& wgd_max){
 // }
 // n = cn_max + 1 for model 1 (total copy number)
 void get_transition_matrix_bounded(double* q, double* p, const double& t, const int& n){
+    static thread_local EXPM_WORKSPACE expm_ws;
+    get_transition_matrix_bounded(q, p, t, n, expm_ws);
+}
+
+
+void get_transition_matrix_bounded(const double* q, double* p, const double& t, const int& n, EXPM_WORKSPACE& expm_ws){
     int debug = 0;
 
-    double *tmp = new double[n*n];
-    memset(tmp, 0.0, n*n*sizeof(double));
+    double* tmp = expm_ws.reserve(n);
+    double* res = tmp + n * n;
     for(int i = 0; i < n*n; i++){
         tmp[i] = q[i] * t;
     }
 
-    double* res = r8mat_expm1(n, tmp);
+    r8mat_expm1_ws(n, tmp, res, res + n * n);
     for(int i = 0; i < n*n; i++){
         if(res[i] < 0){
             p[i] = 0.0;
@@ -297,16 +303,469 @@ void get_transition_matrix_bounded(double* q, double* p, const double& t, const
 
     if(debug){
         cout << "t: " << t << endl;
-        r8mat_print(n, n, q, "  Q matrix:");
+        r8mat_print(n, n, const_cast<double*>(q), "  Q matrix:");
         r8mat_print(n, n, tmp, "  TMP matrix:");
         r8mat_print(n, n, p, "  P matrix:");
     }
+}
+
+
+void get_transition_matrix_deriv(const double* q, const double* dq, double* dp, const double& t, const int& n){
+    static thread_local EXPM_WORKSPACE expm_ws;
+    get_transition_matrix_deriv(q, dq, dp, t, n, expm_ws);
+}
+
+
+// The upper right block of exp([Q dQ; 0 Q] * t) is the integral of P(t - s) * dQ * P(s) over [0, t], which is dP(t)/dx when dQ = dQ/dx (Van Loan, 1978)
+void get_transition_matrix_deriv(const double* q, const double* dq, double* dp, const double& t, const int& n, EXPM_WORKSPACE& expm_ws){
+    int m = 2 * n;
+
+    double* tmp = expm_ws.reserve(m);
+    double* res = tmp + m * m;
+    fill(tmp, tmp + m * m, 0.0);
+    for(int i = 0; i < n; i++){
+        for(int j = 0; j < n; j++){
+            tmp[i + j*m] = q[i + j*n] * t;
+            tmp[(i + n) + (j + n)*m] = q[i + j*n] * t;
+            tmp[i + (j + n)*m] = dq[i + j*n] * t;
+        }
+    }
+
+    r8mat_expm1_ws(m, tmp, res, res + m * m);
+    for(int i = 0; i < n; i++){
+        for(int j = 0; j < n; j++){
+            dp[i + j*n] = res[i + (j + n)*m];
+        }
+    }
+}
+
+
+void get_eigen_decomposition(const double* q, const int& n, QMAT_EIGEN& qmat_eigen){
+    int debug = 0;
+    int dim_mat = n * n;
+
+    if(qmat_eigen.q.size() == dim_mat && equal(q, q + dim_mat, qmat_eigen.q.begin())){
+        return;
+    }
+
+    qmat_eigen.n = n;
+    qmat_eigen.is_valid = 0;
+    qmat_eigen.q.assign(q, q + dim_mat);
+    qmat_eigen.lambda.assign(n, 0.0);
+    qmat_eigen.U.assign(dim_mat, 0.0);
+    qmat_eigen.U_inv.assign(dim_mat, 0.0);
+    qmat_eigen.min_prob = 0.0;
+    qmat_eigen.poisson_rate = 0.0;
+
+    // states reachable through the nonzero entries of q (transitive closure)
+    qmat_eigen.is_reachable.assign(dim_mat, 0);
+    for(int i = 0; i < n; i++){
+        for(int j = 0; j < n; j++){
+            if(i == j || q[i + j * n] != 0){
+                qmat_eigen.is_reachable[i + j * n] = 1;
+            }
+        }
+    }
+    for(int k = 0; k < n; k++){
+        for(int i = 0; i < n; i++){
+            if(!qmat_eigen.is_reachable[i + k * n]) continue;
+            for(int j = 0; j < n; j++){
+                if(qmat_eigen.is_reachable[k + j * n]){
+                    qmat_eigen.is_reachable[i + j * n] = 1;
+                }
+            }
+        }
+    }
+
+    // A pure birth chain with one rate (WGD) has repeated eigenvalues and no decomposition, but P(t) has a closed form
+    double r = (n > 1) ? q[1 * n] : 0.0;
+    bool is_poisson = r > 0;
+    for(int i = 0; i < n && is_poisson; i++){
+        for(int j = 0; j < n; j++){
+            double qij = 0.0;
+            if(i < n - 1 && j == i) qij = -r;
+            if(i < n - 1 && j == i + 1) qij = r;
+            if(q[i + j * n] != qij){
+                is_poisson = false;
+                break;
+            }
+        }
+    }
+    if(is_poisson){
+        qmat_eigen.poisson_rate = r;
+        qmat_eigen.is_valid = 1;
+        return;
+    }
+
+    if(!get_eigen_decomposition_tridiag(q, n, qmat_eigen) && !get_eigen_decomposition_general(q, n, qmat_eigen)){
+        if(debug){
+            cout << "Eigendecomposition of rate matrix is not used" << endl;
+        }
+        return;
+    }
+
+    // condition number of U in 1-norm, which bounds the error of P(t)
+    double norm_U = 0.0;
+    double norm_U_inv = 0.0;
+    for(int j = 0; j < n; j++){
+        double sum_U = 0.0;
+        double sum_U_inv = 0.0;
+        for(int i = 0; i < n; i++){
+            sum_U += fabs(qmat_eigen.U[i + j * n]);
+            sum_U_inv += fabs(qmat_eigen.U_inv[i + j * n]);
+        }
+        norm_U = max(norm_U, sum_U);
+        norm_U_inv = max(norm_U_inv, sum_U_inv);
+    }
+    double cond = norm_U * norm_U_inv;
+    if(std::isfinite(cond) && cond < MAX_COND_EIGEN){
+        qmat_eigen.is_valid = 1;
+        // rounding errors of P(t) are bounded by about n * epsilon * cond, as exp(lambda * t) <= 1
+        qmat_eigen.min_prob = n * DBL_EPSILON * cond / MAX_REL_ERR_EIGEN;
+    }
+
+    if(debug){
+        cout << "Condition number of eigenvectors: " << cond << endl;
+        cout << "Eigendecomposition of rate matrix is " << (qmat_eigen.is_valid ? "used" : "not used") << endl;
+        r8mat_print(n, n, qmat_eigen.q.data(), "  Q matrix:");
+        r8mat_print(n, n, qmat_eigen.U.data(), "  U matrix:");
+        r8mat_print(n, n, qmat_eigen.U_inv.data(), "  U^-1 matrix:");
+    }
+}
+
+
+// The eigenvectors of S are found by the symmetric solver of GSL, which are accurate and orthogonal
+// For an absorbing state a, the left eigenvector is e_a, and the right one has the probabilities of absorption in a
+bool get_eigen_decomposition_tridiag(const double* q, const int& n, QMAT_EIGEN& qmat_eigen){
+    for(int i = 0; i < n; i++){
+        for(int j = 0; j < n; j++){
+            if(abs(i - j) > 1 && q[i + j * n] != 0){
+                return false;
+            }
+        }
+    }
+
+    // the other states are lo, ..., hi
+    vector<int> absorbing;
+    int lo = 0;
+    int hi = n - 1;
+    if(q[0] == 0 && (n == 1 || q[n] == 0)){
+        absorbing.push_back(0);
+        lo++;
+    }
+    if(hi > lo && q[hi + hi * n] == 0 && q[hi + (hi - 1) * n] == 0){
+        absorbing.push_back(hi);
+        hi--;
+    }
+    int m = hi - lo + 1;
+    if(m < 2){
+        return false;
+    }
 
-    delete [] tmp;
-    delete [] res;
+    // d[i + 1] / d[i] = sqrt(q[i, i + 1] / q[i + 1, i]) for the states counted from lo
+    vector<double> d(m, 1.0);
+    for(int i = 0; i < m - 1; i++){
+        double up = q[(lo + i) + (lo + i + 1) * n];
+        double down = q[(lo + i + 1) + (lo + i) * n];
+        if(!(up > 0 && down > 0)){
+            return false;
+        }
+        d[i + 1] = d[i] * sqrt(up / down);
+        if(!std::isfinite(d[i + 1]) || d[i + 1] == 0){
+            return false;
+        }
+    }
+
+    gsl_matrix* s = gsl_matrix_calloc(m, m);
+    for(int i = 0; i < m; i++){
+        gsl_matrix_set(s, i, i, q[(lo + i) + (lo + i) * n]);
+        if(i < m - 1){
+            double sij = sqrt(q[(lo + i) + (lo + i + 1) * n] * q[(lo + i + 1) + (lo + i) * n]);
+            gsl_matrix_set(s, i, i + 1, sij);
+            gsl_matrix_set(s, i + 1, i, sij);
+        }
+    }
+
+    gsl_vector* eval = gsl_vector_alloc(m);
+    gsl_matrix* evec = gsl_matrix_alloc(m, m);
+    gsl_eigen_symmv_workspace* w = gsl_eigen_symmv_alloc(m);
+    int status = gsl_eigen_symmv(s, eval, evec, w);
+    gsl_eigen_symmv_free(w);
+    gsl_matrix_free(s);
+
+    // U = D^-1 * V and U^-1 = V^T * D on the states lo, ..., hi, with the eigenvectors in the columns of V
+    bool is_valid = (status == 0);
+    for(auto a : absorbing){
+        qmat_eigen.lambda[a] = 0.0;
+        qmat_eigen.U[a + a * n] = 1.0;
+        qmat_eigen.U_inv[a + a * n] = 1.0;
+    }
+    for(int k = 0; k < m && is_valid; k++){
+        int c = lo + k;
+        double lambda = gsl_vector_get(eval, k);
+        qmat_eigen.lambda[c] = lambda;
+        for(int i = 0; i < m; i++){
+            double v = gsl_matrix_get(evec, i, k);
+            qmat_eigen.U[(lo + i) + c * n] = v / d[i];
+            qmat_eigen.U_inv[c + (lo + i) * n] = v * d[i];
+        }
+        // the left eigenvector has U^-1[c, a] = u * q[, a] / lambda, with u the left eigenvector on the other states
+        // the right eigenvector of a has -sum_c U[, c] * U^-1[c, a] on the other states
+        for(auto a : absorbing){
+            double ub = 0.0;
+            for(int i = 0; i < m; i++){
+                ub += qmat_eigen.U_inv[c + (lo + i) * n] * q[(lo + i) + a * n];
+            }
+            if(ub == 0) continue;
+            if(lambda == 0){
+                is_valid = false;
+                break;
+            }
+            double wa = ub / lambda;
+            qmat_eigen.U_inv[c + a * n] = wa;
+            for(int i = 0; i < m; i++){
+                qmat_eigen.U[(lo + i) + a * n] -= qmat_eigen.U[(lo + i) + c * n] * wa;
+            }
+        }
+    }
+    gsl_vector_free(eval);
+    gsl_matrix_free(evec);
+
+    if(!is_valid){
+        fill(qmat_eigen.lambda.begin(), qmat_eigen.lambda.end(), 0.0);
+        fill(qmat_eigen.U.begin(), qmat_eigen.U.end(), 0.0);
+        fill(qmat_eigen.U_inv.begin(), qmat_eigen.U_inv.end(), 0.0);
+    }
+
+    return is_valid;
 }
 
 
+// Eigenvalues and eigenvectors are computed with GSL, since the rate matrices are not symmetric
+bool get_eigen_decomposition_general(const double* q, const int& n, QMAT_EIGEN& qmat_eigen){
+    gsl_matrix* m = gsl_matrix_alloc(n, n);
+    for(int i = 0; i < n; i++){
+        for(int j = 0; j < n; j++){
+            gsl_matrix_set(m, i, j, q[i + j * n]);
+        }
+    }
+
+    gsl_vector_complex* eval = gsl_vector_complex_alloc(n);
+    gsl_matrix_complex* evec = gsl_matrix_complex_alloc(n, n);
+    gsl_eigen_nonsymmv_workspace* w = gsl_eigen_nonsymmv_alloc(n);
+    int status = gsl_eigen_nonsymmv(m, eval, evec, w);
+    gsl_eigen_nonsymmv_free(w);
+
+    // the decomposition is only used when all the eigenvalues and eigenvectors are real
+    bool is_real = (status == 0);
+    for(int k = 0; k < n && is_real; k++){
+        gsl_complex lambda = gsl_vector_complex_get(eval, k);
+        if(fabs(GSL_IMAG(lambda)) > SMALL_VAL){
+            is_real = false;
+        }
+        qmat_eigen.lambda[k] = GSL_REAL(lambda);
+        for(int i = 0; i < n; i++){
+            gsl_complex u = gsl_matrix_complex_get(evec, i, k);
+            if(fabs(GSL_IMAG(u)) > SMALL_VAL){
+                is_real = false;
+            }
+            qmat_eigen.U[i + k * n] = GSL_REAL(u);
+            gsl_matrix_set(m, i, k, GSL_REAL(u));
+        }
+    }
+    gsl_vector_complex_free(eval);
+    gsl_matrix_complex_free(evec);
+
+    bool is_valid = false;
+    if(is_real){
+        gsl_permutation* perm = gsl_permutation_alloc(n);
+        int signum = 0;
+        gsl_linalg_LU_decomp(m, perm, &signum);
+
+        bool is_singular = false;
+        for(int i = 0; i < n; i++){
+            if(gsl_matrix_get(m, i, i) == 0){
+                is_singular = true;
+                break;
+            }
+        }
+
+        if(!is_singular){
+            gsl_matrix* m_inv = gsl_matrix_alloc(n, n);
+            gsl_linalg_LU_invert(m, perm, m_inv);
+            for(int i = 0; i < n; i++){
+                for(int j = 0; j < n; j++){
+                    qmat_eigen.U_inv[i + j * n] = gsl_matrix_get(m_inv, i, j);
+                }
+            }
+            gsl_matrix_free(m_inv);
+            is_valid = true;
+        }
+        gsl_permutation_free(perm);
+    }
+    gsl_matrix_free(m);
+
+    return is_valid;
+}
+
+
+void get_transition_matrix_eigen(const QMAT_EIGEN& qmat_eigen, double* p, const double& t){
+    get_transition_matrices_eigen(qmat_eigen, &t, &p, 1);
+}
+
+
+void get_transition_matrices_eigen(const QMAT_EIGEN& qmat_eigen, const double* blens, double* const* pmats, const int& nblen){
+    int n = qmat_eigen.n;
+
+    if(qmat_eigen.poisson_rate > 0){
+        for(int b = 0; b < nblen; b++){
+            get_transition_matrix_poisson(qmat_eigen.poisson_rate, pmats[b], blens[b], n);
+        }
+        return;
+    }
+
+    if(!qmat_eigen.is_valid){
+        for(int b = 0; b < nblen; b++){
+            get_transition_matrix_bounded(const_cast<double*>(qmat_eigen.q.data()), pmats[b], blens[b], n);
+        }
+        return;
+    }
+
+    for(int b = 0; b < nblen; b++){
+        fill(pmats[b], pmats[b] + n * n, 0.0);
+    }
+
+    // sum of outer products of the eigenvectors, weighted by exp(lambda * t)
+    // each eigenvector is used for all the branches while it is in cache
+    for(int k = 0; k < n; k++){
+        for(int b = 0; b < nblen; b++){
+            if(blens[b] == 0) continue;
+            double* p = pmats[b];
+            double ek = exp(qmat_eigen.lambda[k] * blens[b]);
+            for(int j = 0; j < n; j++){
+                double c = ek * qmat_eigen.U_inv[k + j * n];
+                if(c == 0) continue;
+                for(int i = 0; i < n; i++){
+                    p[i + j * n] += qmat_eigen.U[i + k * n] * c;
+                }
+            }
+        }
+    }
+
+    for(int b = 0; b < nblen; b++){
+        double* p = pmats[b];
+        if(blens[b] == 0){
+            for(int i = 0; i < n; i++){
+                p[i + i * n] = 1.0;
+            }
+            continue;
+        }
+        for(int i = 0; i < n * n; i++){
+            if(!qmat_eigen.is_reachable[i]){
+                p[i] = 0.0;
+            }else if(p[i] < qmat_eigen.min_prob){
+                // a small probability (e.g. of several changes on a short branch) is not accurate, which may make a site impossible
+                get_transition_matrix_bounded(const_cast<double*>(qmat_eigen.q.data()), p, blens[b], n);
+                break;
+            }
+        }
+    }
+}
+
+
+void get_transition_matrix_poisson(const double& r, double* p, const double& t, const int& n){
+    double x = r * t;
+    double e = exp(-x);
+
+    fill(p, p + n * n, 0.0);
+    for(int i = 0; i < n - 1; i++){
+        double pk = e;
+        for(int j = i; j < n - 1; j++){
+            p[i + j * n] = pk;
+            pk *= x / (j - i + 1);
+        }
+        // P(Poisson(x) >= n - 1 - i), which is accurate for a small x
+        p[i + (n - 1) * n] = gsl_sf_gamma_inc_P(n - 1 - i, x);
+    }
+    p[(n - 1) + (n - 1) * n] = 1.0;
+}
+
+
+
+void get_sparse_rate_matrix(const double* q, const int& n, QMAT_SPARSE& qmat_sparse){
+    int dim_mat = n * n;
+    if(qmat_sparse.q.size() == dim_mat && equal(q, q + dim_mat, qmat_sparse.q.begin())){
+        return;
+    }
+
+    qmat_sparse.n = n;
+    qmat_sparse.q.assign(q, q + dim_mat);
+    qmat_sparse.lambda = 0.0;
+    for(int i = 0; i < n; i++){
+        qmat_sparse.lambda = max(qmat_sparse.lambda, -q[i + i * n]);
+    }
+
+    qmat_sparse.row_start.assign(1, 0);
+    qmat_sparse.col.clear();
+    qmat_sparse.val.clear();
+    for(int i = 0; i < n; i++){
+        for(int j = 0; j < n; j++){
+            double b = (i == j) ? 1.0 : 0.0;
+            if(qmat_sparse.lambda > 0) b += q[i + j * n] / qmat_sparse.lambda;
+            if(b == 0) continue;
+            qmat_sparse.col.push_back(j);
+            qmat_sparse.val.push_back(b);
+        }
+        qmat_sparse.row_start.push_back(qmat_sparse.col.size());
+    }
+}
+
+
+void get_uniformization_weights(const QMAT_SPARSE& qmat_sparse, const double& t, UNIF_WEIGHTS& unif){
+    double lt = qmat_sparse.lambda * t;
+    unif.nstep = max(1, (int) ceil(lt / MAX_UNIF_STEP));
+    double x = lt / unif.nstep;
+
+    // the weights increase up to k = x, and the series is cut after that when they become negligible
+    unif.weights.assign(1, exp(-x));
+    for(int k = 1; k <= x || unif.weights.back() >= MIN_UNIF_WEIGHT; k++){
+        unif.weights.push_back(unif.weights.back() * x / k);
+    }
+}
+
+
+void apply_transition_matrix_sparse(const QMAT_SPARSE& qmat_sparse, const UNIF_WEIGHTS& unif, const double* v, double* pv, double* work){
+    int n = qmat_sparse.n;
+    double* y = work;
+    double* by = work + n;
+    const int* row_start = qmat_sparse.row_start.data();
+    const int* col = qmat_sparse.col.data();
+    const double* val = qmat_sparse.val.data();
+
+    copy(v, v + n, pv);
+    for(int step = 0; step < unif.nstep; step++){
+        // y = B^k * v of the step, added up to pv with the Poisson weights
+        copy(pv, pv + n, y);
+        for(int i = 0; i < n; i++){
+            pv[i] = unif.weights[0] * y[i];
+        }
+        for(int k = 1; k < unif.weights.size(); k++){
+            for(int i = 0; i < n; i++){
+                double sum = 0.0;
+                for(int e = row_start[i]; e < row_start[i + 1]; e++){
+                    sum += val[e] * y[col[e]];
+                }
+                by[i] = sum;
+            }
+            swap(y, by);
+            double w = unif.weights[k];
+            for(int i = 0; i < n; i++){
+                pv[i] += w * y[i];
+            }
+        }
+    }
+}
+
 
 // not used in practice to save effeorts in function call
 double get_transition_prob_bounded(double* p, const int& sk, const int& sj, const int& n){
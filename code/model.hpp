@@ -11,12 +11,75 @@
 #include "matexp/matrix_exponential.hpp"
 #include "matexp/r8lib.hpp"
 
+#include <cfloat>   // for DBL_EPSILON
+#include <gsl/gsl_eigen.h>
+#include <gsl/gsl_linalg.h>
+#include <gsl/gsl_sf_gamma.h>
+
 
 
 typedef vector<double>::iterator DBIter;  // convenience typedefs
 typedef pair<DBIter, DBIter> DBIterPair;
 
 
+// Eigendecomposition Q = U * diag(lambda) * U^-1 of a rate matrix, used to get P(t) for any branch length without matrix exponential
+// Matrices are stored column by column as the rate matrix
+// The tridiagonal rate matrices of birth-death chains are decomposed as symmetric matrices, and a pure birth chain (WGD) has P(t) in closed form
+struct QMAT_EIGEN{
+  int n;
+  int is_valid;   // 0 if Q has complex eigenvalues or ill-conditioned eigenvectors, when P(t) is computed by r8mat_expm1
+  vector<double> q;   // the decomposed rate matrix
+  vector<double> lambda;
+  vector<double> U;
+  vector<double> U_inv;
+  vector<int> is_reachable;   // whether state j can be reached from state i, when P(t)[i + j * n] > 0 for any t > 0
+  double min_prob;    // smallest P(t) entry that can be obtained accurately from the decomposition
+  double poisson_rate;  // > 0 if Q is a pure birth chain with this rate and the last state absorbing, when there is no decomposition
+};
+
+// Rate matrix in compressed sparse rows, used to apply P(t) to vectors by uniformization without forming P(t)
+// P(t) = sum_k Poisson(k; lambda * t) * B^k with B = I + Q / lambda, which has no negative entries, so there is no cancellation
+// The bounded rate matrices only have a few nonzero entries in each row, so B * v costs much less than a dense P(t) * v for many states
+struct QMAT_SPARSE{
+  int n;
+  vector<double> q;   // the rate matrix, stored column by column
+  double lambda;      // largest rate of leaving a state
+  vector<int> row_start;  // entries of row i are at row_start[i] to row_start[i + 1] - 1
+  vector<int> col;
+  vector<double> val;     // entries of B
+};
+
+// Poisson weights of uniformization for one branch, which is split into nstep steps so that lambda * t of each step is at most MAX_UNIF_STEP
+struct UNIF_WEIGHTS{
+  int nstep;
+  vector<double> weights;   // Poisson(k; lambda * t / nstep) for k = 0, 1, ..., truncated when below MIN_UNIF_WEIGHT
+};
+
+// exp(-lambda * t) of a step does not underflow and the number of terms stays small
+const double MAX_UNIF_STEP = 10.0;
+const double MIN_UNIF_WEIGHT = 1e-18;
+
+// Buffers of the matrix exponential in get_transition_matrix_bounded and get_transition_matrix_deriv, allocated once for the largest matrix and reused
+// A workspace must not be shared by threads running at the same time
+struct EXPM_WORKSPACE{
+  vector<double> work;
+
+  // Get 6 * n * n values: the scaled rate matrix, the result of r8mat_expm1_ws and its workspace
+  double* reserve(int n){
+    size_t size = (size_t) 6 * n * n;
+    if(work.size() < size){
+      work.resize(size);
+    }
+    return work.data();
+  }
+};
+
+// maximum condition number of the eigenvectors for the decomposition to be used
+const double MAX_COND_EIGEN = 1e6;
+// maximum relative error of a transition probability obtained from the decomposition, used to get QMAT_EIGEN::min_prob
+const double MAX_REL_ERR_EIGEN = 1e-3;
+
+
 // to validate the rate matrix (row sum should be 0)
 bool check_matrix_row_sum(double *mat, int nstate);
 
@@ -44,6 +107,24 @@ inline double get_transition_prob(const double& mu, const double& blength, const
   return prob;
 }
 
+// The two distinct entries of P(t) in the Mk model above, on and off the diagonal, with one call of exp()
+inline void get_transition_prob_mk(const double& mu, const double& blength, double& p_same, double& p_diff){
+  double e = exp(-mu * blength);
+  p_same = e + (1 - e) * 0.2;
+  p_diff = (1 - e) * 0.2;
+}
+
+// P(t) of the Mk model above for n states in column major order, as used by the kernels of the other models
+inline void get_transition_matrix_mk(const double& mu, double* p, const double& blength, const int& n){
+  double p_same, p_diff;
+  get_transition_prob_mk(mu, blength, p_same, p_diff);
+  for(int j = 0; j < n; ++j){
+    for(int i = 0; i < n; ++i){
+      p[i + j * n] = (i == j) ? p_same : p_diff;
+    }
+  }
+}
+
 /*************** BOUND model *****************/
 
 // model when copy number is bounded by 0 and cn_max
@@ -54,8 +135,50 @@ void get_rate_matrix_bounded(double* m, const double& dup_rate, const double& de
 void get_rate_matrix_allele_specific(double* m, const double& dup_rate, const double& del_rate, const int& cn_max);
 
 // n = cn_max + 1 for model 1 (total copy number)
+// Uses a workspace kept by each thread, so that no memory is allocated after the first calls
 void get_transition_matrix_bounded(double* q, double* p, const double& t, const int& n);
 
+// The same with a workspace given by the caller
+void get_transition_matrix_bounded(const double* q, double* p, const double& t, const int& n, EXPM_WORKSPACE& expm_ws);
+
+// Get the derivative of P(t) with respect to a parameter x of the rate matrix q, where dq = dQ/dx
+void get_transition_matrix_deriv(const double* q, const double* dq, double* dp, const double& t, const int& n);
+
+// The same with a workspace given by the caller, used for a matrix of dimension 2 * n
+void get_transition_matrix_deriv(const double* q, const double* dq, double* dp, const double& t, const int& n, EXPM_WORKSPACE& expm_ws);
+
+// Decompose the rate matrix q of dimension n, only done when q differs from the matrix decomposed in qmat_eigen
+void get_eigen_decomposition(const double* q, const int& n, QMAT_EIGEN& qmat_eigen);
+
+// Decompose a tridiagonal rate matrix with positive rates between neighbouring states, apart from absorbing first or last states
+// Q = D^-1 * S * D on the other states with a diagonal D and a symmetric S, whose eigenvectors are orthogonal
+// Return false if q does not have this structure, leaving qmat_eigen for the general decomposition
+bool get_eigen_decomposition_tridiag(const double* q, const int& n, QMAT_EIGEN& qmat_eigen);
+
+// Decompose any rate matrix, return false if it has complex eigenvalues or the eigenvectors are singular
+bool get_eigen_decomposition_general(const double* q, const int& n, QMAT_EIGEN& qmat_eigen);
+
+// Get P(t) = U * diag(exp(lambda * t)) * U^-1
+// Fall back to get_transition_matrix_bounded if the decomposition is not valid or a reachable state gets a probability below min_prob, which is lost in rounding errors
+void get_transition_matrix_eigen(const QMAT_EIGEN& qmat_eigen, double* p, const double& t);
+
+// Get P(t) for nblen branch lengths in one call, writing the matrix of blens[b] to pmats[b]
+void get_transition_matrices_eigen(const QMAT_EIGEN& qmat_eigen, const double* blens, double* const* pmats, const int& nblen);
+
+// P(t) of a pure birth chain with rate r and n states, where the last state is absorbing
+// P(t)[i + j * n] = Poisson(j - i; r * t) for i <= j < n - 1, and the last column has the upper tail of the Poisson distribution
+void get_transition_matrix_poisson(const double& r, double* p, const double& t, const int& n);
+
+// Store the rate matrix q of dimension n in sparse form for uniformization, only done when q differs from the matrix in qmat_sparse
+void get_sparse_rate_matrix(const double* q, const int& n, QMAT_SPARSE& qmat_sparse);
+
+// Get the Poisson weights to apply P(t) by uniformization for branch length t
+void get_uniformization_weights(const QMAT_SPARSE& qmat_sparse, const double& t, UNIF_WEIGHTS& unif);
+
+// Get pv = P(t) * v, i.e. pv[i] = sum_j P(t)[i + j * n] * v[j], with the weights of t from get_uniformization_weights
+// work: buffer of 2 * n values
+void apply_transition_matrix_sparse(const QMAT_SPARSE& qmat_sparse, const UNIF_WEIGHTS& unif, const double* v, double* pv, double* work);
+
 // not used in practice to save effeorts in function call
 double get_transition_prob_bounded(double* p, const int& sk, const int& sj, const int& n);
 
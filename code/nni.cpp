@@ -694,6 +694,7 @@ NNIMove get_best_NNI_for_bran(evo_tree& rtree, map<int, vector<vector<int>>>& vo
         }
 
     		double score = -DBL_MAX;
+        // the partial likelihoods of the move are in lnl_type.lnl_cache after its branches are optimized, so it is scored alone instead of with get_likelihood_revised_batch
         if(lnl_type.model == DECOMP){
             score = get_likelihood_decomp(*trees[cnt], vobs, obs_decomp, comps, lnl_type);
         }else{
@@ -790,6 +791,8 @@ void do_hill_climbing_NNI(evo_tree& rtree, map<int, vector<vector<int>>>& vobs,
     int maxj = opt_type.maxj;
     int miter = opt_type.miter;
     double tolerance = opt_type.tolerance;
+    // parameters and L-BFGS-B memory of the last optimized tree, to start the optimization after the next NNIs from
+    BFGS_SESSION session;
 
     for(numSteps = 1; numSteps <= max_steps; numSteps++){
         if(debug){
@@ -909,7 +912,7 @@ void do_hill_climbing_NNI(evo_tree& rtree, map<int, vector<vector<int>>>& vobs,
         if(cons){  // optimization of all branches under time constraints
             // cout << "1st global optimization" << endl;
             double min_nlnl = MAX_NLNL;
-            max_likelihood_BFGS(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, min_nlnl);
+            max_likelihood_BFGS_warm(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, session, min_nlnl);
             curScore = -min_nlnl;
         }else{
             curScore = optimize_all_branches(rtree, vobs, obs_decomp, comps, lnl_type, 2, loglh_epsilon, maxj);
@@ -956,7 +959,8 @@ void do_hill_climbing_NNI(evo_tree& rtree, map<int, vector<vector<int>>>& vobs,
                 if(cons){
                     // cout << "2nd global optimization" << endl;
                     double min_nlnl = MAX_NLNL;
-                    max_likelihood_BFGS(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, min_nlnl);
+                    // keep the restored parameters, only the curvature is taken from the session
+                    max_likelihood_BFGS(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, min_nlnl, &session);
                     curScore = -min_nlnl;
                 }else{
                     curScore = optimize_all_branches(rtree, vobs, obs_decomp, comps, lnl_type, 2, loglh_epsilon, maxj);
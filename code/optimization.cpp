@@ -1,12 +1,16 @@
 #include "optimization.hpp"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 // using namespace std;
 
 
 double my_f(const gsl_vector *v, void *params){
   GSL_PARAM* gsl_param = (GSL_PARAM*) params;
   evo_tree* tree = &(gsl_param->rtree);
-  LNL_TYPE lnl_type = gsl_param->lnl_type;
+  LNL_TYPE& lnl_type = gsl_param->lnl_type;
   // evo_tree *tree = (evo_tree*) params;
 
   //create a new tree with the current branch lengths
@@ -34,7 +38,7 @@ double my_f(const gsl_vector *v, void *params){
 double my_f_mu(const gsl_vector *v, void *params){
   GSL_PARAM* gsl_param = (GSL_PARAM*) params;
   evo_tree* tree = &(gsl_param->rtree);
-  LNL_TYPE lnl_type = gsl_param->lnl_type;
+  LNL_TYPE& lnl_type = gsl_param->lnl_type;
   // evo_tree *tree = (evo_tree*) params;
 
   //create a new tree with the current branch lengths
@@ -63,7 +67,7 @@ double my_f_mu(const gsl_vector *v, void *params){
 double my_f_cons(const gsl_vector *v, void *params){
   GSL_PARAM* gsl_param = (GSL_PARAM*) params;
   evo_tree* tree = &(gsl_param->rtree);
-  LNL_TYPE lnl_type = gsl_param->lnl_type;
+  LNL_TYPE& lnl_type = gsl_param->lnl_type;
   // evo_tree *tree = (evo_tree*) params;
 
   //create a new tree with the current parameters observing timing constraints
@@ -100,7 +104,7 @@ double my_f_cons(const gsl_vector *v, void *params){
 double my_f_cons_mu(const gsl_vector *v, void *params){
   GSL_PARAM* gsl_param = (GSL_PARAM*) params;
   evo_tree* tree = &(gsl_param->rtree);
-  LNL_TYPE lnl_type = gsl_param->lnl_type;
+  LNL_TYPE& lnl_type = gsl_param->lnl_type;
   // evo_tree *tree = (evo_tree*) params;
 
   //create a new tree with the current parameters observing timing constraints
@@ -638,6 +642,77 @@ double optimize_mutation_rates(evo_tree& rtree, map<int, vector<vector<int>>>& v
 
 
 
+double optimize_one_branch_newton(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type, double tolerance, double* fx){
+    int debug = 0;
+    int eid = rtree.current_eid;
+    double current_len = rtree.edges[eid].length;
+
+    LNL_EDGE lnl_edges[2];
+    double lnl0 = get_likelihood_revised_edge(rtree, vobs, lnl_type, eid, lnl_edges);
+    *fx = -lnl0;
+    if(lnl0 <= SMALL_LNL){
+        return current_len;
+    }
+
+    // The maximum is kept in [lo, hi], narrowed by the sign of the first derivative
+    double lo = BLEN_MIN, hi = BLEN_MAX;
+    double t = max(BLEN_MIN, min(BLEN_MAX, current_len));
+    double d1, d2;
+    double lnl = get_likelihood_revised_edge_deriv(rtree, vobs, lnl_type, lnl_edges, t, d1, d2);
+    int niter = 0;
+    for(; niter < MAX_NEWTON_ITER; niter++){
+        if(d1 > 0) lo = t;
+        else hi = t;
+        // the maximum is at one bound
+        if(lo == hi) break;
+
+        double t_new = t;
+        if(d2 < 0){
+            t_new = max(BLEN_MIN, min(BLEN_MAX, t - d1 / d2));
+        }
+        if(d2 >= 0 || t_new < lo || t_new > hi){
+            // the likelihood is not concave at t or the step leaves the bracket, so bisect it, or move by a factor of 2 towards a bound not reached yet
+            if(d1 > 0) t_new = hi < BLEN_MAX ? (t + hi) / 2 : min(2 * t, BLEN_MAX);
+            else t_new = lo > BLEN_MIN ? (lo + t) / 2 : max(t / 2, BLEN_MIN);
+        }
+
+        double d1_new, d2_new;
+        double lnl_new = get_likelihood_revised_edge_deriv(rtree, vobs, lnl_type, lnl_edges, t_new, d1_new, d2_new);
+        // halve the step if the likelihood decreases
+        for(int i = 0; i < MAX_NEWTON_ITER && lnl_new < lnl; i++){
+            t_new = (t + t_new) / 2;
+            lnl_new = get_likelihood_revised_edge_deriv(rtree, vobs, lnl_type, lnl_edges, t_new, d1_new, d2_new);
+        }
+        if(lnl_new < lnl) break;
+
+        double step = fabs(t_new - t);
+        t = t_new;
+        lnl = lnl_new;
+        d1 = d1_new;
+        d2 = d2_new;
+        if(step <= tolerance * t) break;
+    }
+
+    // the likelihood is computed on the tree to keep the partial likelihoods up to date, falling back to the current length if it is not better
+    rtree.current_it->length = t;
+    rtree.current_it_back->length = t;
+    rtree.edges[eid].length = t;
+    double lnl_opt = get_likelihood_revised(rtree, vobs, lnl_type);
+    if(debug){
+        cout << "\tNewton-Raphson on edge " << eid + 1 << " after " << niter << " iterations: " << current_len << " -> " << t << ", logl " << lnl0 << " -> " << lnl_opt << " (predicted " << lnl << ")" << endl;
+    }
+    if(lnl_opt < lnl0){
+        rtree.current_it->length = current_len;
+        rtree.current_it_back->length = current_len;
+        rtree.edges[eid].length = current_len;
+        return current_len;
+    }
+
+    *fx = -lnl_opt;
+    return t;
+}
+
+
 void optimize_one_branch(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, double tolerance, int maxj, Node* node1, Node* node2){
     int debug = 0;
     if(debug){
@@ -662,16 +737,20 @@ void optimize_one_branch(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, O
     double negative_lh = 0.0;
     double ferror, optx;
 
-    // Brent method
-    optx = minimizeOneDimen(rtree, vobs, obs_decomp, comps, lnl_type, -1, BLEN_MIN, current_len, BLEN_MAX, tolerance, &negative_lh, &ferror);
+    if(lnl_type.model == DECOMP || lnl_type.model == MK || lnl_type.cons){
+        // Brent method
+        optx = minimizeOneDimen(rtree, vobs, obs_decomp, comps, lnl_type, -1, BLEN_MIN, current_len, BLEN_MAX, tolerance, &negative_lh, &ferror);
+    }else{
+        optx = optimize_one_branch_newton(rtree, vobs, lnl_type, tolerance, &negative_lh);
+    }
 
     rtree.current_it->length = optx;
     rtree.current_it_back->length = optx;
     rtree.edges[eid].length = optx;
 
     if(debug){
-        cout << "\tUsing Brent method to optimize the likelihood of one branch length of edge " << eid + 1 << endl;
-        cout << "\tmax Brent logl: " << -negative_lh << " optimized branch length " << optx << endl;
+        cout << "\tOptimizing the likelihood of one branch length of edge " << eid + 1 << endl;
+        cout << "\tmax logl: " << -negative_lh << " optimized branch length " << optx << endl;
     }
 
     if(maxj){
@@ -1044,16 +1123,57 @@ double targetFunk(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECO
 }
 
 
+/**
+	the analytic derivative function, only for model BOUNDT and BOUNDA when branch lengths are estimated directly
+	@param x the input vector x
+	@param dfx the derivative at x
+	@return the function value at x
+*/
+double derivativeFunk_analytic(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, int ndim, double x[], double dfx[]){
+    update_variables_transformed(rtree, x, lnl_type, opt_type);
+
+    vector<double> grad;
+    double fx = -1.0 * get_likelihood_revised_grad(rtree, vobs, lnl_type, grad, opt_type.maxj);
+
+    // the order of variables follows update_variables_transformed
+    int nedge = rtree.edges.size();
+    int npar_ne = 0;
+    if(opt_type.opt_one_branch){
+        npar_ne = 1;
+        dfx[1] = -grad[rtree.current_eid];
+    }else{
+        npar_ne = 2 * rtree.nleaf - 3;
+        for(int i = 0; i < npar_ne; i++){
+            dfx[i + 1] = -grad[i];
+        }
+    }
+
+    if(opt_type.maxj){
+        for(int i = 0; i < ndim - npar_ne; i++){
+            dfx[npar_ne + i + 1] = -grad[nedge + i];
+        }
+    }
+
+    return fx;
+}
+
+
 /**
 	the approximated derivative function
 	@param x the input vector x
 	@param dfx the derivative at x
 	@return the function value at x
 */
-double derivativeFunk(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, int ndim, double x[], double dfx[]){
+double derivativeFunk(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, GRAD_WORKSPACE& grad_ws, int ndim, double x[], double dfx[]){
   int debug = 0;
 
+  // the gradient is obtained in one pass over the tree when branch lengths are not transformed into ratios
+  if(!lnl_type.cons && (lnl_type.model == BOUNDT || lnl_type.model == BOUNDA)){
+      return derivativeFunk_analytic(rtree, vobs, lnl_type, opt_type, ndim, x, dfx);
+  }
+
 	double *h = new double[ndim + 1];
+  double *x_h = new double[ndim + 1];   // perturbed value of each variable
   double temp;
   int dim;
 
@@ -1063,13 +1183,46 @@ double derivativeFunk(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_
 		temp = x[dim];
 		h[dim] = ERROR_X * fabs(temp);
 		if(h[dim] == 0.0) h[dim] = ERROR_X;
-		x[dim] = temp + h[dim];
-		h[dim] = x[dim] - temp;
-
-    dfx[dim] = (targetFunk(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, x));
-		x[dim] = temp;
+		x_h[dim] = temp + h[dim];
+		h[dim] = x_h[dim] - temp;
 	}
 
+  // Each perturbation starts from the tree at x, so that they can be computed in any order with the same results
+  // The other threads use their copies of lnl_type in grad_ws.lnl_pool, with their own partial likelihoods
+  // The perturbations are split over at most one thread per variable, and are computed in turn inside a parallel region
+  #ifdef _OPENMP
+  int nthread = 1;
+  if(!omp_in_parallel()){
+    nthread = min(ndim, omp_get_max_threads());
+  }
+  if((int)grad_ws.lnl_pool.size() < nthread - 1){
+    // new copies start with the site patterns and partial likelihoods of lnl_type
+    grad_ws.lnl_pool.resize(nthread - 1, lnl_type);
+  }
+  #pragma omp parallel num_threads(nthread) if(nthread > 1)
+  #endif
+  {
+  evo_tree rtree_dim(rtree);
+  LNL_TYPE* lnl_dim = &lnl_type;
+  #ifdef _OPENMP
+  int tid = omp_get_thread_num();
+  if(tid > 0){
+    lnl_dim = &grad_ws.lnl_pool[tid - 1];
+    copy_lnl_type(lnl_type, *lnl_dim);
+  }
+  #endif
+  vector<double> x_dim(x + 1, x + ndim + 1);
+  #ifdef _OPENMP
+  #pragma omp for schedule(dynamic)
+  #endif
+  for(int i = 1; i <= ndim; i++){
+    rtree_dim = rtree;
+    x_dim[i - 1] = x_h[i];
+    dfx[i] = targetFunk(rtree_dim, vobs, obs_decomp, comps, *lnl_dim, opt_type, x_dim.data() - 1);
+    x_dim[i - 1] = x[i];
+  }
+  }
+
 	for(dim = 1; dim <= ndim; dim++ ){
         dfx[dim] = (dfx[dim] - fx) / h[dim];
         if(debug){
@@ -1078,6 +1231,7 @@ double derivativeFunk(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_
     }
 
   delete [] h;
+  delete [] x_h;
 
 	return fx;
 }
@@ -1087,8 +1241,8 @@ double optimFunc(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOM
     return targetFunk(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, vars-1);
 }
 
-double optimGradient(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, int nvar, double *x, double *dfx){
-    return derivativeFunk(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, nvar, x - 1, dfx - 1);
+double optimGradient(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, GRAD_WORKSPACE& grad_ws, int nvar, double *x, double *dfx){
+    return derivativeFunk(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, grad_ws, nvar, x - 1, dfx - 1);
 }
 
 
@@ -1096,10 +1250,13 @@ void lbfgsb(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& ob
 		double *Fmin, int *fail,
 		double factr, double pgtol,
 		int *fncount, int *grcount, int maxit, char *msg,
-		int trace, int nREPORT){
+		int trace, int nREPORT, BFGS_SESSION* session){
 	char task[60];
 	double f, *g, dsave[29], *wa;
 	int tr = -1, iter = 0, *iwa, isave[44], lsave[4];
+	GRAD_WORKSPACE grad_ws;   // kept for all the gradients of this optimization
+	int try_seed = session != NULL && !session->s.empty();   // put the correction pairs of the session into the memory on the first FG_START
+	int nseed = 0;   // number of correction pairs taken from the session
 
 	/* shut up gcc -Wall in 4.6.x */
 
@@ -1140,8 +1297,19 @@ void lbfgsb(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& ob
 		/* Main workhorse setulb() from ../appl/lbfgsb.c : */
 		setulb(n, m, x, l, u, nbd, &f, g, factr, &pgtol, wa, iwa, task, tr, lsave, isave, dsave);
 		/*    Rprintf("in lbfgsb - %s\n", task);*/
+		if(try_seed && strncmp(task, "FG_START", 8) == 0){
+			try_seed = 0;
+			// start with the curvature of the previous optimization
+			int npair = session->s.size();
+			vector<double> s_seed(n * npair), y_seed(n * npair);
+			for(int k = 0; k < npair; k++){
+				copy(session->s[k].begin(), session->s[k].end(), s_seed.begin() + k * n);
+				copy(session->y[k].begin(), session->y[k].end(), y_seed.begin() + k * n);
+			}
+			nseed = setulb_seed(n, m, &s_seed[0], &y_seed[0], npair, wa, iwa, lsave, isave, dsave);
+		}
 		if(strncmp(task, "FG", 2) == 0){
-            f = optimGradient(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, n, x, g);
+            f = optimGradient(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, grad_ws, n, x, g);
 			if(!isfinite(f)){
 				cerr << "L-BFGS-B needs finite values of 'fn'" << endl;
 				exit(1);
@@ -1159,6 +1327,12 @@ void lbfgsb(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& ob
 			*fail = 51;
 			break;
 		} else if(strncmp(task, "CONV", 4) == 0){
+			if(nseed > 0 && iter <= 1){
+				// stopped on the first step from the seeded curvature (e.g. when it leaves the valid trees), so restart from x without it
+				nseed = 0;
+				strcpy(task, "START");
+				continue;
+			}
 			break;
 		} else if(strncmp(task, "ERROR", 5) == 0){
 			*fail = 52;
@@ -1179,6 +1353,17 @@ void lbfgsb(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& ob
 	}
 	strcpy(msg, task);
 
+	if(session != NULL){
+		vector<double> s_out(n * m), y_out(n * m);
+		int npair = setulb_pairs(n, m, wa, isave, &s_out[0], &y_out[0]);
+		session->s.assign(npair, DoubleVector());
+		session->y.assign(npair, DoubleVector());
+		for(int k = 0; k < npair; k++){
+			session->s[k].assign(s_out.begin() + k * n, s_out.begin() + (k + 1) * n);
+			session->y[k].assign(y_out.begin() + k * n, y_out.begin() + (k + 1) * n);
+		}
+	}
+
 	free(g);
 	free(wa);
 	free(iwa);
@@ -1196,7 +1381,7 @@ void lbfgsb(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& ob
  @return minimized function value
  After the function is invoked, the values of x will be updated
 */
-double L_BFGS_B(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, int n, double* x, double* l, double* u){
+double L_BFGS_B(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, int n, double* x, double* l, double* u, BFGS_SESSION* session){
   int debug = 0;
 
   int i;
@@ -1219,6 +1404,10 @@ double L_BFGS_B(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP
 
   double pgtol = opt_type.tolerance;
   double maxit = opt_type.miter;
+  if(opt_type.screen){
+      factr *= SCREEN_TOL_FACTOR;
+      pgtol *= SCREEN_TOL_FACTOR;
+  }
 
   //	double pgtol = 0;   // helps control the convergence of the "L-BFGS-B" method.
   //    pgtol = 0.0;
@@ -1251,7 +1440,7 @@ double L_BFGS_B(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP
   // }
   // cout << "\n";
 
-  lbfgsb(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, n, m, x, l, u, nbd, &Fmin, &fail, factr, pgtol, &fncount, &grcount, maxit, msg, trace, nREPORT);
+  lbfgsb(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, n, m, x, l, u, nbd, &Fmin, &fail, factr, pgtol, &fncount, &grcount, maxit, msg, trace, nREPORT, session);
   //#endif
 
   if(fail == 51 || fail == 52){
@@ -1264,7 +1453,7 @@ double L_BFGS_B(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP
 }
 
 
-void max_likelihood_BFGS(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, double &min_nlnl){
+void max_likelihood_BFGS(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, double &min_nlnl, BFGS_SESSION* session){
     int debug = 0;
 
     int model = lnl_type.model;
@@ -1402,8 +1591,18 @@ void max_likelihood_BFGS(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, O
         }
     }
 
+    if(session != NULL){
+        vector<vector<int>> keys;
+        get_BFGS_keys(rtree, lnl_type, opt_type, npar_ne, ndim, keys);
+        remap_BFGS_pairs(*session, keys);
+    }
+
     // variables contains the parameters to estimate(branch length, mutation rate)
-    min_nlnl = L_BFGS_B(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, ndim, variables + 1, lower_bound + 1, upper_bound + 1);
+    min_nlnl = L_BFGS_B(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, ndim, variables + 1, lower_bound + 1, upper_bound + 1, session);
+
+    if(session != NULL){
+        save_BFGS_session(rtree, *session);
+    }
 
     if(debug){
         cout << "negative log likelihood of current ML tree: " << min_nlnl << endl;
@@ -1416,6 +1615,135 @@ void max_likelihood_BFGS(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, O
 
 
 
+void get_node_clades(evo_tree& rtree, vector<vector<int>>& clades){
+    clades.assign(rtree.nodes.size(), vector<int>());
+    for(int i = 0; i < rtree.nleaf; i++){
+        clades[i].push_back(i);
+    }
+
+    vector<int> inodes;
+    Node* root = &(rtree.nodes[rtree.root_node_id]);
+    rtree.get_inodes_postorder(root, inodes);
+    for(auto nid : inodes){
+        for(auto child : rtree.nodes[nid].daughters){
+            clades[nid].insert(clades[nid].end(), clades[child].begin(), clades[child].end());
+        }
+        sort(clades[nid].begin(), clades[nid].end());
+    }
+}
+
+
+void get_BFGS_keys(evo_tree& rtree, const LNL_TYPE& lnl_type, const OPT_TYPE& opt_type, int npar_ne, int ndim, vector<vector<int>>& keys){
+    vector<vector<int>> clades;
+    get_node_clades(rtree, clades);
+
+    keys.clear();
+    // the nodes (or edges) in the order of the variables set in max_likelihood_BFGS
+    if(lnl_type.cons){
+        keys.push_back(clades[rtree.root_node_id]);
+        if(opt_type.opt_one_branch){
+            keys.push_back(clades[rtree.edges[rtree.current_eid].end]);
+        }else{
+            for(int i = 1; i < npar_ne; ++i){
+                keys.push_back(clades[rtree.root_node_id + i]);
+            }
+        }
+    }else{
+        if(opt_type.opt_one_branch){
+            keys.push_back(clades[rtree.edges[rtree.current_eid].end]);
+        }else{
+            for(int i = 0; i < npar_ne; ++i){
+                keys.push_back(clades[rtree.edges[i].end]);
+            }
+        }
+    }
+
+    for(int k = 0; keys.size() < ndim; k++){
+        keys.push_back(vector<int>(1, -k - 1));
+    }
+}
+
+
+void remap_BFGS_pairs(BFGS_SESSION& session, const vector<vector<int>>& keys){
+    map<vector<int>, int> old_pos;
+    for(int i = 0; i < session.keys.size(); i++){
+        old_pos[session.keys[i]] = i;
+    }
+
+    vector<int> pos(keys.size(), -1);
+    for(int i = 0; i < keys.size(); i++){
+        auto it = old_pos.find(keys[i]);
+        if(it != old_pos.end()) pos[i] = it->second;
+    }
+
+    for(int k = 0; k < session.s.size(); k++){
+        DoubleVector s(keys.size(), 0.0);
+        DoubleVector y(keys.size(), 0.0);
+        for(int i = 0; i < keys.size(); i++){
+            if(pos[i] < 0) continue;
+            s[i] = session.s[k][pos[i]];
+            y[i] = session.y[k][pos[i]];
+        }
+        session.s[k] = s;
+        session.y[k] = y;
+    }
+    session.keys = keys;
+}
+
+
+void save_BFGS_session(evo_tree& rtree, BFGS_SESSION& session){
+    vector<vector<int>> clades;
+    get_node_clades(rtree, clades);
+
+    session.blens.clear();
+    for(int i = 0; i < rtree.edges.size(); i++){
+        session.blens[clades[rtree.edges[i].end]] = rtree.edges[i].length;
+    }
+
+    session.rates.clear();
+    save_mutation_rates(rtree, session.rates);
+}
+
+
+int seed_from_BFGS_session(evo_tree& rtree, const LNL_TYPE& lnl_type, const OPT_TYPE& opt_type, const BFGS_SESSION& session){
+    if(session.rates.empty()) return 0;   // nothing optimized yet
+
+    if(opt_type.maxj){
+        restore_mutation_rates(rtree, session.rates);
+    }
+
+    if(lnl_type.cons) return 0;
+
+    vector<vector<int>> clades;
+    get_node_clades(rtree, clades);
+
+    int nseed = 0;
+    // only the edges optimized by max_likelihood_BFGS
+    for(int i = 0; i < 2 * rtree.nleaf - 3; i++){
+        auto it = session.blens.find(clades[rtree.edges[i].end]);
+        if(it != session.blens.end()){
+            rtree.edges[i].length = it->second;
+            nseed++;
+        }
+    }
+
+    return nseed;
+}
+
+
+void max_likelihood_BFGS_warm(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, BFGS_SESSION& session, double &min_nlnl){
+    int debug = 0;
+
+    int nseed = seed_from_BFGS_session(rtree, lnl_type, opt_type, session);
+    if(debug){
+        cout << nseed << " branch lengths and " << session.s.size() << " correction pairs taken from the session" << endl;
+    }
+
+    max_likelihood_BFGS(rtree, vobs, obs_decomp, comps, lnl_type, opt_type, min_nlnl, &session);
+}
+
+
+
 // Optimizing the branch length of(node1, node2) with BFGS to incorporate constraints imposed by patient age and tip timings.
 // Optimize mutation rates if necessary
 void optimize_one_branch_BFGS(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, Node* node1, Node* node2){
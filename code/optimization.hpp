@@ -23,6 +23,8 @@ const double MAX_MRATE = 1;
 // The minimum age ratio allowed
 const double MIN_RATIO = 1e-2;
 const double MAX_RATIO = 0.99;
+// The factor by which the gradient and function tolerances of L-BFGS-B are loosened when screening candidate trees
+const double SCREEN_TOL_FACTOR = 100;
 
 
 // bundle of variables used in optimization (values from input)
@@ -34,9 +36,25 @@ struct OPT_TYPE{
 
   int opt_one_branch;
 
+  int screen;   // use tolerances loosened by SCREEN_TOL_FACTOR in L-BFGS-B
+
   // vector<double> tobs;  // sample times, used to get constaints in optimization
 };
 
+// buffers of the finite-difference gradient kept between calls of derivativeFunk, owned by the optimizer calling it (lbfgsb)
+struct GRAD_WORKSPACE{
+  vector<LNL_TYPE> lnl_pool;  // copies of lnl_type for the threads other than the first, refreshed by copy_lnl_type in each call
+};
+
+// Parameters and L-BFGS-B memory of an optimized tree, used to warm-start the optimization of the trees derived from it by topology changes
+struct BFGS_SESSION{
+  map<vector<int>, double> blens;   // branch lengths keyed by the samples below each edge, so that shared edges are matched across topologies
+  DoubleVector rates;   // mutation rates, in the order of save_mutation_rates
+  vector<vector<int>> keys;   // variables of the last optimization (see get_BFGS_keys)
+  vector<DoubleVector> s;   // correction pairs of L-BFGS-B over keys, oldest first: steps
+  vector<DoubleVector> y;   // and changes of the gradient
+};
+
 struct GSL_PARAM{
   evo_tree rtree;
   map<int, vector<vector<int>>> vobs;
@@ -104,7 +122,17 @@ double minimizeOneDimen(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OB
 double optimize_mutation_rates(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type);
 
 
-// Optimizing the branch length of (node1, node2) with Brent method
+// Maximum number of Newton-Raphson steps for one branch length, and of halvings of one step
+const int MAX_NEWTON_ITER = 20;
+
+// Optimize the length of branch rtree.current_eid by Newton-Raphson with the first and second derivatives of the likelihood, for model BOUNDT and BOUNDA without time constraints
+// The derivatives are obtained from the partial likelihoods on both sides of the branch (get_likelihood_revised_edge), so each step does not traverse the tree
+// Each step is kept in a bracket of the maximum and halved if the likelihood decreases. The current length is kept if the likelihood of the tree is not improved
+// fx: negative log likelihood at the returned length
+double optimize_one_branch_newton(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type, double tolerance, double* fx);
+
+
+// Optimizing the branch length of (node1, node2) with Newton-Raphson, or with Brent method for model MK and DECOMP or with time constraints
 // Optimize mutation rates if necessary
 void optimize_one_branch(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, double tolerance, int maxj, Node* node1, Node* node2);
 
@@ -161,24 +189,33 @@ void update_variables_transformed(evo_tree& rtree, double *x, LNL_TYPE& lnl_type
 double targetFunk(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, double x[]);
 
 
+/**
+	the analytic derivative function, only for model BOUNDT and BOUNDA when branch lengths are estimated directly
+	@param x the input vector x
+	@param dfx the derivative at x
+	@return the function value at x
+*/
+double derivativeFunk_analytic(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, int ndim, double x[], double dfx[]);
+
+
 /**
 	the approximated derivative function
 	@param x the input vector x
 	@param dfx the derivative at x
 	@return the function value at x
 */
-double derivativeFunk(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, int ndim, double x[], double dfx[]);
+double derivativeFunk(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, GRAD_WORKSPACE& grad_ws, int ndim, double x[], double dfx[]);
 
 double optimFunc(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, int nvar, double *vars);
 
-double optimGradient(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, int nvar, double *x, double *dfx);
+double optimGradient(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, GRAD_WORKSPACE& grad_ws, int nvar, double *x, double *dfx);
 
 
 void lbfgsb(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, int n, int m, double *x, double *l, double *u, int *nbd,
 		double *Fmin, int *fail,
 		double factr, double pgtol,
 		int *fncount, int *grcount, int maxit, char *msg,
-		int trace, int nREPORT);
+		int trace, int nREPORT, BFGS_SESSION* session = NULL);
 
 
 /**
@@ -192,11 +229,33 @@ void lbfgsb(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& ob
  @return minimized function value
  After the function is invoked, the values of x will be updated
 */
-double L_BFGS_B(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, int n, double* x, double* l, double* u);
+double L_BFGS_B(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, int n, double* x, double* l, double* u, BFGS_SESSION* session = NULL);
 
 // Using BFGS method to get the maximum likelihood with lower and upper bounds (minimalize negative likelihood function)
 // Note: the topology of rtree is fixed, yet its branch lengths may be updated in the optimization process
-void max_likelihood_BFGS(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, double &min_nlnl);
+// With a session, L-BFGS-B starts from its correction pairs on the variables shared with rtree, and the session is updated with the result
+void max_likelihood_BFGS(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, double &min_nlnl, BFGS_SESSION* session = NULL);
+
+
+// Get the samples below each node (indexed by node ID)
+void get_node_clades(evo_tree& rtree, vector<vector<int>>& clades);
+
+// Identify the variables of max_likelihood_BFGS across topologies: a branch length (or a node age ratio under time constraints) by the samples below it, the k-th mutation rate by {-k-1}
+void get_BFGS_keys(evo_tree& rtree, const LNL_TYPE& lnl_type, const OPT_TYPE& opt_type, int npar_ne, int ndim, vector<vector<int>>& keys);
+
+// Rewrite the correction pairs of the session over keys, with zeros for the variables it does not have
+void remap_BFGS_pairs(BFGS_SESSION& session, const vector<vector<int>>& keys);
+
+// Record the optimized branch lengths and mutation rates of rtree in the session
+void save_BFGS_session(evo_tree& rtree, BFGS_SESSION& session);
+
+// Set the branch lengths of the edges rtree shares with the tree in the session, and the mutation rates if they are estimated
+// Branch lengths are not copied under time constraints, as they are determined by node ages
+// return the number of edges seeded
+int seed_from_BFGS_session(evo_tree& rtree, const LNL_TYPE& lnl_type, const OPT_TYPE& opt_type, const BFGS_SESSION& session);
+
+// Warm-started max_likelihood_BFGS: start from the parameters and correction pairs in the session, which is then updated with the result
+void max_likelihood_BFGS_warm(evo_tree& rtree, map<int, vector<vector<int>>>& vobs, OBS_DECOMP& obs_decomp, const set<vector<int>>& comps, LNL_TYPE& lnl_type, OPT_TYPE& opt_type, BFGS_SESSION& session, double &min_nlnl);
 
 
 // Optimizing the branch length of (node1, node2) with BFGS to incorporate constraints imposed by patient age and tip timings.
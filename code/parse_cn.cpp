@@ -669,3 +669,32 @@ void get_bootstrap_vector_by_chr(map<int, vector<vector<int>>>& data, map<int, v
       vobs[nchr] = obs_chr;
     }
 }
+
+
+int get_site_patterns_by_chr(map<int, vector<vector<int>>>& vobs, SITE_PATTERN& site_pattern){
+    site_pattern.obs.clear();
+    site_pattern.weight.clear();
+
+    int num_pattern = 0;
+    for(auto& it : vobs){
+        int nchr = it.first;
+        vector<vector<int>>& obs_chr = site_pattern.obs[nchr];
+        vector<int>& weight_chr = site_pattern.weight[nchr];
+        // index of each pattern in obs_chr
+        map<vector<int>, int> pattern_index;
+        for(int nc = 0; nc < it.second.size(); ++nc){
+            const vector<int>& obs = it.second[nc];
+            auto pi = pattern_index.find(obs);
+            if(pi == pattern_index.end()){
+                pattern_index[obs] = obs_chr.size();
+                obs_chr.push_back(obs);
+                weight_chr.push_back(1);
+            }else{
+                weight_chr[pi->second]++;
+            }
+        }
+        num_pattern += obs_chr.size();
+    }
+
+    return num_pattern;
+}
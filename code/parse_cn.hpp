@@ -8,6 +8,13 @@
 
 // collection of functions for reading/writing
 
+
+// Unique site patterns on each chromosome, with the number of sites having each pattern
+struct SITE_PATTERN{
+  map<int, vector<vector<int>>> obs;
+  map<int, vector<int>> weight;
+};
+
 // const int num_total_bins = 4401;
 
 
@@ -76,6 +83,10 @@ map<int, vector<vector<int>>> get_obs_vector_by_chr(map<int, vector<vector<int>>
 
 void get_bootstrap_vector_by_chr(map<int, vector<vector<int>>>& data, map<int, vector<vector<int>>>& vobs, gsl_rng* r);
 
+// Compress the input matrix of copy numbers into unique site patterns on each chromosome (in the order of first occurrence)
+// Returns the number of unique patterns
+int get_site_patterns_by_chr(map<int, vector<vector<int>>>& vobs, SITE_PATTERN& site_pattern);
+
 
 /******************* read input file ***********************/
 // Read the samping time and patient age of each sample
@@ -1,20 +1,20 @@
 #include "state.hpp"
 
 
-void print_tree_state(const evo_tree& rtree, const vector<vector<int>>& S_sk_k, int nstate){
+void print_tree_state(const evo_tree& rtree, const int* S_sk_k, int nstate){
     cout << "\nStates so far:\n";
 
     int ntotn = 2 * rtree.nleaf - 1;
     for(int i = 0; i < ntotn; ++i){
         for(int j = 0; j < nstate; ++j){
-          cout << "\t" << S_sk_k[i][j];
+          cout << "\t" << S_sk_k[i * nstate + j];
         }
         cout << endl;
     }
 }
 
 
-map<int, vector<int>> extract_tree_ancestral_state(const evo_tree& rtree, const set<vector<int>>& comps, const vector<vector<double>>& L_sk_k, const vector<vector<int>>& S_sk_k, int model, int cn_max, int is_total, int m_max, map<int, int> &asr_states){
+map<int, vector<int>> extract_tree_ancestral_state(const evo_tree& rtree, const set<vector<int>>& comps, const double* L_sk_k, const int* S_sk_k, int model, int cn_max, int is_total, int m_max, int nstate, map<int, int> &asr_states){
     int debug = 0;
     map<int, vector<int>> asr_cns;     // copy numbers for each internal node at one site, stored in the order of decreasing IDs
     int Ns = rtree.nleaf - 1;
@@ -23,8 +23,8 @@ map<int, vector<int>> extract_tree_ancestral_state(const evo_tree& rtree, const
     // int cn_max = lnl_type.cn_max;
 
     if(debug){
-        for(int j = 0; j < L_sk_k[Ns + 1].size(); ++j){
-          cout << "\t" << L_sk_k[Ns + 1][j];
+        for(int j = 0; j < nstate; ++j){
+          cout << "\t" << L_sk_k[(Ns + 1) * nstate + j];
         }
         cout << endl;
     }
@@ -62,7 +62,7 @@ map<int, vector<int>> extract_tree_ancestral_state(const evo_tree& rtree, const
         assert(asr_states.find(parent) != asr_states.end());
         parent_state = asr_states[parent];
 
-        int state = S_sk_k[nid][parent_state];
+        int state = S_sk_k[nid * nstate + parent_state];
         asr_states[nid] = state;
         if(debug){
             cout << "\t\tnode " << nid + 1 << " with state " << state  << " and parent " << parent + 1 << " whose state is " << parent_state << endl;
@@ -105,7 +105,7 @@ map<int, vector<int>> extract_tree_ancestral_state(const evo_tree& rtree, const
 
 // Create likelihood vectors and state vectors at the tip node for reconstructing joint ancestral state
 // L_sk_k (S_sk_k) has one row for each tree node and one column for each possible state
-void initialize_asr_table(const vector<int>& obs, const evo_tree& rtree, const vector<double>& blens, const vector<double*>& pmat_per_blen, vector<vector<double>>& L_sk_k, vector<vector<int>>& S_sk_k, int model, int nstate, int is_total){
+void initialize_asr_table(const vector<int>& obs, const evo_tree& rtree, const vector<int>& blen_per_edge, const vector<double*>& pmat_per_blen, double* L_sk_k, int* S_sk_k, int model, int nstate, int is_total){
     int debug = 0;
     if(debug) cout << "Initializing tables for reconstructing joint ancestral state" << endl;
 
@@ -118,10 +118,7 @@ void initialize_asr_table(const vector<int>& obs, const evo_tree& rtree, const v
         // cout << "parent " << parent + 1 << endl;
         // cout << "blen " << blen << endl;
 
-        auto pi = equal_range(blens.begin(), blens.end(), blen);
-        assert(pi.first == pi.second);
-        int idx_blen = distance(pi.first, blens.begin());
-        double* pblen = pmat_per_blen[idx_blen];
+        const double* pblen = pmat_per_blen[blen_per_edge[rtree.nodes[i].e_in]];
 
         // Find the state(s) of current node
         vector<int> tip_states;
@@ -135,6 +132,8 @@ void initialize_asr_table(const vector<int>& obs, const evo_tree& rtree, const v
           }else{ // With allele-specific copy number, only the specific site needs to be filled
               tip_states.push_back(obs[i]);
           }
+        }else{
+          tip_states.push_back(obs[i]);
         }
         if(debug) cout << "There are " << tip_states.size() << " states for copy number " << obs[i] << endl;
         for(int j = 0; j < nstate; ++j){  // For each possible parent state, find the most likely tip states
@@ -142,13 +141,7 @@ void initialize_asr_table(const vector<int>& obs, const evo_tree& rtree, const v
             for(int m = 0; m < tip_states.size(); ++m){
                 int k = tip_states[m];
                 if(debug) cout << "parent state " << j << ", child state " << k << endl;
-                double li = 0;
-                if (model == MK){
-                    li = get_transition_prob(rtree.mu, blen, j, k);
-                }
-                else{
-                    li =  pblen[j  + k * nstate];  // assume parent has state j
-                }
+                double li =  pblen[j  + k * nstate];  // assume parent has state j
                 if(li > 0) li = log(li);
                 else li = SMALL_LNL;
                 vec_li[k] = li;
@@ -158,8 +151,8 @@ void initialize_asr_table(const vector<int>& obs, const evo_tree& rtree, const v
             double max_li = *max_element(vec_li.begin(), vec_li.end());
             assert(max_li == vec_li[max_i]);
             // cout << "for node: i " << i + 1 << ", parent state " << j << ", max state is " << max_i << " with probability " << exp(max_li) << endl;
-            S_sk_k[i][j] = max_i;
-            L_sk_k[i][j] = max_li;
+            S_sk_k[i * nstate + j] = max_i;
+            L_sk_k[i * nstate + j] = max_li;
         }
     }
 
@@ -172,14 +165,14 @@ void initialize_asr_table(const vector<int>& obs, const evo_tree& rtree, const v
       cout << "\nLikelihood for tips:\n";
       for(int i = 0; i < rtree.nleaf; ++i){
           for(int j = 0; j < nstate; ++j){
-            cout << "\t" << L_sk_k[i][j];
+            cout << "\t" << L_sk_k[i * nstate + j];
           }
           cout << endl;
       }
       cout << "\nState vector for tips:\n";
       for(int i = 0; i < rtree.nleaf; ++i){
           for(int j = 0; j < nstate; ++j){
-            cout << "\t" << S_sk_k[i][j];
+            cout << "\t" << S_sk_k[i * nstate + j];
           }
           cout << endl;
       }
@@ -190,7 +183,7 @@ void initialize_asr_table(const vector<int>& obs, const evo_tree& rtree, const v
 
 // Create likelihood vectors and state vectors at the tip node for reconstructing joint ancestral state, for independent chain model
 // L_sk_k (S_sk_k) has one row for each tree node and one column for each possible state
-void initialize_asr_table_decomp(const vector<int>& obs, const evo_tree& rtree, const set<vector<int>>& comps, MAX_DECOMP& max_decomp, PMAT_DECOMP& pmat_decomp, vector<vector<double>>& L_sk_k, vector<vector<int>>& S_sk_k, int nstate, int is_total){
+void initialize_asr_table_decomp(const vector<int>& obs, const evo_tree& rtree, const set<vector<int>>& comps, MAX_DECOMP& max_decomp, PMAT_DECOMP& pmat_decomp, double* L_sk_k, int* S_sk_k, int nstate, int is_total){
     int debug = 0;
     if(debug) cout << "Initializing tables for reconstructing joint ancestral state" << endl;
 
@@ -307,8 +300,8 @@ void initialize_asr_table_decomp(const vector<int>& obs, const evo_tree& rtree,
             double max_li = *max_element(vec_li.begin(), vec_li.end());
             assert(max_li == vec_li[max_i]);
             // cout << "for node: i " << i + 1 << ", parent state " << j << ", max state is " << max_i << " with probability " << exp(max_li) << endl;
-            S_sk_k[i][j] = max_i;
-            L_sk_k[i][j] = max_li;
+            S_sk_k[i * nstate + j] = max_i;
+            L_sk_k[i * nstate + j] = max_li;
         }
     }
 
@@ -321,14 +314,14 @@ void initialize_asr_table_decomp(const vector<int>& obs, const evo_tree& rtree,
       cout << "\nLikelihood for tips:\n";
       for(int i = 0; i < rtree.nleaf; ++i){
           for(int j = 0; j < nstate; ++j){
-            cout << "\t" << L_sk_k[i][j];
+            cout << "\t" << L_sk_k[i * nstate + j];
           }
           cout << endl;
       }
       cout << "\nState vector for tips:\n";
       for(int i = 0; i < rtree.nleaf; ++i){
           for(int j = 0; j < nstate; ++j){
-            cout << "\t" << S_sk_k[i][j];
+            cout << "\t" << S_sk_k[i * nstate + j];
           }
           cout << endl;
       }
@@ -338,30 +331,25 @@ void initialize_asr_table_decomp(const vector<int>& obs, const evo_tree& rtree,
 
 
 // Find the most likely state for a node under each possible state, assuming current node has state nsk and parent node (connected by branch of length blen) has state np
-double get_max_prob_children(const vector<vector<double>>& L_sk_k, vector<vector<int>>& S_sk_k, const evo_tree& rtree, double* pblen, int k, int nstate, int sp, int ni, int nj, int blen, int model){
+double get_max_prob_children(const double* L_sk_k, int* S_sk_k, const evo_tree& rtree, const double* pblen, int k, int nstate, int sp, int ni, int nj){
     int debug = 0;
 
     vector<double> vec_li;
     double li = 0;
     // loop over possible si for a fixed state of parent (sp)
     for(int si = 0; si < nstate; ++si){
-        if (model == MK){
-          li = get_transition_prob(rtree.mu, blen, sp, si);
-        }
-        else{
-          li = pblen[sp + si * nstate];
-        }
+        li = pblen[sp + si * nstate];
 
         if(debug){
             cout << "\tfor state " << si << endl;
-            cout << "\t\tseparate likelihood "  << li << "\t" << L_sk_k[ni][si] << "\t" << L_sk_k[nj][si] << endl;
+            cout << "\t\tseparate likelihood "  << li << "\t" << L_sk_k[ni * nstate + si] << "\t" << L_sk_k[nj * nstate + si] << endl;
         }
         if(li > 0){
             li = log(li);
         }
         else li = SMALL_LNL;
-        li += (L_sk_k[ni][si]);
-        li += (L_sk_k[nj][si]);
+        li += (L_sk_k[ni * nstate + si]);
+        li += (L_sk_k[nj * nstate + si]);
 
         if(debug) cout << "\t\tscoring: Li\t" << li << endl;
         if(std::isnan(li) || li < SMALL_LNL) li = SMALL_LNL;
@@ -371,7 +359,7 @@ double get_max_prob_children(const vector<vector<double>>& L_sk_k, vector<vector
     int max_i = distance(vec_li.begin(), max_element(vec_li.begin(), vec_li.end()));
     double max_li = *max_element(vec_li.begin(), vec_li.end());
     assert(max_li == vec_li[max_i]);
-    S_sk_k[k][sp] = max_i;
+    S_sk_k[k * nstate + sp] = max_i;
 
     if(debug){
         cout << "all likelihoods:";
@@ -388,7 +376,7 @@ double get_max_prob_children(const vector<vector<double>>& L_sk_k, vector<vector
 
 
 // Assume the likelihood table is for each combination of states
-double get_max_children_decomp2(const vector<vector<double>>& L_sk_k, vector<vector<int>>& S_sk_k, const evo_tree& rtree, const set<vector<int>>& comps, int k, int nstate, double* pbli_wgd, double* pbli_chr, double* pbli_seg, DIM_DECOMP& dim_decomp, int sp, int ni, int nj, int blen){
+double get_max_children_decomp2(const double* L_sk_k, int* S_sk_k, const evo_tree& rtree, const set<vector<int>>& comps, int k, int nstate, double* pbli_wgd, double* pbli_chr, double* pbli_seg, DIM_DECOMP& dim_decomp, int sp, int ni, int nj, int blen){
     int debug = 0;
     int s_wgd, s_chr, s_seg, s_chr2, s_seg2;
     int e_wgd, e_chr, e_seg, e_chr2, e_seg2;
@@ -455,8 +443,8 @@ double get_max_children_decomp2(const vector<vector<double>>& L_sk_k, vector<vec
             li = log(li);
         }
         else li = SMALL_LNL;
-        li += (L_sk_k[ni][si]);
-        li += (L_sk_k[nj][si]);
+        li += (L_sk_k[ni * nstate + si]);
+        li += (L_sk_k[nj * nstate + si]);
 
         if(debug) cout << "\t\tscoring: Li\t" << li << endl;
         if(std::isnan(li) || li < SMALL_LNL) li = SMALL_LNL;
@@ -468,7 +456,7 @@ double get_max_children_decomp2(const vector<vector<double>>& L_sk_k, vector<vec
     int max_i = distance(vec_li.begin(), max_element(vec_li.begin(), vec_li.end()));
     double max_li = *max_element(vec_li.begin(), vec_li.end());
     assert(max_li == vec_li[max_i]);
-    S_sk_k[k][sp] = max_i;
+    S_sk_k[k * nstate + sp] = max_i;
 
     if(debug){
         cout << "all likelihoods:";
@@ -484,7 +472,7 @@ double get_max_children_decomp2(const vector<vector<double>>& L_sk_k, vector<vec
 
 
 // Get the most likely state on one site of a chromosome (assuming higher level events on nodes)
-void get_ancestral_states_site(vector<vector<double>>& L_sk_k, vector<vector<int>>& S_sk_k, const evo_tree& rtree, const vector<int>& knodes, const vector<double>& blens, const vector<double*>& pmat_per_blen, int nstate, int model){
+void get_ancestral_states_site(double* L_sk_k, int* S_sk_k, const evo_tree& rtree, const vector<int>& knodes, const vector<int>& blen_per_edge, const vector<double*>& pmat_per_blen, int nstate, int model){
   int debug = 0;
   if(debug){
       cout << "Getting ancestral state for one site" << endl;
@@ -498,10 +486,7 @@ void get_ancestral_states_site(vector<vector<double>>& L_sk_k, vector<vector<int
         int ni = rtree.edges[rtree.nodes[k].e_ot[0]].end;
         int nj = rtree.edges[rtree.nodes[k].e_ot[1]].end;
 
-        auto pi = equal_range(blens.begin(), blens.end(), blen);
-        assert(pi.first == pi.second);
-        int idx_blen = distance(pi.first, blens.begin());
-        double* pblen = pmat_per_blen[idx_blen];
+        const double* pblen = pmat_per_blen[blen_per_edge[rtree.nodes[k].e_in]];
 
         if(debug) cout << "node:" << np + 1 << " -> " << rtree.nodes[k].id + 1 << " -> " << ni + 1 << " , "  <<  nj + 1 << " , " << blen << endl;
 
@@ -511,12 +496,12 @@ void get_ancestral_states_site(vector<vector<double>>& L_sk_k, vector<vector<int
             int sp = 2;
             if(model == BOUNDA) sp = 4;
             if(debug) cout << "likelihood for state " << sp << endl;
-            L_sk_k[k][sp] = get_max_prob_children(L_sk_k, S_sk_k, rtree, pblen, k, nstate, sp, ni, nj, blen, model);
+            L_sk_k[k * nstate + sp] = get_max_prob_children(L_sk_k, S_sk_k, rtree, pblen, k, nstate, sp, ni, nj);
         }
         else{
             for(int sp = 0; sp<nstate; ++sp){  // looping over all possible states of its parent
                 if(debug) cout << "likelihood for state " << sp << endl;
-                L_sk_k[k][sp] = get_max_prob_children(L_sk_k, S_sk_k, rtree, pblen, k, nstate, sp, ni, nj, blen, model);
+                L_sk_k[k * nstate + sp] = get_max_prob_children(L_sk_k, S_sk_k, rtree, pblen, k, nstate, sp, ni, nj);
             }
         }
   }
@@ -532,7 +517,7 @@ void get_ancestral_states_site(vector<vector<double>>& L_sk_k, vector<vector<int
 // Assuming each observed copy number is composed of three type of events.
 // Sum over all possible states for initial and final nodes
 // Allow at most one WGD event along a branch
-void get_ancestral_states_site_decomp(vector<vector<double>>& L_sk_k, vector<vector<int>>& S_sk_k, const evo_tree& rtree, const vector<int>& knodes, const set<vector<int>>& comps, PMAT_DECOMP& pmat_decomp, DIM_DECOMP& dim_decomp, int nstate){
+void get_ancestral_states_site_decomp(double* L_sk_k, int* S_sk_k, const evo_tree& rtree, const vector<int>& knodes, const set<vector<int>>& comps, PMAT_DECOMP& pmat_decomp, DIM_DECOMP& dim_decomp, int nstate){
   int debug = 0;
   if(debug){
       cout << "Getting ancestral state for one site under independent Markov chain model" << endl;
@@ -569,7 +554,7 @@ void get_ancestral_states_site_decomp(vector<vector<double>>& L_sk_k, vector<vec
             for(auto v : comps){
                 bool zeros = all_of(v.begin(), v.end(), [](int i) { return i == 0; });
                 if(zeros){
-                    L_sk_k[k][sp] = get_max_children_decomp2(L_sk_k, S_sk_k, rtree, comps, k, nstate, pbli_wgd, pbli_chr, pbli_seg, dim_decomp, sp, ni, nj, blen);
+                    L_sk_k[k * nstate + sp] = get_max_children_decomp2(L_sk_k, S_sk_k, rtree, comps, k, nstate, pbli_wgd, pbli_chr, pbli_seg, dim_decomp, sp, ni, nj, blen);
                     break;
                 }
                 sp++;
@@ -577,7 +562,7 @@ void get_ancestral_states_site_decomp(vector<vector<double>>& L_sk_k, vector<vec
         }
         else{
             for(int sp = 0; sp<nstate; ++sp){
-                L_sk_k[k][sp] = get_max_children_decomp2(L_sk_k, S_sk_k, rtree, comps, k, nstate, pbli_wgd, pbli_chr, pbli_seg,  dim_decomp, sp, ni, nj, blen);
+                L_sk_k[k * nstate + sp] = get_max_children_decomp2(L_sk_k, S_sk_k, rtree, comps, k, nstate, pbli_wgd, pbli_chr, pbli_seg,  dim_decomp, sp, ni, nj, blen);
             }
         }
   }
@@ -731,37 +716,48 @@ double reconstruct_marginal_ancestral_state_decomp(const evo_tree& rtree, map<in
     int nstate = comps.size();
     double logL = 0;    // for all chromosmes
 
-    PMAT_DECOMP pmat_decomp = {pmats_wgd, pmats_chr, pmats_seg};
+    PMAT_DECOMP pmat_decomp;
+    pmat_decomp.pmats_wgd = pmats_wgd;
+    pmat_decomp.pmats_chr = pmats_chr;
+    pmat_decomp.pmats_seg = pmats_seg;
+    set_pmat_decomp_per_edge(pmat_decomp, rtree, knodes);
+    COMP_DECOMP comp_decomp{};
+    build_comp_decomp(comps, dim_decomp, comp_decomp);
+    LNL_BUFFER lnl_buffer;
+    double* L_sk_k = lnl_buffer.reserve(ntotn, nstate);
+    vector<double> work(2 * comp_decomp.max_entry + 2 * nstate);
     for(int nchr = 1; nchr <= vobs.size(); nchr++){     // for each chromosome
       if(debug) cout << "Computing likelihood on Chr " << nchr << endl;
       double site_logL = 0;   // log likelihood for all sites on a chromosome
-      // Use a map to store computed log likelihood
-      map<vector<int>, vector<vector<double>>> sites_lnl_map;
+      // Use a map to store computed likelihood table and the number of rescalings
+      map<vector<int>, pair<vector<double>, int>> sites_lnl_map;
       // cout << " chromosome number change is " << 0 << endl;
       for(int nc = 0; nc < vobs[nchr].size(); nc++){    // for each segment on the chromosome
           // cout << "Number of sites for this chr " << vobs[nchr].size() << endl;
           // for each site of the chromosome (may be repeated)
           vector<int> obs = vobs[nchr][nc];
-          vector<vector<double>> L_sk_k;
+          int nscale = 0;
           if(use_repeat){
               if(sites_lnl_map.find(obs) == sites_lnl_map.end()){
-                  L_sk_k = initialize_lnl_table_decomp(obs, obs_decomp, nchr, rtree, comps, infer_wgd, infer_chr, cn_max, is_total);
-                  get_likelihood_site_decomp(L_sk_k, rtree, comps, knodes, pmat_decomp, dim_decomp, cn_max, is_total);
-                  sites_lnl_map[obs] = L_sk_k;
+                  initialize_lnl_table_decomp(L_sk_k, obs, obs_decomp, nchr, rtree, comps, infer_wgd, infer_chr, cn_max, is_total);
+                  nscale = get_likelihood_site_decomp(L_sk_k, rtree, comp_decomp, knodes, pmat_decomp, work.data());
+                  sites_lnl_map[obs] = make_pair(vector<double>(L_sk_k, L_sk_k + ntotn * nstate), nscale);
               }else{
                   if(debug) cout << "\tsites repeated" << endl;
-                  L_sk_k = sites_lnl_map[obs];
+                  copy(sites_lnl_map[obs].first.begin(), sites_lnl_map[obs].first.end(), L_sk_k);
+                  nscale = sites_lnl_map[obs].second;
               }
           }else{
-              L_sk_k = initialize_lnl_table_decomp(obs, obs_decomp, nchr, rtree, comps, infer_wgd, infer_chr, cn_max, is_total);
-              get_likelihood_site_decomp(L_sk_k, rtree, comps, knodes, pmat_decomp, dim_decomp, cn_max, is_total);
+              initialize_lnl_table_decomp(L_sk_k, obs, obs_decomp, nchr, rtree, comps, infer_wgd, infer_chr, cn_max, is_total);
+              nscale = get_likelihood_site_decomp(L_sk_k, rtree, comp_decomp, knodes, pmat_decomp, work.data());
           }
-          // site_logL += extract_tree_lnl(L_sk_k, Ns, model);
-          double lnl = extract_tree_lnl_decomp(L_sk_k, comps, Ns);
+          // site_logL += extract_tree_lnl(L_sk_k, Ns, model, nstate);
+          double lnl = extract_tree_lnl_decomp(L_sk_k, comp_decomp, Ns, nscale);
           site_logL += lnl;
 
           // Get the likelihood table of MRCA node (with largest ID) in the tree from likelihood table
-          int state = distance(L_sk_k[nid].begin(), max_element(L_sk_k[nid].begin(), L_sk_k[nid].end()));
+          const double* L_mrca = L_sk_k + nid * nstate;
+          int state = distance(L_mrca, max_element(L_mrca, L_mrca + nstate));
 
           set<vector<int>>::iterator iter = comps.begin();
           // It will move forward the passed iterator by passed value
@@ -773,8 +769,8 @@ double reconstruct_marginal_ancestral_state_decomp(const evo_tree& rtree, map<in
           cn_mrca.push_back(cn);
           // Print the state of MRCA at this site
           string line = to_string(nid + 1) + "\t" + to_string(nchr) + "_" + to_string(nc) + "\t" + to_string(cn);
-          for(int i = 0; i < L_sk_k[nid].size(); i++){
-              line += "\t" + to_string(L_sk_k[nid][i]);
+          for(int i = 0; i < nstate; i++){
+              line += "\t" + to_string(L_mrca[i]);
           }
           fout << line << endl;
 
@@ -819,7 +815,7 @@ double reconstruct_marginal_ancestral_state_decomp(const evo_tree& rtree, map<in
 
 
 
-void set_pmat(const evo_tree& rtree, int Ns, int nstate, int model, int cn_max, const vector<int>& knodes, vector<double>& blens, vector<double*>& pmat_per_blen, ofstream& fout){
+void set_pmat(const evo_tree& rtree, int Ns, int nstate, int model, int cn_max, const vector<int>& knodes, vector<double>& blens, vector<double*>& pmat_per_blen, vector<int>& blen_per_edge, ofstream& fout){
   int debug = 0;
 
   string header="node\tsite\tcn\tmax probability";
@@ -831,40 +827,28 @@ void set_pmat(const evo_tree& rtree, int Ns, int nstate, int model, int cn_max,
   double *qmat = new double[(nstate)*(nstate)];
   memset(qmat, 0, (nstate)*(nstate)*sizeof(double));
 
-  assert(model > 0);
   if(debug){
       cout << "Getting rate matrix" << endl;
   }
   if(model == BOUNDA){
       get_rate_matrix_allele_specific(qmat, rtree.dup_rate, rtree.del_rate, cn_max);
-  }else{
+  }else if(model == BOUNDT){
       get_rate_matrix_bounded(qmat, rtree.dup_rate, rtree.del_rate, cn_max);
   }
 
-  for(int kn = 0; kn < knodes.size(); ++kn){
-    int k = knodes[kn];
-    double bli = rtree.edges[rtree.nodes[k].e_ot[0]].length;
-    double blj = rtree.edges[rtree.nodes[k].e_ot[1]].length;
-
-    if(find(blens.begin(), blens.end(), bli) == blens.end()){
-      double *pmati = new double[(nstate)*(nstate)];
-      memset(pmati, 0, (nstate)*(nstate)*sizeof(double));
-      get_transition_matrix_bounded(qmat, pmati, bli, nstate);
-      pmat_per_blen.push_back(pmati);
-      blens.push_back(bli);
-    }
-    if(find(blens.begin(), blens.end(), bli) == blens.end()){
-      double *pmatj = new double[(nstate)*(nstate)];
-      memset(pmatj, 0, (nstate)*(nstate)*sizeof(double));
-      get_transition_matrix_bounded(qmat, pmatj, blj, nstate);
-      pmat_per_blen.push_back(pmatj);
-      blens.push_back(blj);
-    }
+  // one matrix for each distinct branch length, sorted by branch length
+  add_distinct_blens(rtree, knodes, blens);
+  for(auto bl : blens){
+      double *pmat = new double[(nstate)*(nstate)];
+      memset(pmat, 0, (nstate)*(nstate)*sizeof(double));
+      if(model == MK){
+          get_transition_matrix_mk(rtree.mu, pmat, bl, nstate);
+      }else{
+          get_transition_matrix_bounded(qmat, pmat, bl, nstate);
+      }
+      pmat_per_blen.push_back(pmat);
   }
-
-  auto p = sort_permutation(blens, [&](const double& a, const double& b){ return a < b; });
-  blens = apply_permutation(blens, p);
-  pmat_per_blen = apply_permutation(pmat_per_blen, p);
+  get_blen_per_edge(rtree, knodes, blens, blen_per_edge);
 
   if(debug){
       for(int i = 0; i < pmat_per_blen.size(); ++i){
@@ -903,39 +887,51 @@ double reconstruct_marginal_ancestral_state(const evo_tree& rtree, map<int, vect
     // map<double, double*> pmats;
     vector<double> blens;
     vector<double*> pmat_per_blen;
+    vector<int> blen_per_edge;
 
-    set_pmat(rtree, Ns, nstate, model, cn_max, knodes, blens, pmat_per_blen, fout);
+    set_pmat(rtree, Ns, nstate, model, cn_max, knodes, blens, pmat_per_blen, blen_per_edge, fout);
 
     vector<int> cn_mrca; // CNs for MRCA
     double logL = 0.0;    // for all chromosmes
+    LNL_BUFFER lnl_buffer;
+    double* L_sk_k = lnl_buffer.reserve(ntotn, nstate);
+    // only the variant without WGD or chromosome change
+    vector<int> variants{1};
+    vector<int> nscale_k(knodes.size(), 0);
+    vector<double> v_tip(4 * nstate, 0.0);
+    vector<int> tip_start, tip_states;
     for(int nchr = 1; nchr <= vobs.size(); nchr++){     // for each chromosome
       if(debug) cout << "\tComputing likelihood on Chr " << nchr << endl;
       double site_logL = 0;   // log likelihood for all sites on a chromosome
-      map<vector<int>, vector<vector<double>>> sites_lnl_map;
+      map<vector<int>, pair<vector<double>, int>> sites_lnl_map;
 
       for(int nc = 0; nc < vobs[nchr].size(); nc++){    // for each segment on the chromosome
           if(debug) cout << "Number of sites for this chr " << vobs[nchr].size() << endl;
           // for each site of the chromosome (may be repeated)
           vector<int> obs = vobs[nchr][nc];
-          vector<vector<double>> L_sk_k(2 * rtree.nleaf - 1, vector<double>(nstate, 0.0));
-          if(use_repeat){
-              if(sites_lnl_map.find(obs) == sites_lnl_map.end()){
-                  initialize_lnl_table(L_sk_k, obs, rtree, model, nstate, is_total);
-                  get_likelihood_site(L_sk_k, rtree, knodes, blens, pmat_per_blen, 0, 0, model, nstate);
-              }else{
-                  // cout << "sites repeated" << end1;
-                  L_sk_k = sites_lnl_map[obs];
-              }
+          int nscale = 0;
+          if(use_repeat && sites_lnl_map.find(obs) != sites_lnl_map.end()){
+              // cout << "sites repeated" << end1;
+              copy(sites_lnl_map[obs].first.begin(), sites_lnl_map[obs].first.end(), L_sk_k);
+              nscale = sites_lnl_map[obs].second;
           }else{
               initialize_lnl_table(L_sk_k, obs, rtree, model, nstate, is_total);
-              get_likelihood_site(L_sk_k, rtree, knodes, blens, pmat_per_blen, 0, 0, model, nstate);
+              tip_start.assign(1, 0);
+              tip_states.clear();
+              add_tip_states(L_sk_k, rtree.nleaf, nstate, tip_start, tip_states);
+              get_likelihood_site_fused(L_sk_k, rtree, knodes, blen_per_edge, pmat_per_blen, variants, tip_start.data(), tip_states.data(), model, nstate, nscale_k.data(), v_tip.data());
+              nscale = accumulate(nscale_k.begin(), nscale_k.end(), 0);
+              if(use_repeat){
+                  sites_lnl_map[obs] = make_pair(vector<double>(L_sk_k, L_sk_k + ntotn * nstate), nscale);
+              }
           }
-          double lnl = extract_tree_lnl(L_sk_k, Ns, model);
+          double lnl = extract_tree_lnl(L_sk_k, Ns, model, nstate, nscale);
           site_logL += lnl;
 
           // Get the likelihood table of MRCA node (with largest ID) in the tree from likelihood table
-          double max_ln = *max_element(L_sk_k[nid].begin(), L_sk_k[nid].end());
-          int state = distance(L_sk_k[nid].begin(), max_element(L_sk_k[nid].begin(), L_sk_k[nid].end()));
+          const double* L_mrca = L_sk_k + nid * nstate;
+          double max_ln = *max_element(L_mrca, L_mrca + nstate);
+          int state = distance(L_mrca, max_element(L_mrca, L_mrca + nstate));
           if(debug) cout << "\t\tState with maximum likelihood " << state << " at chr " << nchr << " site " << nc << endl;
           int cn = state;
           if(model == BOUNDA){
@@ -944,8 +940,8 @@ double reconstruct_marginal_ancestral_state(const evo_tree& rtree, map<int, vect
           cn_mrca.push_back(cn);
 
           string line = to_string(nid + 1) + "\t" + to_string(nchr) + "_" + to_string(nc) + "\t" + to_string(cn) + "\t" + to_string(max_ln);
-          for(int i = 0; i < L_sk_k[nid].size(); i++){
-              line += "\t" + to_string(L_sk_k[nid][i]);
+          for(int i = 0; i < nstate; i++){
+              line += "\t" + to_string(L_mrca[i]);
           }
           // fout << setprecision(dbl::max_digits10) << line << endl;
           fout << line << endl;
@@ -1116,32 +1112,40 @@ void reconstruct_joint_ancestral_state_decomp(const evo_tree& rtree, map<int, ve
 
     knodes.pop_back();  // no need to reconstruct root which is always normal
 
-    PMAT_DECOMP pmat_decomp = {pmats_wgd, pmats_chr, pmats_seg};
+    // the ancestral state reconstruction looks up the matrices by branch length, so the per-edge matrices are not set
+    PMAT_DECOMP pmat_decomp;
+    pmat_decomp.pmats_wgd = pmats_wgd;
+    pmat_decomp.pmats_chr = pmats_chr;
+    pmat_decomp.pmats_seg = pmats_seg;
 
+    int dim_table = ntotn * nstate;
+    LNL_BUFFER lnl_buffer;
+    double* L_sk_k = lnl_buffer.reserve(ntotn, nstate);
+    vector<int> S_sk_k(dim_table, 0);
     for(int nchr = 1; nchr <= vobs.size(); nchr++){     // for each chromosome
       if(debug) cout << "Computing likelihood on Chr " << nchr << " with " << vobs[nchr].size() << " sites " << endl;
-      map<vector<int>, vector<vector<double>>> sites_lnl_map;
+      // Use a map to store computed likelihood and state tables
+      map<vector<int>, pair<vector<double>, vector<int>>> sites_lnl_map;
       for(int nc = 0; nc < vobs[nchr].size(); nc++){    // for each segment on the chromosome
           if(debug) cout << "\tfor site " << nc << " on chromosome " << nchr << endl;
           // for each site of the chromosome (may be repeated)
           vector<int> obs = vobs[nchr][nc];
-          vector<vector<double>> L_sk_k(ntotn, vector<double>(nstate,0));
-          vector<vector<int>> S_sk_k(ntotn, vector<int>(nstate,0));
-          if(use_repeat){
-              if(sites_lnl_map.find(obs) == sites_lnl_map.end()){
-                  initialize_asr_table_decomp(obs, rtree, comps, max_decomp, pmat_decomp, L_sk_k, S_sk_k, nstate, is_total);
-                  get_ancestral_states_site_decomp(L_sk_k, S_sk_k, rtree, knodes, comps, pmat_decomp, dim_decomp, nstate);
-              }else{
-                  if(debug) cout << "\t\tsites repeated" << endl;
-                  L_sk_k = sites_lnl_map[obs];
-              }
+          if(use_repeat && sites_lnl_map.find(obs) != sites_lnl_map.end()){
+              if(debug) cout << "\t\tsites repeated" << endl;
+              copy(sites_lnl_map[obs].first.begin(), sites_lnl_map[obs].first.end(), L_sk_k);
+              S_sk_k = sites_lnl_map[obs].second;
           }else{
-              initialize_asr_table_decomp(obs, rtree, comps, max_decomp, pmat_decomp, L_sk_k, S_sk_k, nstate, is_total);
-              get_ancestral_states_site_decomp(L_sk_k, S_sk_k, rtree, knodes, comps, pmat_decomp, dim_decomp, nstate);
+              fill(L_sk_k, L_sk_k + dim_table, 0.0);
+              fill(S_sk_k.begin(), S_sk_k.end(), 0);
+              initialize_asr_table_decomp(obs, rtree, comps, max_decomp, pmat_decomp, L_sk_k, S_sk_k.data(), nstate, is_total);
+              get_ancestral_states_site_decomp(L_sk_k, S_sk_k.data(), rtree, knodes, comps, pmat_decomp, dim_decomp, nstate);
+              if(use_repeat){
+                  sites_lnl_map[obs] = make_pair(vector<double>(L_sk_k, L_sk_k + dim_table), S_sk_k);
+              }
           }
 
           map<int, int> asr_states;
-          map<int, vector<int>> asr_cns = extract_tree_ancestral_state(rtree, comps, L_sk_k, S_sk_k, DECOMP, cn_max, is_total, m_max, asr_states);
+          map<int, vector<int>> asr_cns = extract_tree_ancestral_state(rtree, comps, L_sk_k, S_sk_k.data(), DECOMP, cn_max, is_total, m_max, nstate, asr_states);
           for(int nid = max_id; nid > Ns + 1; nid--){
               vector<int> cns = asr_cns[nid];
               int state = asr_states[nid];
@@ -1151,9 +1155,9 @@ void reconstruct_joint_ancestral_state_decomp(const evo_tree& rtree, map<int, ve
               }else{
                 line += "\t" + to_string(cns[0]);
               }
-              line += "\t" + to_string(state) + "\t" + to_string(pow(10, L_sk_k[nid][state]));
-              for(int i = 0; i < L_sk_k[nid].size(); i++){
-                  line += "\t" + to_string(pow(10, L_sk_k[nid][i]));
+              line += "\t" + to_string(state) + "\t" + to_string(pow(10, L_sk_k[nid * nstate + state]));
+              for(int i = 0; i < nstate; i++){
+                  line += "\t" + to_string(pow(10, L_sk_k[nid * nstate + i]));
               }
               // fout << setprecision(dbl::max_digits10) << line << endl;
               fout << line << endl;
@@ -1205,37 +1209,42 @@ void reconstruct_joint_ancestral_state(const evo_tree& rtree, map<int, vector<ve
     // map<double, double*> pmats;
     vector<double> blens;
     vector<double*> pmat_per_blen;
+    vector<int> blen_per_edge;
 
-    set_pmat(rtree, Ns, nstate, model, cn_max, knodes, blens, pmat_per_blen, fout);
+    set_pmat(rtree, Ns, nstate, model, cn_max, knodes, blens, pmat_per_blen, blen_per_edge, fout);
 
     knodes.pop_back();  // no need to reconstruct root which is always normal
     int max_id = 2 * (rtree.nleaf - 1);
+    int dim_table = ntotn * nstate;
+    LNL_BUFFER lnl_buffer;
+    double* L_sk_k = lnl_buffer.reserve(ntotn, nstate);
+    vector<int> S_sk_k(dim_table, 0);
     double logL = 0.0;    // for all chromosmes
     for(int nchr = 1; nchr <= vobs.size(); nchr++){     // for each chromosome
       if(debug) cout << "Computing likelihood on Chr " << nchr << " with " << vobs[nchr].size() << " sites " << endl;
-      map<vector<int>, vector<vector<double>>> sites_lnl_map;
+      // Use a map to store computed likelihood and state tables
+      map<vector<int>, pair<vector<double>, vector<int>>> sites_lnl_map;
       for(int nc = 0; nc < vobs[nchr].size(); nc++){    // for each segment on the chromosome
           if(debug) cout << "\tfor site " << nc << " on chromosome " << nchr << endl;
           // for each site of the chromosome (may be repeated)
           vector<int> obs = vobs[nchr][nc];
-          vector<vector<double>> L_sk_k(ntotn, vector<double>(nstate,0));
-          vector<vector<int>> S_sk_k(ntotn, vector<int>(nstate,0));
-          if(use_repeat){
-              if(sites_lnl_map.find(obs) == sites_lnl_map.end()){
-                  initialize_asr_table(obs, rtree, blens, pmat_per_blen, L_sk_k, S_sk_k, model, nstate, is_total);
-                  get_ancestral_states_site(L_sk_k, S_sk_k, rtree, knodes, blens, pmat_per_blen, nstate, model);
-              }else{
-                  if(debug) cout << "\t\tsites repeated" << endl;
-                  L_sk_k = sites_lnl_map[obs];
-              }
+          if(use_repeat && sites_lnl_map.find(obs) != sites_lnl_map.end()){
+              if(debug) cout << "\t\tsites repeated" << endl;
+              copy(sites_lnl_map[obs].first.begin(), sites_lnl_map[obs].first.end(), L_sk_k);
+              S_sk_k = sites_lnl_map[obs].second;
           }else{
-              initialize_asr_table(obs, rtree, blens, pmat_per_blen, L_sk_k, S_sk_k, model, nstate, is_total);
-              get_ancestral_states_site(L_sk_k, S_sk_k, rtree, knodes, blens, pmat_per_blen, nstate, model);
+              fill(L_sk_k, L_sk_k + dim_table, 0.0);
+              fill(S_sk_k.begin(), S_sk_k.end(), 0);
+              initialize_asr_table(obs, rtree, blen_per_edge, pmat_per_blen, L_sk_k, S_sk_k.data(), model, nstate, is_total);
+              get_ancestral_states_site(L_sk_k, S_sk_k.data(), rtree, knodes, blen_per_edge, pmat_per_blen, nstate, model);
+              if(use_repeat){
+                  sites_lnl_map[obs] = make_pair(vector<double>(L_sk_k, L_sk_k + dim_table), S_sk_k);
+              }
           }
 
           map<int, int> asr_states;     // The state ID used in rate matrix
           set<vector<int>> comps;  // empty containtor for argument
-          map<int, vector<int>> asr_cns = extract_tree_ancestral_state(rtree, comps, L_sk_k, S_sk_k, model, cn_max, is_total, m_max, asr_states);
+          map<int, vector<int>> asr_cns = extract_tree_ancestral_state(rtree, comps, L_sk_k, S_sk_k.data(), model, cn_max, is_total, m_max, nstate, asr_states);
           for(int nid = max_id; nid > Ns + 1; nid--){
               vector<int> cns = asr_cns[nid];
               int state = asr_states[nid];
@@ -1245,9 +1254,9 @@ void reconstruct_joint_ancestral_state(const evo_tree& rtree, map<int, vector<ve
               }else{
                 line += "\t" + to_string(cns[0]);
               }
-              line += "\t" + to_string(state) + "\t" + to_string(pow(10, L_sk_k[nid][state]));
-              for(int i = 0; i < L_sk_k[nid].size(); i++){
-                  line += "\t" + to_string(pow(10, L_sk_k[nid][i]));
+              line += "\t" + to_string(state) + "\t" + to_string(pow(10, L_sk_k[nid * nstate + state]));
+              for(int i = 0; i < nstate; i++){
+                  line += "\t" + to_string(pow(10, L_sk_k[nid * nstate + i]));
               }
               fout << line << endl;
           }
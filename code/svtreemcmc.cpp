@@ -2130,6 +2130,7 @@ int main (int argc, char ** const argv) {
             ("fix_topology", po::value<int>(&fix_topology)->default_value(0), "whether or not to fix the topology of the tree")
             ("cons", po::value<int>(&cons)->default_value(1), "constraints on branch length (0: none, 1: fixed total time)")
             ("maxj", po::value<int>(&maxj)->default_value(1), "estimation of mutation rate (0: mutation rate fixed to be the given value, 1: estimating mutation rate)")
+            ("use_repeat", po::value<int>(&use_repeat)->default_value(1), "whether or not to use repeated site patterns when computing the likelihood")
             ("correct_bias", po::value<int>(&correct_bias)->default_value(1), "correct ascertainment bias")
 
             ("init_tree", po::value<int>(&init_tree)->default_value(0), "method of building inital tree for MCMC sampling (0: Random coalescence tree, 1: Provided tree, 2: Tree with the same topology as the true tree)")
@@ -2377,8 +2378,15 @@ int main (int argc, char ** const argv) {
 
     max_tobs = *max_element(tobs.begin(), tobs.end());
     lnl_type = {model, cn_max, is_total, cons, max_tobs, age, use_repeat, correct_bias, num_invar_bins, only_seg, infer_wgd, infer_chr, knodes};
+    if(use_repeat){
+        int num_pattern = get_site_patterns_by_chr(vobs, lnl_type.site_pattern);
+        cout << "   Number of unique site patterns is " << num_pattern << endl;
+    }
 
     obs_decomp = {m_max, max_wgd, max_chr_change, max_site_change, obs_num_wgd, obs_change_chr};
+    if(model == DECOMP){
+        build_tip_lnl_decomp(obs_decomp, comps, infer_wgd, infer_chr, cn_max);
+    }
 
     vector<double> ref_rates;
     if(model == MK){
@@ -112,7 +112,8 @@ long unsigned (*fp_myrng)(long unsigned);
 
 
 // Randomly pick a tree to perturb by ordering string representation of the tree
-evo_tree perturb_tree_set(vector<evo_tree>& trees, gsl_rng* r, long unsigned (*fp_myrng)(long unsigned)){
+// pid: index of the tree perturbed
+evo_tree perturb_tree_set(vector<evo_tree>& trees, gsl_rng* r, long unsigned (*fp_myrng)(long unsigned), int& pid){
     int debug = 0;
     if(debug) cout << "\tperturb a set of trees" << endl;
 
@@ -120,6 +121,7 @@ evo_tree perturb_tree_set(vector<evo_tree>& trees, gsl_rng* r, long unsigned (*f
     while(true){
         // randomly sample the fit population
         int ind = gsl_rng_uniform_int(r, trees.size());
+        pid = ind;
 
         // generate a new tree
         evo_tree ttree = perturb_tree(trees[ind], fp_myrng);
@@ -290,8 +292,10 @@ void do_exhaustive_search(evo_tree& min_nlnl_tree, string real_tstring, int Ngen
     vector<double> lnLs(max_tree_num, 0.0);
     vector<int> index(max_tree_num, 0);
 
+    // each tree is optimized before it is scored, so it is not scored with get_likelihood_revised_batch, whose trees share the same rates
+    // each thread has its own copy of lnl_type, as the partial likelihoods in lnl_type.lnl_cache are updated in each likelihood computation
     #ifdef _OPENMP
-    #pragma omp parallel for
+    #pragma omp parallel for firstprivate(lnl_type)
     #endif
     for(int i = 0; i < max_tree_num; ++i){
         string tstring = order_tree_string_uniq(create_tree_string_uniq(init_trees[i]));
@@ -366,8 +370,12 @@ void do_hill_climbing(evo_tree& min_nlnl_tree, int Npop, int Ngen, int init_tree
     cout << "\tInitial number of trees " << num2init << endl;
 
     // no topolgy change
+    // screen the initial trees with loose tolerances, only the selected ones are optimized fully
+    OPT_TYPE opt_screen = opt_type;
+    opt_screen.screen = 1;
+    // each thread has its own copy of lnl_type, as the partial likelihoods in lnl_type.lnl_cache are updated in each likelihood computation
     #ifdef _OPENMP
-    #pragma omp parallel for
+    #pragma omp parallel for firstprivate(lnl_type)
     #endif
     for(int i = 0; i < num2init; ++i){
         double nlnl = MAX_NLNL;
@@ -380,7 +388,7 @@ void do_hill_climbing(evo_tree& min_nlnl_tree, int Npop, int Ngen, int init_tree
         }else{
             while(!(nlnl < MAX_NLNL)){
                 nlnl = MAX_NLNL;
-                max_likelihood_BFGS(trees[i], vobs, obs_decomp, comps, lnl_type, opt_type, nlnl);
+                max_likelihood_BFGS(trees[i], vobs, obs_decomp, comps, lnl_type, opt_screen, nlnl);
             }
         }
         trees[i].score = -nlnl;
@@ -400,6 +408,18 @@ void do_hill_climbing(evo_tree& min_nlnl_tree, int Npop, int Ngen, int init_tree
 
     cout << "\tNumber of trees to perturb for hill climbing NNIs " << num2perturb << endl;
 
+    // finish the optimization of the screened trees with the full tolerances, starting from their own parameters
+    if(optim == 1){
+        #ifdef _OPENMP
+        #pragma omp parallel for firstprivate(lnl_type)
+        #endif
+        for(int i = 0; i < num2perturb; ++i){
+            double nlnl = MAX_NLNL;
+            max_likelihood_BFGS(trees2[i], vobs, obs_decomp, comps, lnl_type, opt_type, nlnl);
+            trees2[i].score = -nlnl;
+        }
+    }
+
     // Perturb trees randomly (NNI may be disturbed by openmp due to use of pointers)
     // #ifdef _OPENMP
     // #pragma omp parallel for
@@ -494,6 +514,8 @@ void do_evolutionary_algorithm(evo_tree& min_nlnl_tree, const int& Npop, const i
   // create initial population of trees. Sample from coalescent trees
   vector<evo_tree> trees = get_initial_trees(init_tree, dir_itrees, Npop, rates, Npop, Ne, beta, gtime);
   vector<double> lnLs(2 * Npop, 0);
+  // BFGS sessions of trees, used to warm-start the optimization of the trees perturbed from them
+  vector<BFGS_SESSION> sessions(Npop);
   double min_nlnl = MAX_NLNL;
   double nlnl = 0;
   int count_static = 0;
@@ -503,15 +525,22 @@ void do_evolutionary_algorithm(evo_tree& min_nlnl_tree, const int& Npop, const i
     // The top scoring trees have already been scored and optimised
     vector<evo_tree> new_trees;
     vector<evo_tree> opt_trees;
+    vector<BFGS_SESSION> opt_sessions(2 * Npop);
 
     if( g == 0 ){
       for(int i = 0; i < Npop; ++i){
 	         new_trees.push_back(trees[i]);
       }
+      vector<evo_tree> perturbed_trees;
+      for(int i = 0; i < Npop; ++i){
+          int pid = 0;
+          perturbed_trees.push_back(perturb_tree_set(trees, r, fp_myrng, pid));
+      }
+      // score all the perturbed trees in one pass over the data
+      vector<double> scores = get_likelihood_revised_batch(perturbed_trees, vobs, lnl_type);
       for(int i = 0; i < Npop; ++i){
-          evo_tree new_tree = perturb_tree_set(trees, r, fp_myrng);
-          new_tree.score = get_likelihood_revised(new_tree, vobs, lnl_type);
-    	    new_trees.push_back(new_tree);
+          perturbed_trees[i].score = scores[i];
+    	    new_trees.push_back(perturbed_trees[i]);
       }
 
       // Selection: score all the trees in new_trees (all got maximized)
@@ -520,7 +549,7 @@ void do_evolutionary_algorithm(evo_tree& min_nlnl_tree, const int& Npop, const i
            max_likelihood(new_trees[i], vobs, tobs, lnl_type, opt_type, nlnl, ssize);
         }
         if(optim == 1){
-           max_likelihood_BFGS(new_trees[i], vobs, obs_decomp, comps, lnl_type, opt_type, nlnl);
+           max_likelihood_BFGS(new_trees[i], vobs, obs_decomp, comps, lnl_type, opt_type, nlnl, &opt_sessions[i]);
         }
         new_trees[i].score = -nlnl;
         // cout << "otree tobs " << otree.tobs[0] << endl;
@@ -536,24 +565,35 @@ void do_evolutionary_algorithm(evo_tree& min_nlnl_tree, const int& Npop, const i
           for(int i = 0; i < Npop; ++i){
           	new_trees.push_back(trees[i]);
           	opt_trees.push_back(trees[i]);
+          	opt_sessions[i] = sessions[i];
           	lnLs[i] = new_trees[i].score;
           }
 
           // cout << "Size of new_trees " << new_trees.size() << endl;
           // cout << "Size of opt_trees " << new_trees.size() << endl;
 
-          // Perturb this subpopulation
+          // Perturb this subpopulation, and score all the perturbed trees in one pass over the data
+          vector<evo_tree> perturbed_trees;
+          vector<int> parents;
           for(int i = 0; i < Npop; ++i){
-            evo_tree new_tree = perturb_tree_set(trees, r, fp_myrng);
-            new_tree.score = get_likelihood_revised(new_tree, vobs, lnl_type);
-      	    new_trees.push_back(new_tree);
+              int pid = 0;
+              perturbed_trees.push_back(perturb_tree_set(trees, r, fp_myrng, pid));
+              parents.push_back(pid);
+          }
+          vector<double> scores = get_likelihood_revised_batch(perturbed_trees, vobs, lnl_type);
+
+          for(int i = 0; i < Npop; ++i){
+            perturbed_trees[i].score = scores[i];
+      	    new_trees.push_back(perturbed_trees[i]);
             // new_trees of size 2 Npop
             if(optim == 0){
         	    max_likelihood(new_trees[Npop + i], vobs, tobs, lnl_type, opt_type, nlnl, ssize);
             }
             if(optim == 1){
                 // new_trees[Npop + i].print();
-                max_likelihood_BFGS(new_trees[Npop + i], vobs, obs_decomp, comps, lnl_type, opt_type, nlnl);
+                // start from the optimized parameters and L-BFGS-B memory of the parent tree on the edges shared with it
+                opt_sessions[Npop + i] = sessions[parents[i]];
+                max_likelihood_BFGS_warm(new_trees[Npop + i], vobs, obs_decomp, comps, lnl_type, opt_type, opt_sessions[Npop + i], nlnl);
             }
         	new_trees[Npop + i].score = -nlnl;
             // cout << "otree tobs " << otree.tobs[0] << endl;
@@ -584,6 +624,7 @@ void do_evolutionary_algorithm(evo_tree& min_nlnl_tree, const int& Npop, const i
     // Selection: select top half
     for(int i = 0; i < Npop; ++i){
       trees[i] = opt_trees[ index[i] ];
+      sessions[i] = opt_sessions[ index[i] ];
     }
 
     // Selection: record the best (lowest) scoring tree
@@ -916,6 +957,13 @@ void find_ML_tree(string real_tstring, int total_chr, int num_total_bins, string
         do_exhaustive_search(min_nlnl_tree, real_tstring, Ngen, init_tree, dir_itrees, max_static, rates, ssize, tolerance, miter, optim, Ne, beta, gtime);
     }
 
+    if(lnl_type.use_float){
+        lnl_type.use_float = 0;
+        min_nlnl_tree.score = get_likelihood_revised(min_nlnl_tree, vobs, lnl_type);
+        cout.precision(dbl::max_digits10);
+        cout << "Log likelihood of the final tree in double precision " << min_nlnl_tree.score << endl;
+    }
+
     if(debug) cout << "Writing results ......" << endl;
     // Write out the top tree
     cout.precision(PRINT_PRECISION);
@@ -1012,6 +1060,7 @@ int main(int argc, char** const argv){
     string datafile, timefile, ofile, tree_file, dir_itrees;
     int is_bin, incl_all;
     int infer_marginal_state, infer_joint_state;
+    int use_float, check_float;
     double min_asr;
 
     namespace po = boost::program_options;
@@ -1060,6 +1109,8 @@ int main(int argc, char** const argv){
 
     ("use_repeat", po::value<int>(&use_repeat)->default_value(1), "whether or not to use repeated site patterns when computing the likelihood")
     ("correct_bias", po::value<int>(&correct_bias)->default_value(1), "correct ascertainment bias")
+    ("use_float", po::value<int>(&use_float)->default_value(0), "whether or not to compute the partial likelihoods in single precision when searching tree space (only for model 1 and 2). The likelihood of the final tree is computed in double precision")
+    ("check_float", po::value<int>(&check_float)->default_value(0), "whether or not to report the difference between the likelihoods of the input tree in single and double precision (only for model 1 and 2)")
 
     // options related to inferring ancestry state
     ("infer_marginal_state", po::value<int>(&infer_marginal_state)->default_value(1), "whether or not to infer marginal ancestral state of MRCA")
@@ -1235,7 +1286,7 @@ int main(int argc, char** const argv){
 
     vobs = get_obs_vector_by_chr(data, Ns);
 
-    if(model == MK)   mu = 1 / Nchar;
+    if(model == MK)   mu = 1.0 / Nchar;
     vector<double> rates{mu, dup_rate, del_rate, chr_gain_rate, chr_loss_rate, wgd_rate};
 
     // nodes are in an order suitable for dynamic programming (lower nodes at first, which may be changed after topolgy change)
@@ -1264,8 +1315,15 @@ int main(int argc, char** const argv){
 
     max_tobs = *max_element(tobs.begin(), tobs.end());
     lnl_type = {model, cn_max, is_total, cons, max_tobs, age, use_repeat, correct_bias, num_invar_bins, only_seg, infer_wgd, infer_chr, knodes};
+    if(use_repeat){
+        int num_pattern = get_site_patterns_by_chr(vobs, lnl_type.site_pattern);
+        cout << "   Number of unique site patterns is " << num_pattern << endl;
+    }
 
     obs_decomp = {m_max, max_wgd, max_chr_change, max_site_change, obs_num_wgd, obs_change_chr};
+    if(model == DECOMP){
+        build_tip_lnl_decomp(obs_decomp, comps, infer_wgd, infer_chr, cn_max);
+    }
 
     int opt_one_branch = 0; // optimize all branches by default
     opt_type = {maxj, tolerance, miter, opt_one_branch};
@@ -1293,6 +1351,13 @@ int main(int argc, char** const argv){
       }
       cout.precision(dbl::max_digits10);
       cout << "The log likelihood for real tree is: " << Ls << endl;
+
+      if(check_float && (model == BOUNDT || model == BOUNDA)){
+          double max_site_diff = 0.0;
+          double diff = check_lnl_float(real_tree, vobs, lnl_type, max_site_diff);
+          cout << "Difference of the log likelihood in single precision from that in double precision: " << diff << endl;
+          cout << "Maximum difference of the log likelihood of a site pattern: " << max_site_diff << endl;
+      }
     }
 
     if(mode == 0){
@@ -1306,6 +1371,10 @@ int main(int argc, char** const argv){
       if(bootstrap){
           cout << "\nDoing bootstapping " << endl;
           get_bootstrap_vector_by_chr(data, vobs, r);
+          if(use_repeat){
+              get_site_patterns_by_chr(vobs, lnl_type.site_pattern);
+          }
+          lnl_type.data_version++;   // partial likelihoods were computed for the original sites
           if(debug){
               cout << " Copy number matrix after bootstapping" << endl;
               for(auto it : vobs){
@@ -1315,6 +1384,10 @@ int main(int argc, char** const argv){
       }
       cout << "\nNumber of invariant bins after reading input is: " << num_invar_bins << endl;
       int total_chr = data.rbegin()->first;
+      if(use_float && (model == BOUNDT || model == BOUNDA)){
+          cout << "   Computing partial likelihoods in single precision during tree search " << endl;
+          lnl_type.use_float = 1;
+      }
       find_ML_tree(real_tstring, total_chr, num_total_bins, ofile, tree_search, Npop, Ngen, init_tree, dir_itrees, max_static, ssize, tolerance, miter, optim, rates, Ne, beta, gtime);
 
     }else if(mode == 1){